@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../src/dce.hpp"
+#include "../src/encoder.hpp"
+#include "../src/folding.hpp"
+#include "../src/generation.hpp"
+#include "../src/licm.hpp"
+#include "../src/lowering.hpp"
+#include "../src/parser.hpp"
+#include "../src/peephole.hpp"
+#include "../src/tokenization.hpp"
+#include "./program_generator.hpp"
+
+// Compiles every shape of synthetic program at a small and a large size and
+// compares the time per token of each pass. A pass whose cost per token grows
+// by more than the allowed ratio between the two sizes is not linear and
+// fails the run; an absolute throughput floor can be set on top of that.
+
+namespace
+{
+    constexpr std::array<std::string_view, 8> pass_names{"tokenize", "parse", "lower", "dce", "licm", "gen", "peephole", "encode"};
+
+    struct Sample
+    {
+        size_t tokens = 0;
+        std::array<double, pass_names.size()> seconds{};
+    };
+
+    template <typename Pass>
+    double time_pass(Pass &&pass)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        pass();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Fastest of several runs, which is the least disturbed by the rest of the machine
+    Sample measure(const std::string &src, const int runs)
+    {
+        Sample best;
+        best.seconds.fill(std::numeric_limits<double>::infinity());
+        for (int run = 0; run < runs; run++)
+        {
+            Sample sample;
+            sample.seconds[0] = time_pass([&]
+                                          {
+                                              Interner interner;
+                                              Tokenizer tokenizer(src, interner);
+                                              sample.tokens = tokenizer.tokenize().size(); });
+
+            // Parsing pulls its tokens from the tokenizer, so this includes lexing
+            Interner interner;
+            Tokenizer tokenizer(src, interner);
+            Parser parser(tokenizer);
+            std::optional<node::NodeProg> prog;
+            sample.seconds[1] = time_pass([&]
+                                          { prog = parser.parse_prog(); });
+
+            ir::Function fn;
+            sample.seconds[2] = time_pass([&]
+                                          {
+                                              ConstantFolder(prog.value()).fold_prog();
+                                              fn = Lowering(prog.value(), interner).lower(); });
+            // The synthetic programs are all constants and would be folded
+            // away, the backend is timed on the IR as lowered
+            ir::Function eliminated = fn;
+            sample.seconds[3] = time_pass([&]
+                                          { DeadCodeEliminator(eliminated).run(); });
+            sample.seconds[4] = time_pass([&]
+                                          { LoopInvariantCodeMotion(eliminated).run(); });
+            std::vector<Instr> instrs;
+            sample.seconds[5] = time_pass([&]
+                                          { instrs = Generator(fn).gen_prog(); });
+            sample.seconds[6] = time_pass([&]
+                                          { Peephole().optimize(instrs); });
+            sample.seconds[7] = time_pass([&]
+                                          { [[maybe_unused]] const auto code = Encoder().encode(instrs); });
+
+            best.tokens = sample.tokens;
+            for (size_t i = 0; i < pass_names.size(); i++)
+            {
+                best.seconds[i] = std::min(best.seconds[i], sample.seconds[i]);
+            }
+        }
+        return best;
+    }
+
+    size_t base_size(const Shape shape)
+    {
+        switch (shape)
+        {
+        case Shape::let_chain:
+            return 2000;
+        case Shape::wide_expr:
+            return 1000;
+        case Shape::while_loops:
+            // Smaller programs keep the IR in cache, which makes the large
+            // size look superlinear
+            return 1000;
+        case Shape::nested_scopes:
+        case Shape::if_ladder:
+        case Shape::deep_expr:
+            // The passes recurse once per level
+            break;
+        }
+        return 250;
+    }
+
+    void usage()
+    {
+        std::cerr << "hydro_bench [--scale N] [--growth N] [--max-ratio R] [--min-tokens-per-sec N] [--runs N]" << std::endl;
+        std::cerr << "hydro_bench --emit <shape> <size>" << std::endl;
+        std::cerr << "shapes:";
+        for (const auto &[name, shape] : shapes)
+        {
+            std::cerr << " " << name;
+        }
+        std::cerr << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    double scale = 1;
+    size_t growth = 8;
+    double max_ratio = 3;
+    double min_tokens_per_sec = 0;
+    int runs = 5;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string_view arg = argv[i];
+        if (arg == "--emit" && i + 2 < argc)
+        {
+            const std::optional<Shape> shape = find_shape(argv[i + 1]);
+            if (!shape.has_value())
+            {
+                usage();
+                return EXIT_FAILURE;
+            }
+            std::cout << generate_program(shape.value(), std::stoul(argv[i + 2]));
+            return EXIT_SUCCESS;
+        }
+        if (i + 1 == argc)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--scale")
+        {
+            scale = std::stod(value);
+        }
+        else if (arg == "--growth")
+        {
+            growth = std::stoul(value);
+        }
+        else if (arg == "--max-ratio")
+        {
+            max_ratio = std::stod(value);
+        }
+        else if (arg == "--min-tokens-per-sec")
+        {
+            min_tokens_per_sec = std::stod(value);
+        }
+        else if (arg == "--runs")
+        {
+            runs = std::stoi(value);
+        }
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool failed = false;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::left << std::setw(15) << "shape" << std::right << std::setw(8) << "tokens";
+    for (const std::string_view name : pass_names)
+    {
+        std::cout << std::setw(11) << name;
+    }
+    std::cout << std::setw(13) << "Mtok/s" << "   (ns per token)" << std::endl;
+    for (const auto &[name, shape] : shapes)
+    {
+        const auto small_size = std::max<size_t>(1, static_cast<size_t>(static_cast<double>(base_size(shape)) * scale));
+        std::array<Sample, 2> samples;
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            const std::string src = generate_program(shape, i == 0 ? small_size : small_size * growth);
+            samples[i] = measure(src, runs);
+
+            std::cout << std::left << std::setw(15) << name << std::right << std::setw(8) << samples[i].tokens;
+            for (const double seconds : samples[i].seconds)
+            {
+                std::cout << std::setw(11) << seconds * 1e9 / static_cast<double>(samples[i].tokens);
+            }
+            // Lexing is already part of parse
+            double total = 0;
+            for (size_t pass = 1; pass < pass_names.size(); pass++)
+            {
+                total += samples[i].seconds[pass];
+            }
+            const double tokens_per_sec = static_cast<double>(samples[i].tokens) / total;
+            std::cout << std::setw(13) << tokens_per_sec / 1e6 << std::endl;
+            if (tokens_per_sec < min_tokens_per_sec)
+            {
+                std::cout << "FAIL " << name << ": " << tokens_per_sec << " tokens/s is below " << min_tokens_per_sec << std::endl;
+                failed = true;
+            }
+        }
+
+        for (size_t pass = 0; pass < pass_names.size(); pass++)
+        {
+            const double small = samples[0].seconds[pass] / static_cast<double>(samples[0].tokens);
+            const double large = samples[1].seconds[pass] / static_cast<double>(samples[1].tokens);
+            if (large > small * max_ratio)
+            {
+                std::cout << "FAIL " << name << ": " << pass_names[pass] << " takes " << large / small
+                          << "x longer per token on a " << growth << "x larger program" << std::endl;
+                failed = true;
+            }
+        }
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "../src/driver.hpp"
+
+// Start-to-result latency of the ways to run a program: interpreting its
+// bytecode (--interp), running the native code in-process (--run) and
+// writing the executable, starting it and waiting for its exit. Every tier
+// goes through the whole Compiler, from reading the source to the exit
+// status, and all of them have to agree on that status.
+
+extern char **environ;
+
+namespace
+{
+    struct Program
+    {
+        std::string_view name;
+        std::string source;
+    };
+
+    std::string loop(const size_t iterations)
+    {
+        std::string src = "let i = 0;\nlet s = 0;\n";
+        src += "while (i < " + std::to_string(iterations) + ") {\n";
+        src += "    s = s + i / 3 * 5;\n    i = i + 1;\n}\n";
+        src += "exit(s);\n";
+        return src;
+    }
+
+    std::array<Program, 5> programs()
+    {
+        return {{
+            {"exit", "exit(42);\n"},
+            {"script", "let a = 7;\nlet b = a * 6 - 2;\n"
+                       "if (b > 30) {\n    a = a + b / 4;\n}\nelif (b == 0) {\n    exit(1);\n}\nelse {\n    a = 0;\n}\n"
+                       "let c = (a + b) * (b - a) / 3;\n"
+                       "if (c != 100) {\n    c = c + 1;\n}\nexit(a + b + c);\n"},
+            {"loop_1k", loop(1000)},
+            {"loop_1m", loop(1000000)},
+            {"array_64k", "let a = [3; 65536];\nlet b = [0; 65536];\nlet i = 0;\n"
+                          "while (i < 16) {\n    b = b + a * i - 1;\n    i = i + 1;\n}\nexit(b[65535] + b[0]);\n"},
+        }};
+    }
+
+    enum class Tier
+    {
+        interp,
+        run,
+        exec
+    };
+
+    constexpr std::array<std::pair<std::string_view, Tier>, 3> tiers{{
+        {"interp", Tier::interp},
+        {"run", Tier::run},
+        {"exec", Tier::exec},
+    }};
+
+    int spawn(const std::string &path)
+    {
+        char *argv[] = {const_cast<char *>(path.c_str()), nullptr};
+        pid_t pid = 0;
+        if (posix_spawn(&pid, path.c_str(), nullptr, nullptr, argv, environ) != 0)
+        {
+            throw CompileError("unable to start ", path);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+
+    // The exit status of the program and the seconds it took to get it
+    std::pair<int, double> measure(Compiler &compiler, const CompileJob &job, const Tier tier)
+    {
+        CompileOptions options;
+        options.interp = tier == Tier::interp;
+        options.run = tier == Tier::run;
+        std::ostringstream discarded;
+        const auto start = std::chrono::steady_clock::now();
+        const std::optional<int> status = compiler.compile(job, options, discarded, discarded);
+        const int result = tier == Tier::exec ? spawn(job.output) : status.value();
+        return {result, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()};
+    }
+
+    void usage()
+    {
+        std::cerr << "hydro_interp_bench [--runs N]" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string_view arg = argv[i];
+        if (arg == "--runs" && i + 1 < argc)
+        {
+            runs = std::stoi(argv[++i]);
+        }
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    const std::filesystem::path dir = std::filesystem::temp_directory_path() / ("hydro_interp_bench." + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+    bool failed = false;
+    Compiler compiler;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::left << std::setw(12) << "program" << std::right;
+    for (const auto &[name, tier] : tiers)
+    {
+        std::cout << std::setw(12) << name;
+    }
+    std::cout << "   (us from source to exit status)" << std::endl;
+    try
+    {
+        for (const Program &program : programs())
+        {
+            const std::string path = (dir / program.name).string();
+            const CompileJob job{.input = path + ".hy", .output = path, .asm_output = path + ".asm", .ir_output = path + ".ir"};
+            std::ofstream(job.input) << program.source;
+
+            std::cout << std::left << std::setw(12) << program.name << std::right;
+            std::optional<int> expected;
+            for (const auto &[name, tier] : tiers)
+            {
+                // Fastest of several runs, which is the least disturbed by the rest of the machine
+                double best = std::numeric_limits<double>::infinity();
+                for (int run = 0; run < runs; run++)
+                {
+                    const auto [status, seconds] = measure(compiler, job, tier);
+                    best = std::min(best, seconds);
+                    if (expected.has_value() && status != expected.value())
+                    {
+                        std::cout << std::endl
+                                  << "FAIL " << program.name << ": " << name << " exits with " << status << " instead of "
+                                  << expected.value() << std::endl;
+                        failed = true;
+                        break;
+                    }
+                    expected = status;
+                }
+                std::cout << std::setw(12) << best * 1e6;
+            }
+            std::cout << std::endl;
+        }
+    }
+    catch (const CompileError &error)
+    {
+        std::cerr << error.what() << std::endl;
+        failed = true;
+    }
+    std::filesystem::remove_all(dir);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Synthetic Hydrogen programs that stress one dimension of the compiler each.
+// size is the number of repetitions of the shape's building block.
+enum class Shape
+{
+    let_chain,     // size lets, each reading the two before it
+    nested_scopes, // size scopes nested inside each other
+    if_ladder,     // one if followed by size elifs and an else
+    wide_expr,     // one expression with size operands
+    deep_expr,     // one expression nested size parens deep
+    while_loops    // size loops in a row, each with a loop nested inside
+};
+
+constexpr std::array<std::pair<std::string_view, Shape>, 6> shapes{{
+    {"let_chain", Shape::let_chain},
+    {"nested_scopes", Shape::nested_scopes},
+    {"if_ladder", Shape::if_ladder},
+    {"wide_expr", Shape::wide_expr},
+    {"deep_expr", Shape::deep_expr},
+    {"while_loops", Shape::while_loops},
+}};
+
+[[nodiscard]] inline std::optional<Shape> find_shape(const std::string_view name)
+{
+    for (const auto &[shape_name, shape] : shapes)
+    {
+        if (shape_name == name)
+        {
+            return shape;
+        }
+    }
+    return {};
+}
+
+[[nodiscard]] inline std::string generate_program(const Shape shape, const size_t size)
+{
+    std::string src = "let a = 1;\n";
+    // Operators cycle so every kind of binary expression shows up
+    constexpr std::array<std::string_view, 10> ops{" + ", " * ", " - ", " / ", " < ", " == ", " >= ",
+                                                   " != ", " <= ", " > "};
+    switch (shape)
+    {
+    case Shape::let_chain:
+        src += "let vb = a;\nlet vc = a + 2;\n";
+        for (size_t i = 0; i < size; i++)
+        {
+            const std::string name = "v" + std::to_string(i);
+            const std::string prev = i < 2 ? (i == 0 ? "vb" : "vc") : "v" + std::to_string(i - 2);
+            const std::string last = i < 1 ? "vc" : "v" + std::to_string(i - 1);
+            src += "let " + name + " = " + prev + " + " + last + " * 3;\n";
+            if (i % 8 == 7)
+            {
+                src += "a = a + " + name + ";\n";
+            }
+        }
+        break;
+    case Shape::nested_scopes:
+        for (size_t i = 0; i < size; i++)
+        {
+            src += "{\n    let s" + std::to_string(i) + " = a + " + std::to_string(i) + ";\n";
+            src += "    a = s" + std::to_string(i) + " - " + std::to_string(i) + ";\n";
+        }
+        src.append(size, '}');
+        src += '\n';
+        break;
+    case Shape::if_ladder:
+        src += "if (a == 1) {\n    a = 2;\n}\n";
+        for (size_t i = 0; i < size; i++)
+        {
+            src += "elif (a < " + std::to_string(i + 2) + ") {\n    a = a + " + std::to_string(i) + ";\n}\n";
+        }
+        src += "else {\n    a = 3;\n}\n";
+        break;
+    case Shape::wide_expr:
+        src += "let w = a";
+        for (size_t i = 0; i < size; i++)
+        {
+            src += ops[i % ops.size()];
+            src += i % 2 == 0 ? "a" : std::to_string(i % 7 + 1);
+            if (i % 16 == 15)
+            {
+                src += '\n';
+            }
+        }
+        src += ";\n";
+        break;
+    case Shape::deep_expr:
+        src += "let d = ";
+        for (size_t i = 0; i < size; i++)
+        {
+            src += "a";
+            src += ops[i % 2];
+            src += '(';
+        }
+        src += "a";
+        src.append(size, ')');
+        src += ";\n";
+        break;
+    case Shape::while_loops:
+        for (size_t i = 0; i < size; i++)
+        {
+            const std::string outer = "i" + std::to_string(i);
+            const std::string inner = "j" + std::to_string(i);
+            src += "let " + outer + " = 0;\nwhile (" + outer + " < 3) {\n";
+            src += "    let " + inner + " = 0;\n    while (" + inner + " < " + outer + ") {\n";
+            // The product does not change in the inner loop
+            src += "        a = a + " + outer + " * " + std::to_string(i + 2) + ";\n";
+            src += "        " + inner + " = " + inner + " + 1;\n    }\n";
+            src += "    " + outer + " = " + outer + " + 1;\n}\n";
+        }
+        break;
+    }
+    src += "exit(a / 256);\n";
+    return src;
+}
@@ -0,0 +1,535 @@
+#pragma once
+
+#include "./error.hpp"
+#include "./parser.hpp"
+#include "./symbol_table.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Register-based bytecode run by the Interpreter, compiled straight from the
+// syntax tree for programs that finish before the native backend would. A
+// frame holds the variables and temporaries; the constants are loaded into
+// the registers after it, so every operand is a register. An array takes
+// as many consecutive registers as it has elements.
+namespace bc
+{
+    using RegId = uint32_t;
+
+    enum class Opcode : uint8_t
+    {
+        mov, // a = b
+        add, // a = b op c
+        sub,
+        mul,
+        div,
+        eq,
+        ne,
+        lt,
+        le,
+        gt,
+        ge,
+        jmp, // to a
+        jz,  // to a if b is 0
+        jnz, // to a if b is not 0
+        jeq, // to a if b op c, the comparisons fused with a branch
+        jne,
+        jlt,
+        jle,
+        jgt,
+        jge,
+        exit,  // with b
+        load,  // a = element c of the array at b, trapping when out of bounds
+        store, // element b of the array at a = c, the same
+        vmov,  // every element of the array at a = that of b
+        vfill, // every element of a = b
+        vadd,  // every element of a = that of b op that of c
+        vsub,
+        vmul
+    };
+
+    constexpr size_t opcode_count = static_cast<size_t>(Opcode::vmul) + 1;
+
+    struct Instr
+    {
+        Opcode op;
+        uint32_t n : 24 = 0; // the length of the arrays
+        uint32_t a = 0;      // destination or jump target
+        RegId b = 0;
+        RegId c = 0;
+    };
+
+    static_assert(sizeof(Instr) == 16);
+
+    struct Program
+    {
+        std::vector<Instr> code;
+        std::vector<uint64_t> constants; // in the registers from frame_size on
+        uint32_t frame_size = 0;         // registers of the variables and temporaries
+    };
+}
+
+class BytecodeCompiler
+{
+public:
+    // prog has to outlive the compiler
+    BytecodeCompiler(const node::NodeProg &prog, const Interner &interner)
+        : m_prog(prog),
+          m_interner(interner)
+    {
+    }
+
+    // Throws CompileError for names that are undeclared or declared twice and
+    // for arrays used where they do not fit
+    [[nodiscard]] bc::Program compile()
+    {
+        m_lengths.assign(m_prog.has_arrays ? m_prog.exprs.size() : 0, unknown_length);
+        compile_scope(m_prog.root);
+        // Falling off the end of the program exits with 0
+        emit({.op = bc::Opcode::exit, .b = constant(0)});
+        // Constants were numbered on their own until the frame size is known
+        for (bc::Instr &instr : m_program.code)
+        {
+            relocate(instr.b);
+            relocate(instr.c);
+        }
+        return std::move(m_program);
+    }
+
+private:
+    // Marks the register operands that are still constant indices
+    static constexpr bc::RegId constant_flag = 1u << 31;
+
+    // The number of the instruction a jump goes to, patched in once known
+    using Jump = size_t;
+    static constexpr Jump no_jump = SIZE_MAX;
+
+    void compile_scope(const node::ScopeId scope)
+    {
+        m_vars.begin_scope();
+        // The variables of the scope are freed with it
+        const bc::RegId first_free = m_next;
+        for (const node::StmtId stmt : m_prog.body(scope))
+        {
+            compile_stmt(stmt);
+        }
+        m_next = first_free;
+        m_vars.end_scope();
+    }
+
+    void compile_stmt(const node::StmtId id)
+    {
+        const node::NodeStmt &stmt = m_prog.stmts[id];
+        switch (stmt.kind)
+        {
+        case node::StmtKind::exit:
+        {
+            const bc::RegId first_free = m_next;
+            emit({.op = bc::Opcode::exit, .b = operand(stmt.expr)});
+            m_next = first_free;
+            break;
+        }
+        case node::StmtKind::let:
+        {
+            if (m_vars.lookup(stmt.ident) != nullptr)
+            {
+                throw CompileError("identifier already used: ", m_interner.name(stmt.ident));
+            }
+            // The initializer is evaluated before the variable exists
+            const uint32_t length = array_length(stmt.expr);
+            if (length > node::max_array_elements - m_array_elements)
+            {
+                throw CompileError("arrays take more than ", node::max_array_elements, " elements");
+            }
+            m_array_elements += length;
+            const bc::RegId var = allocate(std::max(length, 1u));
+            if (length == 0)
+            {
+                compile_into(stmt.expr, var);
+            }
+            else
+            {
+                compile_array_into(stmt.expr, var, length);
+            }
+            m_vars.declare(stmt.ident, {.reg = var, .length = length});
+            break;
+        }
+        case node::StmtKind::assign:
+        {
+            const Var var = lookup(stmt.ident);
+            if (var.length == 0)
+            {
+                compile_into(stmt.expr, var.reg);
+                break;
+            }
+            node::check_assigned_length(var.length, array_length(stmt.expr));
+            compile_array_into(stmt.expr, var.reg, var.length);
+            break;
+        }
+        case node::StmtKind::store:
+        {
+            const Var array = lookup_array(stmt.ident);
+            const bc::RegId first_free = m_next;
+            const bc::RegId index = operand(stmt.index);
+            const bc::RegId value = operand(stmt.expr);
+            emit({.op = bc::Opcode::store, .n = array.length, .a = array.reg, .b = index, .c = value});
+            m_next = first_free;
+            break;
+        }
+        case node::StmtKind::scope:
+            compile_scope(stmt.scope);
+            break;
+        case node::StmtKind::if_:
+            compile_if(stmt);
+            break;
+        case node::StmtKind::while_:
+            compile_while(stmt);
+            break;
+        }
+    }
+
+    void compile_if(const node::NodeStmt &stmt_if)
+    {
+        const Jump to_else = branch(stmt_if.expr, false);
+        compile_scope(stmt_if.scope);
+        if (stmt_if.else_ == node::none)
+        {
+            patch(to_else);
+            return;
+        }
+        const Jump to_end = emit({.op = bc::Opcode::jmp});
+        patch(to_else);
+        // An elif is an if_ of its own, an else a scope
+        compile_stmt(stmt_if.else_);
+        patch(to_end);
+    }
+
+    // Inverted like in the Lowering: the condition is tested once in front of
+    // the loop and then at the bottom of every iteration
+    void compile_while(const node::NodeStmt &stmt_while)
+    {
+        const Jump skip = branch(stmt_while.expr, false);
+        const auto body = static_cast<uint32_t>(m_program.code.size());
+        compile_scope(stmt_while.scope);
+        const Jump back = branch(stmt_while.expr, true);
+        if (back != no_jump)
+        {
+            m_program.code[back].a = body;
+        }
+        patch(skip);
+    }
+
+    // Emits a jump taken when cond is when and returns it, or no_jump when a
+    // constant condition never takes it
+    Jump branch(const node::ExprId cond, const bool when)
+    {
+        const node::NodeExpr &expr = m_prog.exprs[cond];
+        if (expr.kind == node::ExprKind::int_lit)
+        {
+            if ((expr.value() != 0) != when)
+            {
+                return no_jump;
+            }
+            return emit({.op = bc::Opcode::jmp});
+        }
+        const bc::RegId first_free = m_next;
+        Jump jump;
+        if (is_comparison(expr.kind))
+        {
+            // Branching when the comparison fails is branching on the opposite one
+            const bc::RegId lhs = operand(expr.lhs);
+            const bc::RegId rhs = operand(expr.rhs);
+            jump = emit({.op = fused_branch(when ? expr.kind : negate(expr.kind)), .b = lhs, .c = rhs});
+        }
+        else
+        {
+            jump = emit({.op = when ? bc::Opcode::jnz : bc::Opcode::jz, .b = operand(cond)});
+        }
+        m_next = first_free;
+        return jump;
+    }
+
+    // Makes jump go to the next instruction emitted
+    void patch(const Jump jump)
+    {
+        if (jump != no_jump)
+        {
+            m_program.code[jump].a = static_cast<uint32_t>(m_program.code.size());
+        }
+    }
+
+    // The register holding the value of id, a temporary unless it is a
+    // variable or a constant. Temporaries are freed by the caller.
+    bc::RegId operand(const node::ExprId id)
+    {
+        const node::NodeExpr &expr = m_prog.exprs[id];
+        switch (expr.kind)
+        {
+        case node::ExprKind::int_lit:
+            return constant(expr.value());
+        case node::ExprKind::ident:
+            return lookup_number(expr.lhs);
+        case node::ExprKind::array_lit:
+        case node::ExprKind::array_fill:
+            throw CompileError("array used as a number");
+        default:
+        {
+            const bc::RegId temp = allocate();
+            compile_into(id, temp);
+            return temp;
+        }
+        }
+    }
+
+    // The number of elements of the array id evaluates to, 0 for a number
+    uint32_t array_length(const node::ExprId id)
+    {
+        if (!m_prog.has_arrays)
+        {
+            return 0;
+        }
+        // Only computed once, which keeps nested expressions linear
+        uint32_t &length = m_lengths[id];
+        if (length != unknown_length)
+        {
+            return length;
+        }
+        const node::NodeExpr &expr = m_prog.exprs[id];
+        switch (expr.kind)
+        {
+        case node::ExprKind::int_lit:
+        case node::ExprKind::index:
+            length = 0;
+            break;
+        case node::ExprKind::ident:
+            length = lookup(expr.lhs).length;
+            break;
+        case node::ExprKind::array_lit:
+            length = expr.rhs - expr.lhs;
+            break;
+        case node::ExprKind::array_fill:
+            length = expr.rhs;
+            break;
+        default:
+            length = node::element_wise_length(expr.kind, array_length(expr.lhs), array_length(expr.rhs));
+            break;
+        }
+        return length;
+    }
+
+    // Writes the array id evaluates to into the length registers from dst
+    void compile_array_into(const node::ExprId id, const bc::RegId dst, const uint32_t length)
+    {
+        const node::NodeExpr &expr = m_prog.exprs[id];
+        const bc::RegId first_free = m_next;
+        switch (expr.kind)
+        {
+        case node::ExprKind::ident:
+        {
+            const bc::RegId src = lookup(expr.lhs).reg;
+            if (src != dst)
+            {
+                emit({.op = bc::Opcode::vmov, .n = length, .a = dst, .b = src});
+            }
+            break;
+        }
+        case node::ExprKind::array_fill:
+            emit({.op = bc::Opcode::vfill, .n = length, .a = dst, .b = operand(expr.lhs)});
+            break;
+        case node::ExprKind::array_lit:
+        {
+            // The elements may read dst, all of them are computed first
+            std::vector<bc::RegId> elems;
+            for (const node::ExprId elem : m_prog.elements(id))
+            {
+                elems.push_back(operand(elem));
+            }
+            for (uint32_t i = 0; i < length; i++)
+            {
+                emit({.op = bc::Opcode::mov, .a = dst + i, .b = elems[i]});
+            }
+            break;
+        }
+        default:
+        {
+            const bc::RegId lhs = array_operand(expr.lhs, length);
+            const bc::RegId rhs = array_operand(expr.rhs, length);
+            const bc::Opcode op = expr.kind == node::ExprKind::add   ? bc::Opcode::vadd
+                                  : expr.kind == node::ExprKind::sub ? bc::Opcode::vsub
+                                                                     : bc::Opcode::vmul;
+            emit({.op = op, .n = length, .a = dst, .b = lhs, .c = rhs});
+            break;
+        }
+        }
+        m_next = first_free;
+    }
+
+    // The first register of an array of length holding the value of id, a
+    // temporary unless it is a variable. Numbers are filled into every element.
+    bc::RegId array_operand(const node::ExprId id, const uint32_t length)
+    {
+        const node::NodeExpr &expr = m_prog.exprs[id];
+        if (expr.kind == node::ExprKind::ident && array_length(id) != 0)
+        {
+            return lookup(expr.lhs).reg;
+        }
+        const bc::RegId temp = allocate(length);
+        if (array_length(id) == 0)
+        {
+            emit({.op = bc::Opcode::vfill, .n = length, .a = temp, .b = operand(id)});
+        }
+        else
+        {
+            compile_array_into(id, temp, length);
+        }
+        return temp;
+    }
+
+    // Only the last instruction writes dst, so it may be read by the
+    // expression, as in a = a + 1
+    void compile_into(const node::ExprId id, const bc::RegId dst)
+    {
+        const node::NodeExpr &expr = m_prog.exprs[id];
+        if (expr.kind == node::ExprKind::index)
+        {
+            const Var array = lookup_array(expr.lhs);
+            const bc::RegId first_free = m_next;
+            emit({.op = bc::Opcode::load, .n = array.length, .a = dst, .b = array.reg, .c = operand(expr.rhs)});
+            m_next = first_free;
+            return;
+        }
+        if (!node::is_bin_expr(expr.kind))
+        {
+            emit({.op = bc::Opcode::mov, .a = dst, .b = operand(id)});
+            return;
+        }
+        const bc::RegId first_free = m_next;
+        const bc::RegId lhs = operand(expr.lhs);
+        const bc::RegId rhs = operand(expr.rhs);
+        emit({.op = arithmetic(expr.kind), .a = dst, .b = lhs, .c = rhs});
+        m_next = first_free;
+    }
+
+    [[nodiscard]] static bool is_comparison(const node::ExprKind kind)
+    {
+        return kind >= node::ExprKind::eq && kind <= node::ExprKind::ge;
+    }
+
+    [[nodiscard]] static node::ExprKind negate(const node::ExprKind kind)
+    {
+        switch (kind)
+        {
+        case node::ExprKind::eq:
+            return node::ExprKind::ne;
+        case node::ExprKind::ne:
+            return node::ExprKind::eq;
+        case node::ExprKind::lt:
+            return node::ExprKind::ge;
+        case node::ExprKind::le:
+            return node::ExprKind::gt;
+        case node::ExprKind::gt:
+            return node::ExprKind::le;
+        case node::ExprKind::ge:
+        default:
+            return node::ExprKind::lt;
+        }
+    }
+
+    // The binary expressions are listed in the same order in both enums
+    [[nodiscard]] static bc::Opcode arithmetic(const node::ExprKind kind)
+    {
+        assert(node::is_bin_expr(kind));
+        return static_cast<bc::Opcode>(static_cast<uint8_t>(kind) - static_cast<uint8_t>(node::ExprKind::add) +
+                                       static_cast<uint8_t>(bc::Opcode::add));
+    }
+
+    [[nodiscard]] static bc::Opcode fused_branch(const node::ExprKind kind)
+    {
+        assert(is_comparison(kind));
+        return static_cast<bc::Opcode>(static_cast<uint8_t>(kind) - static_cast<uint8_t>(node::ExprKind::eq) +
+                                       static_cast<uint8_t>(bc::Opcode::jeq));
+    }
+
+    // The registers of a variable
+    struct Var
+    {
+        bc::RegId reg;
+        uint32_t length = 0; // of the array starting at reg, 0 for a number
+    };
+
+    Var lookup(const Symbol ident)
+    {
+        const Var *var = m_vars.lookup(ident);
+        if (var == nullptr)
+        {
+            throw CompileError("undeclared identifier: ", m_interner.name(ident));
+        }
+        return *var;
+    }
+
+    bc::RegId lookup_number(const Symbol ident)
+    {
+        const Var var = lookup(ident);
+        if (var.length != 0)
+        {
+            throw CompileError("array used as a number: ", m_interner.name(ident));
+        }
+        return var.reg;
+    }
+
+    Var lookup_array(const Symbol ident)
+    {
+        const Var var = lookup(ident);
+        if (var.length == 0)
+        {
+            throw CompileError("not an array: ", m_interner.name(ident));
+        }
+        return var;
+    }
+
+    bc::RegId allocate(const uint32_t count = 1)
+    {
+        m_program.frame_size = std::max(m_program.frame_size, m_next + count);
+        const bc::RegId first = m_next;
+        m_next += count;
+        return first;
+    }
+
+    bc::RegId constant(const uint64_t value)
+    {
+        const auto [it, added] = m_constants.try_emplace(value, static_cast<bc::RegId>(m_program.constants.size()));
+        if (added)
+        {
+            m_program.constants.push_back(value);
+        }
+        return it->second | constant_flag;
+    }
+
+    void relocate(bc::RegId &reg) const
+    {
+        if ((reg & constant_flag) != 0)
+        {
+            reg = m_program.frame_size + (reg & ~constant_flag);
+        }
+    }
+
+    Jump emit(const bc::Instr instr)
+    {
+        m_program.code.push_back(instr);
+        return m_program.code.size() - 1;
+    }
+
+    const node::NodeProg &m_prog;
+    const Interner &m_interner;
+    bc::Program m_program{};
+    SymbolTable<Var> m_vars{};
+    bc::RegId m_next = 0; // the first free register, the ones below are in use
+    std::unordered_map<uint64_t, bc::RegId> m_constants{};
+    static constexpr uint32_t unknown_length = UINT32_MAX;
+    std::vector<uint32_t> m_lengths{}; // per expression, see array_length
+    uint32_t m_array_elements = 0;     // of the variables declared so far
+};
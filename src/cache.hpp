@@ -0,0 +1,231 @@
+#pragma once
+
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "./error.hpp"
+
+// On-disk cache of compiled executables (and their assembly), keyed by a hash
+// of everything that determines them. An entry is the file <key> plus, when
+// the assembly was asked for, <key>.asm. Files are written under a temporary
+// name and renamed into place, so concurrent compilers, threads or processes,
+// only ever see complete entries. The modification time of an entry is
+// bumped on every hit and the least recently used files are evicted once
+// the cache grows past its size limit.
+class CompileCache
+{
+public:
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t stores = 0;
+        uint64_t evictions = 0;
+    };
+
+    CompileCache(std::filesystem::path dir, const uint64_t max_bytes)
+        : m_dir(std::move(dir)),
+          m_max_bytes(max_bytes)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(m_dir, error);
+        if (error)
+        {
+            throw CompileError("unable to create cache directory ", m_dir.string(), ": ", error.message());
+        }
+    }
+
+    // Copies the entry of key to output (and asm_output), returns false when
+    // there is no complete entry
+    bool restore(const std::string &key, const std::string &output, const std::optional<std::string> &asm_output)
+    {
+        const std::filesystem::path entry = m_dir / key;
+        std::error_code error;
+        if (asm_output.has_value())
+        {
+            copy_out(entry.string() + ".asm", asm_output.value(), error);
+        }
+        if (!error)
+        {
+            copy_out(entry, output, error);
+        }
+        if (error)
+        {
+            m_misses++;
+            return false;
+        }
+        std::filesystem::permissions(output, std::filesystem::perms::owner_exec | std::filesystem::perms::group_exec | std::filesystem::perms::others_exec,
+                                     std::filesystem::perm_options::add, error);
+        m_hits++;
+        return true;
+    }
+
+    // Adds the files just compiled for key. The cache is an optimization, so
+    // failing to write it is not an error.
+    void store(const std::string &key, const std::string &output, const std::optional<std::string> &asm_output)
+    {
+        const std::filesystem::path entry = m_dir / key;
+        if (asm_output.has_value() && !copy_in(asm_output.value(), entry.string() + ".asm"))
+        {
+            return;
+        }
+        if (!copy_in(output, entry))
+        {
+            return;
+        }
+        m_stores++;
+        evict();
+    }
+
+    // Counts since the cache was opened
+    [[nodiscard]] Stats stats() const
+    {
+        return {.hits = m_hits, .misses = m_misses, .stores = m_stores, .evictions = m_evictions};
+    }
+
+    struct Recorded
+    {
+        Stats run;   // since the previous call
+        Stats total; // of every process that used the directory
+    };
+
+    // Adds the counts since the previous call to the totals kept in the
+    // cache directory
+    Recorded record_stats()
+    {
+        const std::lock_guard lock(m_record_mutex);
+        const Stats now = stats();
+        const Stats run{.hits = now.hits - m_recorded.hits,
+                        .misses = now.misses - m_recorded.misses,
+                        .stores = now.stores - m_recorded.stores,
+                        .evictions = now.evictions - m_recorded.evictions};
+        m_recorded = now;
+
+        Stats total;
+        const std::string path = (m_dir / "stats").string();
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            return {.run = run, .total = run};
+        }
+        flock(fd, LOCK_EX);
+        std::string contents(256, '\0');
+        const ssize_t count = pread(fd, contents.data(), contents.size(), 0);
+        contents.resize(count > 0 ? static_cast<size_t>(count) : 0);
+        std::istringstream(contents) >> total.hits >> total.misses >> total.stores >> total.evictions;
+        total.hits += run.hits;
+        total.misses += run.misses;
+        total.stores += run.stores;
+        total.evictions += run.evictions;
+        const std::string updated = std::to_string(total.hits) + " " + std::to_string(total.misses) + " " +
+                                    std::to_string(total.stores) + " " + std::to_string(total.evictions) + "\n";
+        if (ftruncate(fd, 0) == 0)
+        {
+            [[maybe_unused]] const ssize_t written = pwrite(fd, updated.data(), updated.size(), 0);
+        }
+        ::close(fd);
+        return {.run = run, .total = total};
+    }
+
+private:
+    static void copy_out(const std::filesystem::path &from, const std::string &to, std::error_code &error)
+    {
+        std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, error);
+        if (!error)
+        {
+            // Marks the entry as recently used
+            std::error_code ignored;
+            std::filesystem::last_write_time(from, std::filesystem::file_time_type::clock::now(), ignored);
+        }
+    }
+
+    bool copy_in(const std::string &from, const std::filesystem::path &to)
+    {
+        std::ostringstream temp_name;
+        temp_name << to.string() << ".tmp." << getpid() << "." << std::this_thread::get_id();
+        const std::filesystem::path temp = temp_name.str();
+        std::error_code error;
+        std::filesystem::copy_file(from, temp, std::filesystem::copy_options::overwrite_existing, error);
+        if (!error)
+        {
+            std::filesystem::rename(temp, to, error);
+        }
+        if (error)
+        {
+            std::filesystem::remove(temp, error);
+            return false;
+        }
+        return true;
+    }
+
+    // Removes the least recently used files until the cache is back to 90% of its limit
+    void evict()
+    {
+        const std::lock_guard lock(m_evict_mutex);
+        struct File
+        {
+            std::filesystem::path path;
+            std::filesystem::file_time_type used;
+            uint64_t size;
+        };
+        std::vector<File> files;
+        uint64_t total = 0;
+        std::error_code error;
+        for (const auto &file : std::filesystem::directory_iterator(m_dir, error))
+        {
+            const std::string name = file.path().filename().string();
+            if (name == "stats" || name.find(".tmp.") != std::string::npos || !file.is_regular_file(error))
+            {
+                continue;
+            }
+            const uint64_t size = file.file_size(error);
+            if (error)
+            {
+                // Removed by someone else in the meantime
+                continue;
+            }
+            files.push_back({.path = file.path(), .used = file.last_write_time(error), .size = size});
+            total += size;
+        }
+        if (total <= m_max_bytes)
+        {
+            return;
+        }
+        std::ranges::sort(files, {}, &File::used);
+        for (const File &file : files)
+        {
+            if (total <= m_max_bytes / 10 * 9)
+            {
+                break;
+            }
+            if (std::filesystem::remove(file.path, error))
+            {
+                total -= file.size;
+                m_evictions++;
+            }
+        }
+    }
+
+    std::filesystem::path m_dir;
+    uint64_t m_max_bytes;
+    std::mutex m_evict_mutex{};
+    std::mutex m_record_mutex{};
+    Stats m_recorded{};
+    std::atomic<uint64_t> m_hits = 0;
+    std::atomic<uint64_t> m_misses = 0;
+    std::atomic<uint64_t> m_stores = 0;
+    std::atomic<uint64_t> m_evictions = 0;
+};
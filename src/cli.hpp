@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "./cache.hpp"
+#include "./driver.hpp"
+#include "./thread_pool.hpp"
+
+// One run of hydro as described by its command line
+struct Invocation
+{
+    CompileOptions options{};
+    std::optional<std::string> output{};
+    size_t thread_count = 1;
+    std::vector<std::string> inputs{};
+    std::optional<std::string> cache_dir{};
+    size_t cache_size_mib = 256;
+    bool print_cache_stats = false;
+    // Relative paths are taken from here, the working directory by default
+    std::filesystem::path base_dir{};
+};
+
+inline void usage(std::ostream &err)
+{
+    err << "Incorrect usage. Correct usage is..." << std::endl;
+    err << "hydro [--no-peephole] [--no-dce] [--no-licm] [--run | --interp] [--simd=none|sse2|avx2] [--emit-asm] [--emit-ir] [--stats] [--verbose] [--time-passes[=table|json]] [-o <output>] <input.hy | ->"
+        << std::endl;
+    err << "hydro -j <threads> [options] <input.hy>..." << std::endl;
+    err << "cache options: [--cache-dir <dir>] [--cache-size <MiB>] [--cache-stats]" << std::endl;
+    err << "hydro --server <socket>, hydro --connect <socket> [options] <input.hy>..." << std::endl;
+}
+
+inline std::optional<size_t> parse_count(const std::string_view text)
+{
+    size_t value = 0;
+    const auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (result.ec != std::errc() || result.ptr != text.data() + text.size())
+    {
+        return {};
+    }
+    return value;
+}
+
+// Prints the usage to err and returns nullopt when args are malformed.
+// env_cache_dir is the value of HYDRO_CACHE_DIR, if set.
+inline std::optional<Invocation> parse_invocation(const std::vector<std::string> &args, const char *env_cache_dir, std::ostream &err)
+{
+    Invocation invocation;
+    if (env_cache_dir != nullptr)
+    {
+        invocation.cache_dir = env_cache_dir;
+    }
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        const std::string_view arg = args[i];
+        const bool has_value = i + 1 < args.size();
+        if (arg == "--no-peephole")
+        {
+            invocation.options.peephole = false;
+        }
+        else if (arg == "--no-dce")
+        {
+            invocation.options.dce = false;
+        }
+        else if (arg == "--no-licm")
+        {
+            invocation.options.licm = false;
+        }
+        else if (arg == "--run")
+        {
+            invocation.options.run = true;
+        }
+        else if (arg == "--interp")
+        {
+            invocation.options.interp = true;
+        }
+        else if (arg.starts_with("--simd="))
+        {
+            const auto simd = std::ranges::find(simd_names, arg.substr(7));
+            if (simd == simd_names.end())
+            {
+                usage(err);
+                return {};
+            }
+            invocation.options.simd = static_cast<Simd>(simd - simd_names.begin());
+        }
+        else if (arg == "--emit-asm")
+        {
+            invocation.options.emit_asm = true;
+        }
+        else if (arg == "--emit-ir")
+        {
+            invocation.options.emit_ir = true;
+        }
+        else if (arg == "--stats")
+        {
+            invocation.options.stats = true;
+        }
+        else if (arg == "--verbose")
+        {
+            invocation.options.verbose = true;
+        }
+        else if (arg == "--time-passes" || arg == "--time-passes=table")
+        {
+            invocation.options.time_passes = PassTimer::Format::table;
+        }
+        else if (arg == "--time-passes=json")
+        {
+            invocation.options.time_passes = PassTimer::Format::json;
+        }
+        else if (arg == "--cache-stats")
+        {
+            invocation.print_cache_stats = true;
+        }
+        else if (arg == "-o" && has_value)
+        {
+            invocation.output = args[++i];
+        }
+        else if (arg == "--cache-dir" && has_value)
+        {
+            invocation.cache_dir = args[++i];
+        }
+        else if ((arg == "-j" || arg == "--cache-size") && has_value)
+        {
+            const std::optional<size_t> value = parse_count(args[++i]);
+            if (!value.has_value())
+            {
+                usage(err);
+                return {};
+            }
+            if (arg == "--cache-size")
+            {
+                invocation.cache_size_mib = value.value();
+            }
+            // -j 0 uses every core
+            else if (value.value() == 0)
+            {
+                invocation.thread_count = std::max(1u, std::thread::hardware_concurrency());
+            }
+            else
+            {
+                invocation.thread_count = value.value();
+            }
+        }
+        else if (arg == "-" || !arg.starts_with("-"))
+        {
+            invocation.inputs.emplace_back(arg);
+        }
+        else
+        {
+            usage(err);
+            return {};
+        }
+    }
+    const bool single = invocation.inputs.size() == 1;
+    if (invocation.inputs.empty() || (invocation.options.run && invocation.options.interp) ||
+        (!single && (invocation.output.has_value() || invocation.options.executes() ||
+                     std::ranges::find(invocation.inputs, "-") != invocation.inputs.end())))
+    {
+        usage(err);
+        return {};
+    }
+    return invocation;
+}
+
+// A single input goes to out (or -o), several are each compiled next to
+// their source: a.hy becomes a, a.asm and a.ir
+inline CompileJob make_job(const Invocation &invocation, const size_t index)
+{
+    const std::string &input = invocation.inputs[index];
+    std::filesystem::path executable;
+    if (invocation.output.has_value())
+    {
+        executable = invocation.output.value();
+    }
+    else if (invocation.inputs.size() == 1)
+    {
+        executable = "out";
+    }
+    else
+    {
+        executable = input;
+        if (executable.extension() == ".hy")
+        {
+            executable.replace_extension();
+        }
+        else
+        {
+            executable += ".out";
+        }
+    }
+    executable = invocation.base_dir / executable;
+    return {.input = input == "-" ? input : (invocation.base_dir / input).string(),
+            .output = executable.string(),
+            .asm_output = executable.string() + ".asm",
+            .ir_output = executable.string() + ".ir"};
+}
+
+inline void report_cache_stats(CompileCache &cache, std::ostream &err)
+{
+    const auto [run, total] = cache.record_stats();
+    err << "cache: " << run.hits << " hits, " << run.misses << " misses, " << run.stores << " stores, "
+        << run.evictions << " evictions (all runs: " << total.hits << " hits, " << total.misses
+        << " misses, " << total.stores << " stores, " << total.evictions << " evictions)" << std::endl;
+}
+
+// Compiles every input of invocation and returns the exit status, that of
+// the program when it is run. compilers holds the warm per-worker state and
+// grows to the number of workers. cache is the cache named by the
+// invocation, or null.
+inline int run_invocation(const Invocation &invocation, std::vector<Compiler> &compilers, CompileCache *cache,
+                   std::ostream &out, std::ostream &err)
+{
+    CompileOptions options = invocation.options;
+    options.cache = cache;
+    const auto finish = [&](const bool success)
+    {
+        if (cache != nullptr)
+        {
+            if (invocation.print_cache_stats)
+            {
+                report_cache_stats(*cache, err);
+            }
+            else
+            {
+                cache->record_stats();
+            }
+        }
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    };
+
+    if (invocation.inputs.size() == 1)
+    {
+        compilers.resize(std::max<size_t>(compilers.size(), 1));
+        std::optional<int> status;
+        try
+        {
+            status = compilers.front().compile(make_job(invocation, 0), options, out, err);
+        }
+        catch (const CompileError &error)
+        {
+            err << error.what() << std::endl;
+            return finish(false);
+        }
+        const int compile_status = finish(true);
+        return status.value_or(compile_status);
+    }
+
+    // Reports are collected per file and printed in one piece, so those of
+    // files compiled at the same time do not interleave
+    WorkStealingPool pool(invocation.thread_count);
+    compilers.resize(std::max(compilers.size(), pool.worker_count()));
+    std::mutex report_mutex;
+    std::atomic<size_t> failures = 0;
+    pool.run(invocation.inputs.size(), [&](const size_t worker, const size_t index)
+             {
+                 const CompileJob job = make_job(invocation, index);
+                 std::ostringstream file_out;
+                 std::ostringstream file_err;
+                 try
+                 {
+                     compilers[worker].compile(job, options, file_out, file_err);
+                 }
+                 catch (const CompileError &error)
+                 {
+                     file_err << invocation.inputs[index] << ": " << error.what() << std::endl;
+                     failures++;
+                 }
+                 const std::lock_guard lock(report_mutex);
+                 if (!file_out.view().empty())
+                 {
+                     out << "==> " << invocation.inputs[index] << " <==" << std::endl
+                         << file_out.view();
+                 }
+                 err << file_err.view(); });
+    return finish(failures == 0);
+}
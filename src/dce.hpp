@@ -0,0 +1,262 @@
+#pragma once
+
+#include "./ir.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Removes the code that can never run or whose result nobody observes:
+//  - constants are propagated through the SSA values, so conditions built
+//    from variables holding constants become constant as well
+//  - a branch on a constant becomes a jump, which leaves the arm not taken
+//    (and anything only reachable through it) unreachable
+//  - values that neither reach a branch, an exit, a store to an array nor
+//    a possibly faulting division or element access are dropped, such as
+//    variables that are never read
+// Blocks that became unreachable go away with their values and the phis
+// merging them. Everything after an exit is already dropped by the Lowering.
+class DeadCodeEliminator
+{
+public:
+    struct Stats
+    {
+        size_t constants = 0; // values computed at compile time
+        size_t branches = 0;  // branches turned into jumps
+        size_t blocks = 0;    // removed
+        size_t values = 0;    // removed
+    };
+
+    explicit DeadCodeEliminator(ir::Function &fn)
+        : m_fn(fn)
+    {
+    }
+
+    void run()
+    {
+        // Folding a branch can make the phis after it constant in turn
+        bool folded = true;
+        while (folded)
+        {
+            propagate_constants();
+            folded = fold_branches();
+            if (folded)
+            {
+                compact();
+            }
+        }
+        compact(find_dead_values());
+    }
+
+    [[nodiscard]] const Stats &stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    // Same arithmetic as the generated code and the ConstantFolder: wrapping
+    // at 64 bits, unsigned division and comparison, and divisions by zero left
+    // to fault at runtime
+    [[nodiscard]] static std::optional<uint64_t> evaluate(const ir::Opcode opcode, const uint64_t a, const uint64_t b)
+    {
+        switch (opcode)
+        {
+        case ir::Opcode::add:
+            return a + b;
+        case ir::Opcode::sub:
+            return a - b;
+        case ir::Opcode::mul:
+            return a * b;
+        case ir::Opcode::div:
+            if (b == 0)
+            {
+                return {};
+            }
+            return a / b;
+        case ir::Opcode::eq:
+            return a == b;
+        case ir::Opcode::ne:
+            return a != b;
+        case ir::Opcode::lt:
+            return a < b;
+        case ir::Opcode::le:
+            return a <= b;
+        case ir::Opcode::gt:
+            return a > b;
+        case ir::Opcode::ge:
+            return a >= b;
+        default:
+            return {};
+        }
+    }
+
+    [[nodiscard]] std::optional<uint64_t> constant(const ir::ValueId v) const
+    {
+        const ir::Instr &instr = m_fn.values[v];
+        if (instr.opcode != ir::Opcode::const_)
+        {
+            return {};
+        }
+        return instr.imm;
+    }
+
+    // Blocks are in reverse postorder, so apart from phis around loops every
+    // operand is visited before its users
+    void propagate_constants()
+    {
+        for (ir::Block &block : m_fn.blocks)
+        {
+            bool phi_folded = false;
+            for (const ir::ValueId v : block.instrs)
+            {
+                ir::Instr &instr = m_fn.values[v];
+                std::optional<uint64_t> value;
+                if (instr.opcode == ir::Opcode::phi)
+                {
+                    value = phi_constant(v);
+                    phi_folded = phi_folded || value.has_value();
+                }
+                else if (ir::is_binary(instr.opcode))
+                {
+                    const std::optional<uint64_t> a = constant(instr.lhs);
+                    const std::optional<uint64_t> b = constant(instr.rhs);
+                    if (a.has_value() && b.has_value())
+                    {
+                        value = evaluate(instr.opcode, a.value(), b.value());
+                    }
+                }
+                if (value.has_value())
+                {
+                    instr = {.opcode = ir::Opcode::const_, .block = instr.block, .imm = value.value()};
+                    m_stats.constants++;
+                }
+            }
+            // Phis turned into constants no longer belong in front
+            if (phi_folded)
+            {
+                std::ranges::stable_partition(block.instrs, [&](const ir::ValueId v)
+                                              { return m_fn.values[v].opcode == ir::Opcode::phi; });
+            }
+        }
+    }
+
+    // The value of a phi whose operands are all the same constant
+    [[nodiscard]] std::optional<uint64_t> phi_constant(const ir::ValueId phi) const
+    {
+        std::optional<uint64_t> value;
+        for (const ir::ValueId operand : m_fn.operands(phi))
+        {
+            const std::optional<uint64_t> operand_value = constant(operand);
+            if (!operand_value.has_value() || (value.has_value() && value != operand_value))
+            {
+                return {};
+            }
+            value = operand_value;
+        }
+        return value;
+    }
+
+    bool fold_branches()
+    {
+        bool folded = false;
+        for (ir::BlockId b = 0; b < m_fn.blocks.size(); b++)
+        {
+            ir::Terminator &term = m_fn.blocks[b].term;
+            if (term.kind != ir::TermKind::branch)
+            {
+                continue;
+            }
+            const std::optional<uint64_t> cond = constant(term.value);
+            if (!cond.has_value())
+            {
+                continue;
+            }
+            const ir::BlockId taken = term.targets[cond.value() != 0 ? 0 : 1];
+            const ir::BlockId dropped = term.targets[cond.value() != 0 ? 1 : 0];
+            // Branch targets have no phis, so only the edge itself goes
+            std::vector<ir::BlockId> &preds = m_fn.blocks[dropped].preds;
+            preds.erase(std::ranges::find(preds, b));
+            term = {.kind = ir::TermKind::jump, .targets = {taken, ir::none}};
+            m_stats.branches++;
+            folded = true;
+        }
+        return folded;
+    }
+
+    // Values are live when a branch or an exit uses them, when they write an
+    // array or when they might fault, and so is everything they are computed from
+    [[nodiscard]] std::vector<bool> find_dead_values() const
+    {
+        std::vector<bool> live(m_fn.values.size(), false);
+        std::vector<ir::ValueId> worklist;
+        const auto mark = [&](const ir::ValueId v)
+        {
+            if (!live[v])
+            {
+                live[v] = true;
+                worklist.push_back(v);
+            }
+        };
+        for (const ir::Block &block : m_fn.blocks)
+        {
+            if (block.term.kind == ir::TermKind::branch || block.term.kind == ir::TermKind::exit)
+            {
+                mark(block.term.value);
+            }
+            for (const ir::ValueId v : block.instrs)
+            {
+                if (!ir::has_result(m_fn.values[v].opcode) || may_fault(v))
+                {
+                    mark(v);
+                }
+            }
+        }
+        while (!worklist.empty())
+        {
+            const ir::ValueId v = worklist.back();
+            worklist.pop_back();
+            const ir::Instr &instr = m_fn.values[v];
+            if (instr.opcode == ir::Opcode::phi)
+            {
+                for (const ir::ValueId operand : m_fn.operands(v))
+                {
+                    mark(operand);
+                }
+            }
+            else
+            {
+                ir::for_each_operand(m_fn, v, mark);
+            }
+        }
+        live.flip();
+        return live;
+    }
+
+    // Divisions by a divisor that might be zero and loads of an element that
+    // might be out of bounds
+    [[nodiscard]] bool may_fault(const ir::ValueId v) const
+    {
+        const ir::Instr &instr = m_fn.values[v];
+        if (instr.opcode == ir::Opcode::div)
+        {
+            return constant(instr.rhs).value_or(0) == 0;
+        }
+        if (instr.opcode == ir::Opcode::load)
+        {
+            return constant(instr.lhs).value_or(UINT64_MAX) >= m_fn.arrays[instr.imm];
+        }
+        return false;
+    }
+
+    void compact(const std::vector<bool> &dead = {})
+    {
+        ir::Replacements replaced(m_fn.values.size());
+        const ir::Removed removed = ir::compact(m_fn, replaced, dead);
+        m_stats.blocks += removed.blocks;
+        m_stats.values += removed.values + removed.phis;
+    }
+
+    ir::Function &m_fn;
+    Stats m_stats{};
+};
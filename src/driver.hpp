@@ -0,0 +1,331 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./bytecode.hpp"
+#include "./cache.hpp"
+#include "./dce.hpp"
+#include "./elf.hpp"
+#include "./encoder.hpp"
+#include "./error.hpp"
+#include "./folding.hpp"
+#include "./generation.hpp"
+#include "./hash.hpp"
+#include "./interpreter.hpp"
+#include "./ir.hpp"
+#include "./jit.hpp"
+#include "./licm.hpp"
+#include "./lowering.hpp"
+#include "./output_buffer.hpp"
+#include "./parser.hpp"
+#include "./peephole.hpp"
+#include "./source.hpp"
+#include "./timing.hpp"
+#include "./tokenization.hpp"
+
+// Part of every cache key, bump when the generated code changes
+constexpr std::string_view compiler_version = "hydro 0.3";
+
+struct CompileOptions
+{
+    bool peephole = true;
+    bool dce = true;
+    bool licm = true;
+    bool run = false;    // executes the program in-process instead of writing it
+    bool interp = false; // interprets the program as bytecode instead of compiling it
+    Simd simd = Simd::sse2;
+    bool emit_asm = false;
+    bool emit_ir = false;
+    bool stats = false;
+    bool verbose = false;
+    std::optional<PassTimer::Format> time_passes{};
+    CompileCache *cache = nullptr; // shared by all compilers, may be null
+
+    // Whether the program is run by the compiler instead of written out
+    [[nodiscard]] bool executes() const
+    {
+        return run || interp;
+    }
+};
+
+struct CompileJob
+{
+    std::string input;      // source file, or "-" for stdin
+    std::string output;     // executable, unless the program is run
+    std::string asm_output; // only written with CompileOptions::emit_asm
+    std::string ir_output;  // only written with CompileOptions::emit_ir
+};
+
+// Runs the whole pipeline on one input at a time. Keep one Compiler per
+// thread: the interned names and the buffers of a compilation are reused by
+// the next one instead of being allocated again.
+class Compiler
+{
+public:
+    // Reports asked for by the options go to out, except for the pass timing
+    // which goes to err. Returns the exit status of the program when it is
+    // run. Throws CompileError.
+    std::optional<int> compile(const CompileJob &job, const CompileOptions &options, std::ostream &out, std::ostream &err)
+    {
+        m_options = options;
+        // There is no executable to restore or store
+        if (m_options.executes())
+        {
+            m_options.cache = nullptr;
+        }
+        PassTimer timer;
+        const SourceBuffer source = timer.time("load", [&]
+                                               { return SourceBuffer::load(job.input); });
+
+        // The statistics, the echo and the IR need the real pipeline, but its result is still cached
+        std::string cache_key;
+        if (m_options.cache != nullptr)
+        {
+            const bool restored = timer.time("cache", [&]
+                                             {
+                                                 cache_key = cache_key_of(source.view());
+                                                 return !m_options.stats && !m_options.verbose && !m_options.emit_ir &&
+                                                        m_options.cache->restore(cache_key, job.output, asm_output(job)); });
+            if (restored)
+            {
+                if (m_options.time_passes.has_value())
+                {
+                    timer.count("source_bytes", source.view().size());
+                    timer.count("cache_hit", 1);
+                    timer.print(err, m_options.time_passes.value(), job.input);
+                }
+                return {};
+            }
+        }
+
+        Tokenizer tokenizer(source.view(), m_interner);
+        if (m_options.verbose)
+        {
+            out << source.view() << std::endl;
+        }
+
+        // Tokens are lexed as the parser asks for them, so this covers both
+        Parser parser(tokenizer, std::move(m_prog));
+        std::optional<node::NodeProg> prog = timer.time("parse", [&]
+                                                        { return parser.parse_prog(); });
+        if (!prog.has_value())
+        {
+            throw CompileError("invalid program");
+        }
+        ConstantFolder folder(prog.value());
+        timer.time("fold", [&]
+                   { folder.fold_prog(); });
+        if (m_options.interp)
+        {
+            timer.count("source_bytes", source.view().size());
+            timer.count("tokens", tokenizer.token_count());
+            timer.count("ast_nodes", prog->node_count());
+            const int status = interpret(prog.value(), timer, out);
+            if (m_options.time_passes.has_value())
+            {
+                timer.print(err, m_options.time_passes.value(), job.input);
+            }
+            m_prog = std::move(prog.value());
+            return status;
+        }
+        Lowering lowering(prog.value(), m_interner);
+        ir::Function fn = timer.time("lower", [&]
+                                     { return lowering.lower(); });
+        DeadCodeEliminator dce(fn);
+        if (m_options.dce)
+        {
+            timer.time("dce", [&]
+                       { dce.run(); });
+        }
+        LoopInvariantCodeMotion licm(fn);
+        if (m_options.licm)
+        {
+            timer.time("licm", [&]
+                       { licm.run(); });
+        }
+        if (m_options.emit_ir)
+        {
+            m_assembly.clear();
+            timer.time("ir_write", [&]
+                       {
+                           ir::append_ir(m_assembly, fn);
+                           m_assembly.write_file(job.ir_output); });
+        }
+        timer.time("verify", [&]
+                   { ir::verify(fn); });
+        Generator generator(fn, m_options.simd);
+        std::vector<Instr> instrs = timer.time("gen", [&]
+                                               { return generator.gen_prog(); });
+        const size_t generated_count = instrs.size();
+        Peephole peephole;
+        if (m_options.peephole)
+        {
+            timer.time("peephole", [&]
+                       { peephole.optimize(instrs); });
+        }
+        if (m_options.stats)
+        {
+            const auto &symbols = lowering.symbol_stats();
+            out << "symbols: " << symbols.lookups << " lookups (" << symbols.misses << " misses), "
+                << symbols.declarations << " declarations, " << symbols.scopes << " scopes, max depth "
+                << symbols.max_depth << std::endl;
+            out << "ast: " << prog->node_count() << " nodes (" << prog->exprs.size() << " expressions, "
+                << prog->stmts.size() << " statements, " << prog->scopes.size() << " scopes) in "
+                << prog->bytes() << " bytes" << std::endl;
+            out << "ir: " << fn.blocks.size() << " blocks, " << fn.values.size() << " values (" << fn.phi_count()
+                << " phis), " << generator.allocation().spill_count << " spilled to "
+                << generator.allocation().slot_count << " stack slots" << std::endl;
+            // The code after an exit is dropped as soon as the IR is built
+            const DeadCodeEliminator::Stats &removed = dce.stats();
+            out << "dce: " << removed.constants << " constants folded, " << removed.branches
+                << " branches folded, removed " << removed.blocks + lowering.removed().blocks << " blocks and "
+                << removed.values + lowering.removed().values << " values (" << lowering.removed().values
+                << " after exit)" << std::endl;
+            out << "licm: " << licm.stats().values << " values hoisted out of " << licm.stats().loops << " loops"
+                << std::endl;
+            out << "strength reduction: " << generator.stats().multiplications << " multiplications, "
+                << generator.stats().divisions << " divisions by constants" << std::endl;
+            out << "kernels: " << fn.kernels.size() << " over " << fn.arrays.size() << " arrays, "
+                << generator.stats().vector_loops << " vector loops of " << simd_lanes(m_options.simd) << " lanes ("
+                << simd_names[static_cast<size_t>(m_options.simd)] << ")" << std::endl;
+            out << "peephole: " << peephole.rewrite_count() << " rewrites" << std::endl;
+            for (size_t i = 0; i < Peephole::rule_count; i++)
+            {
+                out << "    " << Peephole::rules()[i].name << ": " << peephole.rewrite_count(i) << std::endl;
+            }
+        }
+        if (m_options.emit_asm || m_options.verbose)
+        {
+            m_assembly.clear();
+            timer.time("asm_write", [&]
+                       {
+                           append_asm(m_assembly, instrs);
+                           if (m_options.emit_asm)
+                           {
+                               m_assembly.write_file(job.asm_output);
+                           } });
+            if (m_options.verbose)
+            {
+                out << m_assembly.view();
+            }
+        }
+
+        std::optional<int> status;
+        size_t code_size = 0;
+        if (m_options.run)
+        {
+            if (m_options.simd == Simd::avx2 && !__builtin_cpu_supports("avx2"))
+            {
+                throw CompileError("--simd=avx2 needs a CPU with AVX2 to run the program");
+            }
+            JitProgram program = timer.time("encode", [&]
+                                            { return JitProgram(instrs); });
+            code_size = program.code_size();
+            status = timer.time("run", [&]
+                                { return program.run(); });
+        }
+        else
+        {
+            Encoder encoder;
+            const std::vector<uint8_t> code = timer.time("encode", [&]
+                                                         { return encoder.encode(instrs); });
+            code_size = code.size();
+            timer.time("link", [&]
+                       { write_elf_executable(job.output, code); });
+            if (m_options.cache != nullptr)
+            {
+                timer.time("cache_store", [&]
+                           { m_options.cache->store(cache_key, job.output, asm_output(job)); });
+            }
+        }
+
+        if (m_options.time_passes.has_value())
+        {
+            const double parse_seconds = timer.seconds("parse");
+            timer.count("source_bytes", source.view().size());
+            timer.count("tokens", tokenizer.token_count());
+            timer.count("tokens_per_sec", parse_seconds > 0 ? static_cast<uint64_t>(tokenizer.token_count() / parse_seconds) : 0);
+            timer.count("ast_nodes", prog->node_count());
+            timer.count("ast_bytes", prog->bytes());
+            timer.count("ir_blocks", fn.blocks.size());
+            timer.count("ir_values", fn.values.size());
+            timer.count("dce_removed_values", dce.stats().values + lowering.removed().values);
+            timer.count("instrs_generated", generated_count);
+            timer.count("instrs_emitted", instrs.size());
+            timer.count("code_bytes", code_size);
+            if (m_options.cache != nullptr)
+            {
+                timer.count("cache_hit", 0);
+            }
+            timer.print(err, m_options.time_passes.value(), job.input);
+        }
+        m_prog = std::move(prog.value());
+        return status;
+    }
+
+private:
+    // Skips the IR and the backend, which take longer than running a short
+    // program does
+    int interpret(const node::NodeProg &prog, PassTimer &timer, std::ostream &out)
+    {
+        BytecodeCompiler compiler(prog, m_interner);
+        const bc::Program program = timer.time("bytecode", [&]
+                                               { return compiler.compile(); });
+        timer.count("bytecode_instrs", program.code.size());
+        if (m_options.stats)
+        {
+            out << "bytecode: " << program.code.size() << " instructions, " << program.frame_size << " registers, "
+                << program.constants.size() << " constants" << std::endl;
+        }
+        return timer.time("interp", [&]
+                          { return m_interpreter.run(program); });
+    }
+
+    [[nodiscard]] std::optional<std::string> asm_output(const CompileJob &job) const
+    {
+        if (!m_options.emit_asm)
+        {
+            return {};
+        }
+        return job.asm_output;
+    }
+
+    // Covers everything the output depends on: the source, the options that
+    // change the generated code and the compiler itself, identified by its
+    // version and the size and modification time of its executable
+    [[nodiscard]] std::string cache_key_of(const std::string_view source) const
+    {
+        static const Hasher compiler = []
+        {
+            Hasher hasher;
+            hasher.update(compiler_version);
+            struct stat info{};
+            if (stat("/proc/self/exe", &info) == 0)
+            {
+                hasher.update(static_cast<uint64_t>(info.st_size));
+                hasher.update(static_cast<uint64_t>(info.st_mtim.tv_sec) * 1000000000 + static_cast<uint64_t>(info.st_mtim.tv_nsec));
+            }
+            return hasher;
+        }();
+        Hasher hasher = compiler;
+        hasher.update(m_options.peephole);
+        hasher.update(m_options.dce);
+        hasher.update(m_options.licm);
+        hasher.update(static_cast<uint64_t>(m_options.simd));
+        hasher.update(source);
+        return hasher.hex();
+    }
+
+    CompileOptions m_options{}; // of the current compilation
+    Interner m_interner{};
+    node::NodeProg m_prog{};
+    OutputBuffer m_assembly{};
+    Interpreter m_interpreter{};
+};
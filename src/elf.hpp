@@ -0,0 +1,49 @@
+#pragma once
+
+#include <elf.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "./output_buffer.hpp"
+
+// Writes code as a static x86-64 Linux executable. The file is mapped as a
+// single read+execute segment and execution starts at the first byte of code.
+inline void write_elf_executable(const std::string &path, const std::vector<uint8_t> &code)
+{
+    constexpr uint64_t base_address = 0x400000;
+    constexpr uint64_t code_offset = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr);
+
+    Elf64_Ehdr header{};
+    std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_entry = base_address + code_offset;
+    header.e_phoff = sizeof(Elf64_Ehdr);
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_phentsize = sizeof(Elf64_Phdr);
+    header.e_phnum = 1;
+
+    Elf64_Phdr segment{};
+    segment.p_type = PT_LOAD;
+    segment.p_flags = PF_R | PF_X;
+    segment.p_offset = 0;
+    segment.p_vaddr = base_address;
+    segment.p_paddr = base_address;
+    segment.p_filesz = code_offset + code.size();
+    segment.p_memsz = segment.p_filesz;
+    segment.p_align = 0x1000;
+
+    OutputBuffer file(code_offset + code.size());
+    file.append_bytes(&header, sizeof(header));
+    file.append_bytes(&segment, sizeof(segment));
+    file.append_bytes(code.data(), code.size());
+    file.write_file(path, 0755);
+}
@@ -0,0 +1,553 @@
+#pragma once
+
+#include "./error.hpp"
+#include "./x86.hpp"
+
+#include <bit>
+#include <cstdint>
+#include <initializer_list>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+// Translates the Generator's instructions to x86-64 machine code. The code
+// only uses relative jumps, so it runs at whatever address it is loaded.
+class Encoder
+{
+public:
+    [[nodiscard]] std::vector<uint8_t> encode(const std::vector<Instr> &instrs)
+    {
+        // Everything but jumps has a fixed encoding, collect those first
+        std::vector<uint8_t> bytes;
+        std::vector<size_t> starts;
+        starts.reserve(instrs.size() + 1);
+        for (const Instr &instr : instrs)
+        {
+            starts.push_back(bytes.size());
+            if (!is_jump(instr.op) && instr.op != Op::label)
+            {
+                encode_instr(bytes, instr);
+            }
+        }
+        starts.push_back(bytes.size());
+
+        // Start with short jumps and widen the ones whose target is out of
+        // reach until the layout settles. Jumps only ever grow, so this ends.
+        std::vector<bool> wide(instrs.size(), false);
+        std::vector<size_t> offsets(instrs.size() + 1);
+        std::unordered_map<uint64_t, size_t> labels;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            size_t offset = 0;
+            for (size_t i = 0; i < instrs.size(); i++)
+            {
+                offsets[i] = offset;
+                if (instrs[i].op == Op::label)
+                {
+                    labels[instrs[i].dst.value] = offset;
+                }
+                offset += is_jump(instrs[i].op) ? jump_size(instrs[i].op, wide[i]) : starts[i + 1] - starts[i];
+            }
+            offsets[instrs.size()] = offset;
+
+            for (size_t i = 0; i < instrs.size(); i++)
+            {
+                if (is_jump(instrs[i].op) && !wide[i] && !fits_i8(jump_disp(instrs[i], offsets[i + 1], labels)))
+                {
+                    wide[i] = true;
+                    changed = true;
+                }
+            }
+        }
+
+        std::vector<uint8_t> code;
+        code.reserve(offsets[instrs.size()]);
+        for (size_t i = 0; i < instrs.size(); i++)
+        {
+            if (!is_jump(instrs[i].op))
+            {
+                code.insert(code.end(), bytes.begin() + starts[i], bytes.begin() + starts[i + 1]);
+                continue;
+            }
+            const int64_t disp = jump_disp(instrs[i], offsets[i + 1], labels);
+            const uint8_t condition = condition_code(instrs[i].op);
+            if (!wide[i])
+            {
+                code.push_back(instrs[i].op == Op::jmp ? 0xEB : 0x70 + condition);
+                code.push_back(static_cast<uint8_t>(disp));
+                continue;
+            }
+            if (instrs[i].op == Op::jmp)
+            {
+                code.push_back(0xE9);
+            }
+            else
+            {
+                code.insert(code.end(), {0x0F, static_cast<uint8_t>(0x80 + condition)});
+            }
+            emit_imm(code, static_cast<uint64_t>(disp), 4);
+        }
+        return code;
+    }
+
+private:
+    // Opcodes of the classic arithmetic instructions: r/m, reg form; reg, r/m form and the /digit of the immediate forms
+    struct AluOpcodes
+    {
+        uint8_t rm_reg;
+        uint8_t reg_rm;
+        uint8_t ext;
+    };
+
+    static void encode_instr(std::vector<uint8_t> &out, const Instr &instr)
+    {
+        const Operand &dst = instr.dst;
+        const Operand &src = instr.src;
+        switch (instr.op)
+        {
+        case Op::mov:
+            if (src.kind == Operand::Kind::reg && dst.kind != Operand::Kind::imm)
+            {
+                emit_rm(out, {0x89}, code(src.reg), dst);
+                return;
+            }
+            if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::mem)
+            {
+                emit_rm(out, {0x8B}, code(dst.reg), src);
+                return;
+            }
+            if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::imm)
+            {
+                if (src.value <= UINT32_MAX)
+                {
+                    // Writing the low half zero extends into the full register
+                    emit_rex(out, false, 0, code(dst.reg));
+                    out.push_back(0xB8 + (code(dst.reg) & 7));
+                    emit_imm(out, src.value, 4);
+                }
+                else if (fits_i32(static_cast<int64_t>(src.value)))
+                {
+                    emit_rm(out, {0xC7}, 0, dst);
+                    emit_imm(out, src.value, 4);
+                }
+                else
+                {
+                    emit_rex(out, true, 0, code(dst.reg));
+                    out.push_back(0xB8 + (code(dst.reg) & 7));
+                    emit_imm(out, src.value, 8);
+                }
+                return;
+            }
+            if (dst.kind == Operand::Kind::mem && src.kind == Operand::Kind::imm && fits_i32(static_cast<int64_t>(src.value)))
+            {
+                emit_rm(out, {0xC7}, 0, dst);
+                emit_imm(out, src.value, 4);
+                return;
+            }
+            break;
+        case Op::movzx:
+            // With REX.W the source is always a byte register, never ah to bh
+            if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::reg)
+            {
+                emit_rm(out, {0x0F, 0xB6}, code(dst.reg), src);
+                return;
+            }
+            break;
+        case Op::lea:
+            if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::address)
+            {
+                emit_rm(out, {0x8D}, code(dst.reg), src);
+                return;
+            }
+            break;
+        case Op::add:
+            if (encode_alu(out, {.rm_reg = 0x01, .reg_rm = 0x03, .ext = 0}, dst, src))
+            {
+                return;
+            }
+            break;
+        case Op::sub:
+            if (encode_alu(out, {.rm_reg = 0x29, .reg_rm = 0x2B, .ext = 5}, dst, src))
+            {
+                return;
+            }
+            break;
+        case Op::xor_:
+            if (encode_alu(out, {.rm_reg = 0x31, .reg_rm = 0x33, .ext = 6}, dst, src))
+            {
+                return;
+            }
+            break;
+        case Op::cmp:
+            if (encode_alu(out, {.rm_reg = 0x39, .reg_rm = 0x3B, .ext = 7}, dst, src))
+            {
+                return;
+            }
+            break;
+        case Op::setz:
+        case Op::setnz:
+        case Op::setb:
+        case Op::setae:
+        case Op::setbe:
+        case Op::seta:
+            // The low bytes of rsp, rbp, rsi and rdi need an empty REX prefix, which is never emitted
+            if (dst.kind == Operand::Kind::reg && (code(dst.reg) < 4 || code(dst.reg) >= 8))
+            {
+                emit_rm(out, {0x0F, static_cast<uint8_t>(0x90 + condition_code(instr.op))}, 0, dst, false);
+                return;
+            }
+            break;
+        case Op::imul:
+            if (dst.kind == Operand::Kind::reg && (src.kind == Operand::Kind::reg || src.kind == Operand::Kind::mem))
+            {
+                emit_rm(out, {0x0F, 0xAF}, code(dst.reg), src);
+                return;
+            }
+            if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::imm && fits_i32(static_cast<int64_t>(src.value)))
+            {
+                const bool short_imm = fits_i8(static_cast<int64_t>(src.value));
+                emit_rm(out, {static_cast<uint8_t>(short_imm ? 0x6B : 0x69)}, code(dst.reg), dst);
+                emit_imm(out, src.value, short_imm ? 1 : 4);
+                return;
+            }
+            break;
+        case Op::mul:
+            if (dst.kind == Operand::Kind::reg || dst.kind == Operand::Kind::mem)
+            {
+                emit_rm(out, {0xF7}, 4, dst);
+                return;
+            }
+            break;
+        case Op::div:
+            if (dst.kind == Operand::Kind::reg || dst.kind == Operand::Kind::mem)
+            {
+                emit_rm(out, {0xF7}, 6, dst);
+                return;
+            }
+            break;
+        case Op::shl:
+        case Op::shr:
+            if ((dst.kind == Operand::Kind::reg || dst.kind == Operand::Kind::mem) && src.kind == Operand::Kind::imm &&
+                src.value < 64)
+            {
+                const uint8_t ext = instr.op == Op::shl ? 4 : 5;
+                // Shifting by one has a form without immediate
+                if (src.value == 1)
+                {
+                    emit_rm(out, {0xD1}, ext, dst);
+                    return;
+                }
+                emit_rm(out, {0xC1}, ext, dst);
+                emit_imm(out, src.value, 1);
+                return;
+            }
+            break;
+        case Op::test:
+            if (src.kind == Operand::Kind::reg && (dst.kind == Operand::Kind::reg || dst.kind == Operand::Kind::mem))
+            {
+                emit_rm(out, {0x85}, code(src.reg), dst);
+                return;
+            }
+            break;
+        case Op::push:
+            if (dst.kind == Operand::Kind::reg)
+            {
+                emit_rex(out, false, 0, code(dst.reg));
+                out.push_back(0x50 + (code(dst.reg) & 7));
+                return;
+            }
+            if (dst.kind == Operand::Kind::mem)
+            {
+                emit_rm(out, {0xFF}, 6, dst, false);
+                return;
+            }
+            break;
+        case Op::pop:
+            if (dst.kind == Operand::Kind::reg)
+            {
+                emit_rex(out, false, 0, code(dst.reg));
+                out.push_back(0x58 + (code(dst.reg) & 7));
+                return;
+            }
+            break;
+        case Op::syscall:
+            out.insert(out.end(), {0x0F, 0x05});
+            return;
+        case Op::ret:
+            out.push_back(0xC3);
+            return;
+        case Op::ud2:
+            out.insert(out.end(), {0x0F, 0x0B});
+            return;
+        case Op::movq:
+            if (dst.kind == Operand::Kind::xmm && src.kind == Operand::Kind::reg)
+            {
+                emit_sse(out, 0x66, 0x6E, code(dst.reg), src, true);
+                return;
+            }
+            if (dst.kind == Operand::Kind::xmm && src.kind == Operand::Kind::mem)
+            {
+                emit_sse(out, 0xF3, 0x7E, code(dst.reg), src);
+                return;
+            }
+            if (dst.kind == Operand::Kind::mem && src.kind == Operand::Kind::xmm)
+            {
+                emit_sse(out, 0x66, 0xD6, code(src.reg), dst);
+                return;
+            }
+            break;
+        case Op::movdqu:
+            if (dst.is_vector() && (src.kind == dst.kind || src.kind == Operand::Kind::mem))
+            {
+                emit_vector(out, 0xF3, 0x6F, code(dst.reg), src, dst.kind == Operand::Kind::ymm);
+                return;
+            }
+            if (dst.kind == Operand::Kind::mem && src.is_vector())
+            {
+                emit_vector(out, 0xF3, 0x7F, code(src.reg), dst, src.kind == Operand::Kind::ymm);
+                return;
+            }
+            break;
+        case Op::paddq:
+        case Op::psubq:
+        case Op::pmuludq:
+        case Op::punpcklqdq:
+            if (dst.is_vector() && src.kind == dst.kind)
+            {
+                emit_vector(out, 0x66, vector_opcode(instr.op), code(dst.reg), src, dst.kind == Operand::Kind::ymm,
+                            code(dst.reg));
+                return;
+            }
+            break;
+        case Op::psllq:
+        case Op::psrlq:
+            // The AVX2 form writes vvvv
+            if (dst.is_vector() && src.kind == Operand::Kind::imm && src.value < 64)
+            {
+                const uint8_t ext = instr.op == Op::psllq ? 6 : 2;
+                emit_vector(out, 0x66, 0x73, ext, dst, dst.kind == Operand::Kind::ymm, code(dst.reg));
+                emit_imm(out, src.value, 1);
+                return;
+            }
+            break;
+        case Op::vpbroadcastq:
+            if (dst.kind == Operand::Kind::ymm && src.kind == Operand::Kind::xmm)
+            {
+                emit_vex(out, 0x66, 2, 0x59, code(dst.reg), 0, src);
+                return;
+            }
+            break;
+        case Op::vzeroupper:
+            out.insert(out.end(), {0xC5, 0xF8, 0x77});
+            return;
+        case Op::label:
+        case Op::jmp:
+        case Op::jz:
+        case Op::jnz:
+        case Op::jb:
+        case Op::jae:
+        case Op::jbe:
+        case Op::ja:
+            break;
+        }
+        OutputBuffer operands(64);
+        append_operand(operands, dst);
+        append_operand(operands.append(", "), src);
+        throw CompileError("unable to encode instruction: ", op_name(instr.op), " ", operands.view());
+    }
+
+    [[nodiscard]] static uint8_t vector_opcode(const Op op)
+    {
+        switch (op)
+        {
+        case Op::paddq:
+            return 0xD4;
+        case Op::psubq:
+            return 0xFB;
+        case Op::pmuludq:
+            return 0xF4;
+        default:
+            return 0x6C;
+        }
+    }
+
+    static bool encode_alu(std::vector<uint8_t> &out, const AluOpcodes opcodes, const Operand &dst, const Operand &src)
+    {
+        if (src.kind == Operand::Kind::reg && (dst.kind == Operand::Kind::reg || dst.kind == Operand::Kind::mem))
+        {
+            emit_rm(out, {opcodes.rm_reg}, code(src.reg), dst);
+            return true;
+        }
+        if (dst.kind == Operand::Kind::reg && src.kind == Operand::Kind::mem)
+        {
+            emit_rm(out, {opcodes.reg_rm}, code(dst.reg), src);
+            return true;
+        }
+        if ((dst.kind == Operand::Kind::reg || dst.kind == Operand::Kind::mem) && src.kind == Operand::Kind::imm &&
+            fits_i32(static_cast<int64_t>(src.value)))
+        {
+            const bool short_imm = fits_i8(static_cast<int64_t>(src.value));
+            emit_rm(out, {static_cast<uint8_t>(short_imm ? 0x83 : 0x81)}, opcodes.ext, dst);
+            emit_imm(out, src.value, short_imm ? 1 : 4);
+            return true;
+        }
+        return false;
+    }
+
+    // Emits the REX prefix (when one is needed), opcode and ModRM byte with
+    // its SIB byte and displacement. reg is a register code or /digit.
+    static void emit_rm(std::vector<uint8_t> &out, const std::initializer_list<uint8_t> opcode, const uint8_t reg,
+                        const Operand &rm, const bool wide = true)
+    {
+        emit_rex(out, wide, reg, code(rm.reg), rm.is_indexed() ? code(rm.index) : 0);
+        out.insert(out.end(), opcode);
+        emit_modrm(out, reg, rm);
+    }
+
+    // SSE2 instructions have a mandatory prefix in front of the REX prefix
+    // and their opcode after 0F
+    static void emit_sse(std::vector<uint8_t> &out, const uint8_t prefix, const uint8_t opcode, const uint8_t reg,
+                         const Operand &rm, const bool wide = false)
+    {
+        out.push_back(prefix);
+        emit_rm(out, {0x0F, opcode}, reg, rm, wide);
+    }
+
+    // An SSE2 instruction, or its AVX2 form when wide with vvvv as second source
+    static void emit_vector(std::vector<uint8_t> &out, const uint8_t prefix, const uint8_t opcode, const uint8_t reg,
+                            const Operand &rm, const bool wide, const uint8_t vvvv = 0)
+    {
+        if (wide)
+        {
+            emit_vex(out, prefix, 1, opcode, reg, vvvv, rm);
+            return;
+        }
+        emit_sse(out, prefix, opcode, reg, rm);
+    }
+
+    // The 256-bit AVX form of an SSE instruction: the VEX prefix takes the
+    // place of the mandatory prefix, REX and 0F (or 0F 38 for map 2) and
+    // adds vvvv, a second source register, 0 when there is none. The two
+    // byte form only covers map 1 without an extended base or index.
+    static void emit_vex(std::vector<uint8_t> &out, const uint8_t prefix, const uint8_t map, const uint8_t opcode,
+                         const uint8_t reg, const uint8_t vvvv, const Operand &rm)
+    {
+        const uint8_t pp = prefix == 0x66 ? 1 : prefix == 0xF3 ? 2
+                                                               : 0;
+        const uint8_t r = (reg & 8) == 0 ? 0x80 : 0;
+        const uint8_t x = rm.is_indexed() && (code(rm.index) & 8) != 0 ? 0 : 0x40;
+        const uint8_t b = (code(rm.reg) & 8) == 0 ? 0x20 : 0;
+        const uint8_t last = static_cast<uint8_t>((~vvvv & 0xF) << 3 | 0x04 | pp);
+        if (map == 1 && x != 0 && b != 0)
+        {
+            out.insert(out.end(), {0xC5, static_cast<uint8_t>(r | last)});
+        }
+        else
+        {
+            out.insert(out.end(), {0xC4, static_cast<uint8_t>(r | x | b | map), last});
+        }
+        out.push_back(opcode);
+        emit_modrm(out, reg, rm);
+    }
+
+    // The ModRM byte with its SIB byte and displacement
+    static void emit_modrm(std::vector<uint8_t> &out, const uint8_t reg, const Operand &rm)
+    {
+        const uint8_t base = code(rm.reg);
+        const bool indexed = rm.is_indexed();
+        const uint8_t index = indexed ? code(rm.index) : 0;
+        if (rm.kind == Operand::Kind::reg || rm.is_vector())
+        {
+            out.push_back(0xC0 | (reg & 7) << 3 | (base & 7));
+            return;
+        }
+
+        const auto disp = static_cast<int64_t>(rm.value);
+        if (!fits_i32(disp))
+        {
+            throw CompileError("stack offset out of range: ", disp);
+        }
+        // rbp and r13 as base always need a displacement
+        const uint8_t mod = disp == 0 && (base & 7) != 5 ? 0 : fits_i8(disp) ? 1 : 2;
+        if (indexed)
+        {
+            // rm = 100 selects the SIB byte; an index of rsp would mean none
+            const auto scale = static_cast<uint8_t>(std::countr_zero(rm.scale));
+            out.push_back(mod << 6 | (reg & 7) << 3 | 4);
+            out.push_back(scale << 6 | (index & 7) << 3 | (base & 7));
+        }
+        else
+        {
+            out.push_back(mod << 6 | (reg & 7) << 3 | (base & 7));
+            // rsp and r12 as base need a SIB byte
+            if ((base & 7) == 4)
+            {
+                out.push_back(0x24);
+            }
+        }
+        if (mod == 1)
+        {
+            emit_imm(out, rm.value, 1);
+        }
+        else if (mod == 2)
+        {
+            emit_imm(out, rm.value, 4);
+        }
+    }
+
+    static void emit_rex(std::vector<uint8_t> &out, const bool wide, const uint8_t reg, const uint8_t base,
+                         const uint8_t index = 0)
+    {
+        const uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg & 8) >> 1 | (index & 8) >> 2 | (base & 8) >> 3;
+        if (rex != 0x40)
+        {
+            out.push_back(rex);
+        }
+    }
+
+    // Little endian
+    static void emit_imm(std::vector<uint8_t> &out, const uint64_t value, const size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            out.push_back(static_cast<uint8_t>(value >> (i * 8)));
+        }
+    }
+
+    [[nodiscard]] static int64_t jump_disp(const Instr &instr, const size_t next_offset,
+                                           const std::unordered_map<uint64_t, size_t> &labels)
+    {
+        return static_cast<int64_t>(labels.at(instr.dst.value)) - static_cast<int64_t>(next_offset);
+    }
+
+    [[nodiscard]] static size_t jump_size(const Op op, const bool wide)
+    {
+        if (!wide)
+        {
+            return 2;
+        }
+        return op == Op::jmp ? 5 : 6;
+    }
+
+    [[nodiscard]] static bool is_jump(const Op op)
+    {
+        return op == Op::jmp || is_conditional_jump(op);
+    }
+
+    [[nodiscard]] static uint8_t code(const Reg reg)
+    {
+        return static_cast<uint8_t>(reg);
+    }
+
+    [[nodiscard]] static bool fits_i8(const int64_t value)
+    {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    [[nodiscard]] static bool fits_i32(const int64_t value)
+    {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Aborts the compilation of one input: errors in the program and failures to
+// read or write its files. The parts of the message are streamed together.
+class CompileError : public std::runtime_error
+{
+public:
+    template <typename... Parts>
+    explicit CompileError(const Parts &...parts)
+        : std::runtime_error(join(parts...))
+    {
+    }
+
+private:
+    template <typename... Parts>
+    static std::string join(const Parts &...parts)
+    {
+        std::ostringstream message;
+        (message << ... << parts);
+        return message.str();
+    }
+};
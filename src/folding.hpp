@@ -0,0 +1,113 @@
+#pragma once
+
+#include "./parser.hpp"
+
+#include <cstdint>
+#include <optional>
+
+// Replaces constant sub-trees of binary expressions with a single literal.
+// Arithmetic wraps around at 64 bits, divides and compares unsigned, the same
+// as the generated code. Divisions by zero are left in place so they still
+// fault at runtime.
+class ConstantFolder
+{
+public:
+    inline explicit ConstantFolder(node::NodeProg &prog)
+        : m_prog(prog)
+    {
+    }
+
+    void fold_prog()
+    {
+        // Every expression hangs off exactly one statement, so folding the
+        // statements in order reaches each of them once
+        for (const node::NodeStmt &stmt : m_prog.stmts)
+        {
+            if (stmt.expr != node::none)
+            {
+                fold_expr(stmt.expr);
+            }
+            if (stmt.index != node::none)
+            {
+                fold_expr(stmt.index);
+            }
+        }
+    }
+
+private:
+    // Returns the value of expr if it is constant. Constant expressions are
+    // rewritten in place to a single integer literal.
+    std::optional<uint64_t> fold_expr(const node::ExprId id)
+    {
+        const node::NodeExpr expr = m_prog.exprs[id];
+        switch (expr.kind)
+        {
+        case node::ExprKind::int_lit:
+            return expr.value();
+        case node::ExprKind::ident:
+            return {};
+        case node::ExprKind::array_lit:
+            for (const node::ExprId elem : m_prog.elements(id))
+            {
+                fold_expr(elem);
+            }
+            return {};
+        case node::ExprKind::array_fill:
+            fold_expr(expr.lhs);
+            return {};
+        case node::ExprKind::index:
+            fold_expr(expr.rhs);
+            return {};
+        default:
+            break;
+        }
+
+        const std::optional<uint64_t> a = fold_expr(expr.lhs);
+        const std::optional<uint64_t> b = fold_expr(expr.rhs);
+        if (!a.has_value() || !b.has_value())
+        {
+            return {};
+        }
+        const std::optional<uint64_t> value = apply(expr.kind, a.value(), b.value());
+        if (value.has_value())
+        {
+            m_prog.exprs[id] = node::NodeExpr::int_lit(value.value());
+        }
+        return value;
+    }
+
+    [[nodiscard]] static std::optional<uint64_t> apply(const node::ExprKind kind, const uint64_t a, const uint64_t b)
+    {
+        switch (kind)
+        {
+        case node::ExprKind::add:
+            return a + b;
+        case node::ExprKind::sub:
+            return a - b;
+        case node::ExprKind::mul:
+            return a * b;
+        case node::ExprKind::div:
+            if (b == 0)
+            {
+                return {};
+            }
+            return a / b;
+        case node::ExprKind::eq:
+            return a == b;
+        case node::ExprKind::ne:
+            return a != b;
+        case node::ExprKind::lt:
+            return a < b;
+        case node::ExprKind::le:
+            return a <= b;
+        case node::ExprKind::gt:
+            return a > b;
+        case node::ExprKind::ge:
+            return a >= b;
+        default:
+            return {};
+        }
+    }
+
+    node::NodeProg &m_prog;
+};
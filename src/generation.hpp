@@ -1,284 +1,795 @@
 #pragma once
 
-#include "./parser.hpp"
+#include "./ir.hpp"
+#include "./register_allocation.hpp"
+#include "./strength_reduction.hpp"
+#include "./x86.hpp"
 
-#include <sstream>
-#include <iostream>
-#include <vector>
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cassert>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+// The widest vector instructions the kernels may use. SSE2 is part of every
+// x86-64 CPU and does 2 elements at a time, AVX2 does 4 and none leaves the
+// kernels to loops over one element, still in xmm registers.
+enum class Simd : uint8_t
+{
+    none,
+    sse2,
+    avx2
+};
+
+constexpr std::array<std::string_view, 3> simd_names{"none", "sse2", "avx2"};
+
+[[nodiscard]] constexpr uint32_t simd_lanes(const Simd simd)
+{
+    return simd == Simd::avx2 ? 4 : simd == Simd::sse2 ? 2
+                                                       : 1;
+}
+
+// Emits x86-64 for the IR. Every value lives in the location picked by the
+// RegisterAllocator for its whole lifetime; rax and rdx serve as scratch
+// registers. Blocks are emitted in their order, a jump to the next block
+// falls through. The arrays follow the stack slots in the frame.
 class Generator
 {
 public:
-    inline explicit Generator(const node::NodeProg prog)
-        : m_prog(std::move(prog))
+    struct Stats
+    {
+        // Operations by a constant done without imul and div
+        size_t multiplications = 0;
+        size_t divisions = 0;
+        size_t vector_loops = 0; // over more than one element at a time
+    };
+
+    // fn has to outlive the generator
+    explicit Generator(const ir::Function &fn, const Simd simd = Simd::sse2)
+        : m_fn(fn),
+          m_lanes(simd_lanes(simd))
     {
     }
 
-    void gen_term(const node ::NodeTerm *term)
+    [[nodiscard]] std::vector<Instr> gen_prog()
     {
-        struct TermVisitor
+        m_allocation = RegisterAllocator(m_fn).allocate();
+        find_fused_comparisons();
+        uint64_t frame_size = m_allocation.slot_count * 8;
+        for (const uint32_t length : m_fn.arrays)
+        {
+            m_array_offsets.push_back(frame_size);
+            frame_size += uint64_t{length} * 8;
+        }
+        // The program never returns, so the frame is not given back
+        if (frame_size > 0)
         {
-            Generator &gen;
-            void operator()(const node::NodeTermIntLit *term_int_lit) const
+            emit(Op::sub, Operand::from_reg(Reg::rsp), Operand::from_imm(frame_size));
+        }
+        // Labels past the blocks are the trap and the loops of the kernels
+        m_next_label = m_fn.blocks.size() + 1;
+        thread_jumps();
+        for (ir::BlockId b = 0; b < m_fn.blocks.size(); b++)
+        {
+            if (m_forward[b] != b)
             {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
+                continue;
             }
-            void operator()(const node::NodeTermIdent *term_ident) const
+            if (b > 0)
             {
-                const auto it = std::ranges::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(),
-                                                     [&](const Var &var)
-                                                     { return var.name == term_ident->ident.value.value(); });
-                if (it == gen.m_vars.cend())
-                {
-                    std::cerr << "undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "]"; // *this offset is in bytes
-                gen.push(offset.str());
+                emit(Op::label, Operand::from_label(b));
             }
-            void operator()(const node::NodeTermParen *term_parem) const
+            for (const ir::ValueId v : m_fn.blocks[b].instrs)
             {
-                gen.gen_expr(term_parem->expr);
+                gen_instr(v);
             }
-        };
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
+            gen_term(b);
+        }
+        // An index out of bounds raises SIGILL
+        if (m_trap_used)
+        {
+            emit(Op::label, trap_label());
+            emit(Op::ud2);
+        }
+        return std::move(m_output);
+    }
+
+    [[nodiscard]] const Allocation &allocation() const
+    {
+        return m_allocation;
     }
 
-    void gen_bin_expr(const node::NodeBinExpr *bin_expr)
+    [[nodiscard]] const Stats &stats() const
     {
-        struct BinExprVisitor
+        return m_stats;
+    }
+
+private:
+    void emit(const Op op, const Operand dst = {}, const Operand src = {})
+    {
+        m_output.push_back({.op = op, .dst = dst, .src = src});
+    }
+
+    [[nodiscard]] const Operand &location(const ir::ValueId v) const
+    {
+        return m_allocation.locations[v];
+    }
+
+    void gen_instr(const ir::ValueId v)
+    {
+        const ir::Instr &instr = m_fn.values[v];
+        const Operand dst = location(v);
+        switch (instr.opcode)
         {
-            Generator &gen;
-            void operator()(const node::NodeBinExprAdd *add) const
+        case ir::Opcode::const_:
+            // Constants used as immediates have nothing to compute
+            if (dst.kind != Operand::Kind::imm)
             {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
+                move(dst, Operand::from_imm(instr.imm));
             }
-            void operator()(const node::NodeBinExprSub *sub) const
+            break;
+        case ir::Opcode::add:
+            gen_alu(Op::add, dst, instr, true);
+            break;
+        case ir::Opcode::sub:
+            gen_alu(Op::sub, dst, instr, false);
+            break;
+        case ir::Opcode::mul:
+            if (!gen_mul_const(dst, instr))
             {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
+                // Only the low 64 bits are kept, which are the same for signed and unsigned multiplication
+                gen_alu(Op::imul, dst, instr, true);
             }
-            void operator()(const node::NodeBinExprMulti *multi) const
+            break;
+        case ir::Opcode::div:
+            if (const std::optional<uint64_t> divisor = constant(instr.rhs); divisor.value_or(0) != 0)
             {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
+                gen_div_const(dst, location(instr.lhs), divisor.value());
+                break;
             }
-            void operator()(const node::NodeBinExprDiv *div) const
+            // A division by zero is left to fault
+            move(Operand::from_reg(Reg::rax), location(instr.lhs));
+            emit(Op::xor_, Operand::from_reg(Reg::rdx), Operand::from_reg(Reg::rdx));
+            emit(Op::div, location(instr.rhs));
+            move(dst, Operand::from_reg(Reg::rax));
+            break;
+        case ir::Opcode::eq:
+        case ir::Opcode::ne:
+        case ir::Opcode::lt:
+        case ir::Opcode::le:
+        case ir::Opcode::gt:
+        case ir::Opcode::ge:
+            // A comparison fused into a branch is computed by the branch
+            if (!m_fused[v])
             {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "  div rbx\n";
-                gen.push("rax");
+                emit(setcc_of(gen_cmp(instr)), Operand::from_reg(Reg::rax));
+                const Operand work = dst.kind == Operand::Kind::reg ? dst : Operand::from_reg(Reg::rax);
+                emit(Op::movzx, work, Operand::from_reg(Reg::rax));
+                move(dst, work);
             }
-        };
-        BinExprVisitor visitor{.gen = *this};
-        std::visit(visitor, bin_expr->var);
+            break;
+        case ir::Opcode::phi:
+            // Written by the predecessors
+            break;
+        case ir::Opcode::load:
+            move(dst, gen_element(instr));
+            break;
+        case ir::Opcode::store:
+            move(gen_element(instr), location(instr.rhs));
+            break;
+        case ir::Opcode::kernel:
+            gen_kernel(m_fn.kernel(v));
+            break;
+        }
     }
 
-    void gen_expr(const node::NodeExpr *expr)
+    [[nodiscard]] Operand trap_label() const
     {
-        struct ExprVisitor
+        return Operand::from_label(m_fn.blocks.size());
+    }
+
+    // The element a load or store accesses, after checking its index. The
+    // index is compared unsigned, so one check covers both ends.
+    Operand gen_element(const ir::Instr &instr)
+    {
+        const uint32_t length = m_fn.arrays[instr.imm];
+        const uint64_t offset = m_array_offsets[instr.imm];
+        if (const std::optional<uint64_t> index = constant(instr.lhs))
         {
-            Generator &gen;
-            void operator()(const node::NodeTerm *term)
+            if (index.value() >= length)
             {
-                gen.gen_term(term);
+                m_trap_used = true;
+                emit(Op::jmp, trap_label());
+                return Operand::from_mem(Reg::rsp, offset);
             }
-            void operator()(const node::NodeBinExpr *bin_expr) const
-            {
-                gen.gen_bin_expr(bin_expr);
-            }
-        };
-        ExprVisitor visitor{.gen = *this};
-        std::visit(visitor, expr->var);
+            return Operand::from_mem(Reg::rsp, offset + index.value() * 8);
+        }
+        Operand index = location(instr.lhs);
+        if (index.kind != Operand::Kind::reg)
+        {
+            move(Operand::from_reg(Reg::rax), index);
+            index = Operand::from_reg(Reg::rax);
+        }
+        m_trap_used = true;
+        emit(Op::cmp, index, Operand::from_imm(length));
+        emit(Op::jae, trap_label());
+        return Operand::from_mem(Reg::rsp, index.reg, 8, offset);
     }
 
-    void gen_scope(const node::NodeScope *scope)
+    // Broadcasts the scalars of the kernel into the vector registers of their
+    // index, then runs it over as many elements at a time as the vector
+    // registers take, and over the rest one at a time. rdx is the index of
+    // the element.
+    void gen_kernel(const ir::Kernel &kernel)
     {
-        begin_scope();
-        for (const node::NodeStmt *stmt : scope->stmts)
+        const uint32_t length = m_fn.arrays[kernel.dst];
+        const uint32_t lanes = length >= m_lanes ? m_lanes : 1;
+        for (size_t i = 0; i < kernel.scalars.size(); i++)
+        {
+            const Operand xmm = Operand::from_vector(static_cast<uint8_t>(i));
+            Operand scalar = location(kernel.scalars[i]);
+            if (scalar.kind == Operand::Kind::imm)
+            {
+                move(Operand::from_reg(Reg::rax), scalar);
+                scalar = Operand::from_reg(Reg::rax);
+            }
+            emit(Op::movq, xmm, scalar);
+            if (lanes == 2)
+            {
+                emit(Op::punpcklqdq, xmm, xmm);
+            }
+            else if (lanes == 4)
+            {
+                emit(Op::vpbroadcastq, Operand::from_vector(static_cast<uint8_t>(i), true), xmm);
+            }
+        }
+        const uint32_t vector_end = length - length % lanes;
+        emit(Op::xor_, Operand::from_reg(Reg::rdx), Operand::from_reg(Reg::rdx));
+        gen_kernel_loop(kernel, vector_end, lanes);
+        if (lanes > 1)
         {
-            gen_stmt(*stmt);
+            m_stats.vector_loops++;
+            if (lanes == 4)
+            {
+                emit(Op::vzeroupper);
+            }
+            if (vector_end < length)
+            {
+                gen_kernel_loop(kernel, length, 1);
+            }
         }
-        end_scope();
     }
 
-    void gen_if_pred(const node::NodeIfPred *pred, const std::string &end_label)
+    // Evaluates the kernel for lanes elements per iteration from rdx up to
+    // end. The stack of the evaluation is kept in the vector registers after
+    // those of the scalars; the scalars are used where they are, and only
+    // copied when they would be overwritten.
+    void gen_kernel_loop(const ir::Kernel &kernel, const uint32_t end, const uint32_t lanes)
     {
-        struct PredVisitor
+        const bool wide = lanes == 4;
+        const Op load = lanes == 1 ? Op::movq : Op::movdqu;
+        const auto reg = [&](const uint8_t number)
+        {
+            return Operand::from_vector(number, wide);
+        };
+        const auto element = [&](const ir::ArrayId array)
+        {
+            return Operand::from_mem(Reg::rsp, Reg::rdx, 8, m_array_offsets[array]);
+        };
+        const auto scalars = static_cast<uint8_t>(kernel.scalars.size());
+        std::array<bool, 16> busy{};
+        const auto take = [&]
         {
-            Generator &gen;
-            const std::string &end_label;
-            void operator()(const node::NodeIfPredElif *elif) const
+            auto number = scalars;
+            while (busy[number])
             {
-                gen.gen_expr(elif->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(elif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
+                number++;
+            }
+            assert(number < kernel_temps[0]);
+            busy[number] = true;
+            return number;
+        };
 
-                if (elif->pred.has_value())
-                {
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(elif->pred.value(), end_label);
-                }
+        const Operand loop = Operand::from_label(m_next_label++);
+        emit(Op::label, loop);
+        std::vector<uint8_t> &stack = m_vector_stack;
+        stack.clear();
+        for (const ir::KernelOp op : kernel.ops)
+        {
+            if (op.kind == ir::KernelOp::Kind::load)
+            {
+                const uint8_t number = take();
+                emit(load, reg(number), element(op.index));
+                stack.push_back(number);
+                continue;
             }
-            void operator()(const node::NodeIfPredElse *else_) const
+            if (op.kind == ir::KernelOp::Kind::scalar)
             {
-                gen.gen_scope(else_->scope);
+                stack.push_back(static_cast<uint8_t>(op.index));
+                continue;
             }
-        };
-        PredVisitor visitor({.gen = *this, .end_label = end_label});
-        std::visit(visitor, pred->var);
+            uint8_t b = stack.back();
+            stack.pop_back();
+            uint8_t a = stack.back();
+            stack.pop_back();
+            const bool commutative = op.kind != ir::KernelOp::Kind::sub;
+            // A constant goes right, where multiplications by it are cheaper
+            const bool a_constant = a < scalars && constant(kernel.scalars[a]).has_value();
+            const bool b_constant = b < scalars && constant(kernel.scalars[b]).has_value();
+            if (commutative && ((a < scalars && b >= scalars) || (a_constant && !b_constant)))
+            {
+                std::swap(a, b);
+            }
+            if (a < scalars)
+            {
+                const uint8_t copy = take();
+                emit(Op::movdqu, reg(copy), reg(a));
+                a = copy;
+            }
+            switch (op.kind)
+            {
+            case ir::KernelOp::Kind::add:
+                emit(Op::paddq, reg(a), reg(b));
+                break;
+            case ir::KernelOp::Kind::sub:
+                emit(Op::psubq, reg(a), reg(b));
+                break;
+            default:
+                gen_vector_mul(reg(a), reg(b), b < scalars ? constant(kernel.scalars[b]) : std::nullopt, wide);
+                break;
+            }
+            if (b >= scalars)
+            {
+                busy[b] = false;
+            }
+            stack.push_back(a);
+        }
+        emit(lanes == 1 ? Op::movq : Op::movdqu, element(kernel.dst), reg(stack.back()));
+        emit(Op::add, Operand::from_reg(Reg::rdx), Operand::from_imm(lanes));
+        emit(Op::cmp, Operand::from_reg(Reg::rdx), Operand::from_imm(end));
+        emit(Op::jb, loop);
     }
 
-    void gen_stmt(const node::NodeStmt &stmt)
+    // a *= b in every lane. There is no 64-bit multiplication before
+    // AVX-512, so the product is put together from the 32 x 32 bit ones of
+    // pmuludq: lo(a) * lo(b) + (hi(a) * lo(b) + lo(a) * hi(b)) << 32. b is
+    // constant when it is known, which drops the products of its zero
+    // high half, or all of them for a power of two.
+    void gen_vector_mul(const Operand a, const Operand b, const std::optional<uint64_t> constant, const bool wide)
     {
-        struct StmtVisitor
+        const Operand hi_a = Operand::from_vector(kernel_temps[0], wide);
+        const Operand hi_b = Operand::from_vector(kernel_temps[1], wide);
+        if (constant.has_value() && std::has_single_bit(constant.value()))
         {
-            Generator &gen;
-            void operator()(const node::NodeStmtExit *stmt_exit) const
-            {
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
-            }
-            void operator()(const node::NodeStmtLet *stmt_let) const
+            m_stats.multiplications++;
+            if (constant.value() != 1)
             {
-                if (std::ranges::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(),
-                                         [&](const Var &var)
-                                         { return var.name == stmt_let->ident.value.value(); }) != gen.m_vars.cend())
-                {
-                    std::cerr << "identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_vars.push_back({.name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size});
-                gen.gen_expr(stmt_let->expr);
+                emit(Op::psllq, a, Operand::from_imm(std::countr_zero(constant.value())));
             }
-            void operator()(const node::NodeStmtAssign *stmt_assign)
+            return;
+        }
+        emit(Op::movdqu, hi_a, a);
+        emit(Op::psrlq, hi_a, Operand::from_imm(32));
+        emit(Op::pmuludq, hi_a, b);
+        if (!constant.has_value() || constant.value() > UINT32_MAX)
+        {
+            emit(Op::movdqu, hi_b, b);
+            emit(Op::psrlq, hi_b, Operand::from_imm(32));
+            emit(Op::pmuludq, hi_b, a);
+            emit(Op::paddq, hi_a, hi_b);
+        }
+        emit(Op::psllq, hi_a, Operand::from_imm(32));
+        emit(Op::pmuludq, a, b);
+        emit(Op::paddq, a, hi_a);
+    }
+
+    // A comparison that a branch directly after it tests and nothing else
+    // uses only sets the flags for the conditional jump
+    void find_fused_comparisons()
+    {
+        std::vector<uint32_t> uses(m_fn.values.size(), 0);
+        for (const ir::Block &block : m_fn.blocks)
+        {
+            for (const ir::ValueId v : block.instrs)
             {
-                const auto it = std::ranges::find_if(gen.m_vars, [&](const Var &var)
-                                                    { return var.name == stmt_assign->ident.value.value(); });
-                if (it == gen.m_vars.end())
+                const ir::Instr &instr = m_fn.values[v];
+                if (instr.opcode == ir::Opcode::phi)
                 {
-                    std::cerr << "undeclared identifier: " << stmt_assign->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                    for (const ir::ValueId operand : m_fn.operands(v))
+                    {
+                        uses[operand]++;
+                    }
                 }
-                gen.gen_expr(stmt_assign->expr);
-                gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
-            }
-            void operator()(const node::NodeScope *scope) const
-            {
-                gen.m_output << "    ;; scope\n";
-                gen.gen_scope(scope);
-                gen.m_output << "    ;; scope\n";
-            }
-            void operator()(const node::NodeStmtIf *stmt_if) const
-            {
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                gen.m_output << label << ":\n";
-                if (stmt_if->pred.has_value())
+                else
                 {
-                    const std::string end_label = gen.create_label();
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
+                    ir::for_each_operand(m_fn, v, [&](const ir::ValueId operand)
+                                         { uses[operand]++; });
                 }
             }
-        };
-        StmtVisitor visitor{.gen = *this};
-        std::visit(visitor, stmt.var);
+            if (block.term.kind == ir::TermKind::branch || block.term.kind == ir::TermKind::exit)
+            {
+                uses[block.term.value]++;
+            }
+        }
+        m_fused.assign(m_fn.values.size(), false);
+        for (const ir::Block &block : m_fn.blocks)
+        {
+            if (block.term.kind == ir::TermKind::branch && !block.instrs.empty() &&
+                block.instrs.back() == block.term.value && ir::is_comparison(m_fn.values[block.term.value].opcode) &&
+                uses[block.term.value] == 1)
+            {
+                m_fused[block.term.value] = true;
+            }
+        }
+    }
+
+    // Emits the cmp of a comparison and returns the conditional jump taken
+    // when it holds
+    Op gen_cmp(const ir::Instr &instr)
+    {
+        Operand lhs = location(instr.lhs);
+        Operand rhs = location(instr.rhs);
+        ir::Opcode opcode = instr.opcode;
+        // Only the right operand can be an immediate
+        if (lhs.kind == Operand::Kind::imm && rhs.kind != Operand::Kind::imm)
+        {
+            std::swap(lhs, rhs);
+            opcode = mirror(opcode);
+        }
+        if (lhs.kind == Operand::Kind::imm || (lhs.kind == Operand::Kind::mem && rhs.kind == Operand::Kind::mem))
+        {
+            move(Operand::from_reg(Reg::rax), lhs);
+            lhs = Operand::from_reg(Reg::rax);
+        }
+        if (rhs.kind == Operand::Kind::imm && !is_imm32(rhs.value))
+        {
+            move(Operand::from_reg(Reg::rdx), rhs);
+            rhs = Operand::from_reg(Reg::rdx);
+        }
+        emit(Op::cmp, lhs, rhs);
+        switch (opcode)
+        {
+        case ir::Opcode::eq:
+            return Op::jz;
+        case ir::Opcode::ne:
+            return Op::jnz;
+        case ir::Opcode::lt:
+            return Op::jb;
+        case ir::Opcode::le:
+            return Op::jbe;
+        case ir::Opcode::gt:
+            return Op::ja;
+        default:
+            return Op::jae;
+        }
     }
 
-    [[nodiscard]] std::string gen_prog()
+    // The comparison with its operands swapped
+    [[nodiscard]] static ir::Opcode mirror(const ir::Opcode opcode)
     {
-        m_output << "global _start\n_start:\n";
+        switch (opcode)
+        {
+        case ir::Opcode::lt:
+            return ir::Opcode::gt;
+        case ir::Opcode::le:
+            return ir::Opcode::ge;
+        case ir::Opcode::gt:
+            return ir::Opcode::lt;
+        case ir::Opcode::ge:
+            return ir::Opcode::le;
+        default:
+            return opcode;
+        }
+    }
 
-        for (const node::NodeStmt *stmt : m_prog.stmts)
+    // dst = lhs op rhs, computed in dst itself when it is a register that
+    // does not hold rhs and in rax otherwise
+    void gen_alu(const Op op, const Operand dst, const ir::Instr &instr, const bool commutative)
+    {
+        const Operand lhs = location(instr.lhs);
+        const Operand rhs = location(instr.rhs);
+        if (dst.kind == Operand::Kind::reg && rhs == dst && commutative &&
+            (lhs.kind != Operand::Kind::imm || is_imm32(lhs.value)))
         {
-            gen_stmt(*stmt);
+            emit(op, dst, lhs);
+            return;
         }
+        const Operand work = dst.kind == Operand::Kind::reg && rhs != dst ? dst : Operand::from_reg(Reg::rax);
+        move(work, lhs);
+        emit(op, work, rhs);
+        move(dst, work);
+    }
 
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
-        return m_output.str();
+    [[nodiscard]] std::optional<uint64_t> constant(const ir::ValueId v) const
+    {
+        if (m_fn.values[v].opcode != ir::Opcode::const_)
+        {
+            return {};
+        }
+        return m_fn.values[v].imm;
     }
 
-private:
-    void push(const std::string &reg)
+    // dst = x * (factor * 2^shift) as lea and shl. Returns false when neither
+    // operand is such a constant.
+    bool gen_mul_const(const Operand dst, const ir::Instr &instr)
     {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
+        const auto multiplier_of = [&](const ir::ValueId v)
+        {
+            const std::optional<uint64_t> value = constant(v);
+            return value.has_value() ? reduce_multiplier(value.value()) : std::nullopt;
+        };
+        ir::ValueId x = instr.lhs;
+        std::optional<Multiplier> multiplier = multiplier_of(instr.rhs);
+        if (!multiplier.has_value())
+        {
+            x = instr.rhs;
+            multiplier = multiplier_of(instr.lhs);
+        }
+        if (!multiplier.has_value())
+        {
+            return false;
+        }
+        m_stats.multiplications++;
+        const Operand work = dst.kind == Operand::Kind::reg ? dst : Operand::from_reg(Reg::rax);
+        Operand product = location(x);
+        if (product.kind != Operand::Kind::reg)
+        {
+            move(work, product);
+            product = work;
+        }
+        if (multiplier->factor != 1)
+        {
+            const auto scale = static_cast<uint8_t>(multiplier->factor - 1);
+            emit(Op::lea, work, Operand::from_address(product.reg, product.reg, scale));
+            product = work;
+        }
+        if (multiplier->shift != 0)
+        {
+            move(work, product);
+            emit(Op::shl, work, Operand::from_imm(multiplier->shift));
+            product = work;
+        }
+        move(dst, product);
+        return true;
+    }
+
+    // dst = x / divisor as a shift or a multiplication by the reciprocal,
+    // which mul leaves in rdx
+    void gen_div_const(const Operand dst, const Operand x, const uint64_t divisor)
+    {
+        m_stats.divisions++;
+        const Reciprocal reciprocal = ::reciprocal(divisor);
+        if (reciprocal.magic == 0)
+        {
+            const Operand work = dst.kind == Operand::Kind::reg ? dst : Operand::from_reg(Reg::rax);
+            move(work, x);
+            if (reciprocal.shift != 0)
+            {
+                emit(Op::shr, work, Operand::from_imm(reciprocal.shift));
+            }
+            move(dst, work);
+            return;
+        }
+        emit(Op::mov, Operand::from_reg(Reg::rax), Operand::from_imm(reciprocal.magic));
+        Operand factor = x;
+        if (x.kind == Operand::Kind::imm)
+        {
+            factor = Operand::from_reg(Reg::rdx);
+            move(factor, x);
+        }
+        emit(Op::mul, factor);
+        Operand quotient = Operand::from_reg(Reg::rdx);
+        if (reciprocal.add)
+        {
+            // q + (x - q) / 2 is (x + q) / 2 without overflowing
+            quotient = Operand::from_reg(Reg::rax);
+            move(quotient, x);
+            emit(Op::sub, quotient, Operand::from_reg(Reg::rdx));
+            emit(Op::shr, quotient, Operand::from_imm(1));
+            emit(Op::add, quotient, Operand::from_reg(Reg::rdx));
+        }
+        emit(Op::shr, quotient, Operand::from_imm(reciprocal.shift));
+        move(dst, quotient);
+    }
+
+    void gen_term(const ir::BlockId b)
+    {
+        const ir::Terminator &term = m_fn.blocks[b].term;
+        switch (term.kind)
+        {
+        case ir::TermKind::jump:
+            gen_phi_copies(b, term.targets[0]);
+            jump_to(b, term.targets[0]);
+            break;
+        case ir::TermKind::branch:
+        {
+            // Only jumps lead to phis, so there is nothing to copy here
+            const Operand cond = location(term.value);
+            if (cond.kind == Operand::Kind::imm)
+            {
+                jump_to(b, term.targets[cond.value != 0 ? 0 : 1]);
+                break;
+            }
+            Op jcc = Op::jnz;
+            if (m_fused[term.value])
+            {
+                jcc = gen_cmp(m_fn.values[term.value]);
+            }
+            else
+            {
+                const Operand tested = cond.kind == Operand::Kind::reg ? cond : Operand::from_reg(Reg::rax);
+                move(tested, cond);
+                emit(Op::test, tested, tested);
+            }
+            // Whichever target follows is reached by falling through
+            if (m_forward[term.targets[1]] == m_fall_through[b])
+            {
+                emit(jcc, Operand::from_label(m_forward[term.targets[0]]));
+                break;
+            }
+            emit(negate_jump(jcc), Operand::from_label(m_forward[term.targets[1]]));
+            jump_to(b, term.targets[0]);
+            break;
+        }
+        case ir::TermKind::exit:
+            emit(Op::mov, Operand::from_reg(Reg::rax), Operand::from_imm(60));
+            move(Operand::from_reg(Reg::rdi), location(term.value));
+            emit(Op::syscall);
+            break;
+        case ir::TermKind::none:
+            assert(false);
+            break;
+        }
     }
 
-    void pop(const std::string &reg)
+    void jump_to(const ir::BlockId from, const ir::BlockId target)
     {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+        if (m_forward[target] != m_fall_through[from])
+        {
+            emit(Op::jmp, Operand::from_label(m_forward[target]));
+        }
     }
 
-    void begin_scope()
+    // A block that only jumps on without copying phis is left out and the
+    // jumps to it go straight to where it leads. This makes the bottom test
+    // of a loop whose phis share their locations with their operands the
+    // single branch back to the header.
+    void thread_jumps()
     {
-        m_scope.push_back(m_vars.size());
+        const size_t count = m_fn.blocks.size();
+        m_forward.assign(count, ir::none);
+        std::vector<ir::BlockId> path;
+        for (ir::BlockId b = 0; b < count; b++)
+        {
+            ir::BlockId target = b;
+            // Blocks on the path point to themselves, so a cycle of them stops
+            while (m_forward[target] == ir::none && passes_through(target))
+            {
+                m_forward[target] = target;
+                path.push_back(target);
+                target = m_fn.blocks[target].term.targets[0];
+            }
+            if (m_forward[target] == ir::none)
+            {
+                m_forward[target] = target;
+            }
+            for (const ir::BlockId passed : path)
+            {
+                m_forward[passed] = m_forward[target];
+            }
+            path.clear();
+        }
+        m_fall_through.assign(count, ir::none);
+        for (auto b = static_cast<ir::BlockId>(count - 1); b-- > 0;)
+        {
+            m_fall_through[b] = m_forward[b + 1] == b + 1 ? b + 1 : m_fall_through[b + 1];
+        }
     }
-    void end_scope()
+
+    // Code starts with the first block, which is always kept
+    [[nodiscard]] bool passes_through(const ir::BlockId b) const
     {
-        const size_t pop_count = m_vars.size() - m_scope.back();
-        m_output << "    add rsp, " << pop_count * 8 << "\n"; // Multiply by 8 since each variable is 8 bytes
-        m_stack_size -= pop_count;
-        for (size_t i = 0; i < pop_count; i++)
+        const ir::Block &block = m_fn.blocks[b];
+        if (b == 0 || !block.instrs.empty() || block.term.kind != ir::TermKind::jump)
         {
-            m_vars.pop_back();
+            return false;
         }
-        m_scope.pop_back();
+        const ir::Block &target = m_fn.blocks[block.term.targets[0]];
+        const size_t index = std::ranges::find(target.preds, b) - target.preds.begin();
+        for (const ir::ValueId v : target.instrs)
+        {
+            if (m_fn.values[v].opcode != ir::Opcode::phi)
+            {
+                break;
+            }
+            if (location(v) != location(m_fn.operands(v)[index]))
+            {
+                return false;
+            }
+        }
+        return true;
     }
 
-    std::string create_label()
+    // Sets the phis of target to their operands coming from pred. The copies
+    // happen all at once, so a cycle of them is broken by saving one
+    // location in rax first.
+    void gen_phi_copies(const ir::BlockId pred, const ir::BlockId target)
     {
-        std::stringstream ss;
-        ss << "label" << m_label_count++;
-        return ss.str();
+        const ir::Block &block = m_fn.blocks[target];
+        const size_t index = std::ranges::find(block.preds, pred) - block.preds.begin();
+        std::vector<std::pair<Operand, Operand>> copies;
+        for (const ir::ValueId v : block.instrs)
+        {
+            if (m_fn.values[v].opcode != ir::Opcode::phi)
+            {
+                break;
+            }
+            const Operand dst = location(v);
+            const Operand src = location(m_fn.operands(v)[index]);
+            if (dst != src)
+            {
+                copies.emplace_back(dst, src);
+            }
+        }
+
+        while (!copies.empty())
+        {
+            // A copy can go first when no other copy still reads its destination
+            const auto ready = std::ranges::find_if(copies, [&](const auto &copy)
+                                                    { return std::ranges::none_of(copies, [&](const auto &other)
+                                                                                  { return other.second == copy.first; }); });
+            if (ready != copies.end())
+            {
+                move(ready->first, ready->second);
+                copies.erase(ready);
+                continue;
+            }
+            const Operand saved = copies.front().first;
+            move(Operand::from_reg(Reg::rax), saved);
+            for (auto &copy : copies)
+            {
+                if (copy.second == saved)
+                {
+                    copy.second = Operand::from_reg(Reg::rax);
+                }
+            }
+        }
     }
 
-    struct Var
+    // mov with the forms x86 lacks (memory to memory, 64 bit immediate to
+    // memory) going through rdx
+    void move(const Operand dst, const Operand src)
     {
-        std::string name;
-        size_t stack_loc;
-    };
+        if (dst == src)
+        {
+            return;
+        }
+        if (dst.kind == Operand::Kind::mem &&
+            (src.kind == Operand::Kind::mem || (src.kind == Operand::Kind::imm && !is_imm32(src.value))))
+        {
+            emit(Op::mov, Operand::from_reg(Reg::rdx), src);
+            emit(Op::mov, dst, Operand::from_reg(Reg::rdx));
+            return;
+        }
+        emit(Op::mov, dst, src);
+    }
+
+    // The vector registers multiplications take for their partial products
+    static constexpr std::array<uint8_t, 2> kernel_temps{14, 15};
 
-    const node::NodeProg m_prog;
-    std::stringstream m_output;
-    size_t m_stack_size = 0;
-    std::vector<Var> m_vars{};
-    std::vector<size_t> m_scope{};
-    int m_label_count = 0;
+    const ir::Function &m_fn;
+    uint32_t m_lanes;
+    Allocation m_allocation{};
+    std::vector<Instr> m_output{};
+    std::vector<bool> m_fused{};             // comparisons computed by the branch using them
+    std::vector<ir::BlockId> m_forward{};      // where a jump to each block lands, see thread_jumps
+    std::vector<ir::BlockId> m_fall_through{}; // the block laid out after each one, none for the last
+    std::vector<uint64_t> m_array_offsets{}; // from rsp
+    size_t m_next_label = 0;
+    bool m_trap_used = false;
+    std::vector<uint8_t> m_vector_stack{}; // of the kernel being evaluated
+    Stats m_stats{};
 };
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Fast non-cryptographic 128-bit hash for cache keys. Two independent 64-bit
+// lanes consume 8 bytes per step; every update also mixes in its length, so
+// hashing "ab" then "c" differs from "a" then "bc".
+class Hasher
+{
+public:
+    Hasher &update(const std::string_view data)
+    {
+        const char *pos = data.data();
+        size_t remaining = data.size();
+        while (remaining >= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, pos, 8);
+            mix(word);
+            pos += 8;
+            remaining -= 8;
+        }
+        uint64_t tail = 0;
+        if (remaining > 0)
+        {
+            std::memcpy(&tail, pos, remaining);
+        }
+        mix(tail);
+        mix(data.size());
+        return *this;
+    }
+
+    Hasher &update(const uint64_t value)
+    {
+        mix(value);
+        return *this;
+    }
+
+    // 32 lowercase hex digits
+    [[nodiscard]] std::string hex() const
+    {
+        constexpr std::string_view digits = "0123456789abcdef";
+        std::string out(32, '0');
+        const uint64_t lanes[2]{finalize(m_a ^ m_b), finalize(m_b + m_a)};
+        for (size_t i = 0; i < 32; i++)
+        {
+            out[i] = digits[(lanes[i / 16] >> (60 - 4 * (i % 16))) & 0xF];
+        }
+        return out;
+    }
+
+private:
+    void mix(const uint64_t word)
+    {
+        m_a = rotl(m_a ^ (word * 0x87C37B91114253D5), 31) * 0x4CF5AD432745937F;
+        m_b = rotl(m_b + (word * 0x9E3779B97F4A7C15), 27) * 0xC2B2AE3D27D4EB4F ^ m_a;
+    }
+
+    [[nodiscard]] static uint64_t rotl(const uint64_t value, const int bits)
+    {
+        return value << bits | value >> (64 - bits);
+    }
+
+    // Avalanche of murmur3
+    [[nodiscard]] static uint64_t finalize(uint64_t value)
+    {
+        value ^= value >> 33;
+        value *= 0xFF51AFD7ED558CCD;
+        value ^= value >> 33;
+        value *= 0xC4CEB9FE1A85EC53;
+        value ^= value >> 33;
+        return value;
+    }
+
+    uint64_t m_a = 0x243F6A8885A308D3;
+    uint64_t m_b = 0x13198A2E03707344;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Dense id of an interned identifier
+using Symbol = uint32_t;
+
+// Maps each distinct identifier to a Symbol, so later stages compare and
+// index names as integers. Ids are handed out in order starting at 0.
+class Interner
+{
+public:
+    Symbol intern(const std::string_view name)
+    {
+        const auto it = m_symbols.find(name);
+        if (it != m_symbols.end())
+        {
+            return it->second;
+        }
+        const auto symbol = static_cast<Symbol>(m_names.size());
+        // Elements of a deque never move, so the map can key on views of them
+        m_symbols.emplace(m_names.emplace_back(name), symbol);
+        return symbol;
+    }
+
+    [[nodiscard]] std::string_view name(const Symbol symbol) const
+    {
+        return m_names[symbol];
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_names.size();
+    }
+
+private:
+    std::unordered_map<std::string_view, Symbol> m_symbols{};
+    std::deque<std::string> m_names{};
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "./bytecode.hpp"
+
+#include <algorithm>
+#include <array>
+#include <csignal>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Runs bytecode with threaded dispatch: every handler ends in a computed
+// goto to the next one (a GCC and Clang extension), which gives each of
+// them an indirect branch of its own for the predictor to learn instead of
+// the single one of a switch. The arithmetic is the one of the generated
+// code: 64 bits wrapping, unsigned division and comparisons.
+class Interpreter
+{
+public:
+    // Returns the exit status, which like that of a process is the low byte
+    // of the value passed to exit. A division by zero raises SIGFPE and an
+    // index out of bounds SIGILL, the signals the generated code gets.
+    [[nodiscard]] int run(const bc::Program &program)
+    {
+        m_regs.assign(program.frame_size, 0);
+        m_regs.insert(m_regs.end(), program.constants.begin(), program.constants.end());
+        uint64_t *const r = m_regs.data();
+        const bc::Instr *const code = program.code.data();
+        const bc::Instr *pc = code;
+
+        // In the order of bc::Opcode
+        static constexpr std::array<void *, bc::opcode_count> handlers{
+            &&mov, &&add, &&sub, &&mul, &&div, &&eq, &&ne, &&lt, &&le, &&gt, &&ge,
+            &&jmp, &&jz, &&jnz, &&jeq, &&jne, &&jlt, &&jle, &&jgt, &&jge, &&exit,
+            &&load, &&store, &&vmov, &&vfill, &&vadd, &&vsub, &&vmul};
+#define DISPATCH() goto *handlers[static_cast<size_t>(pc->op)]
+
+        DISPATCH();
+    mov:
+        r[pc->a] = r[pc->b];
+        pc++;
+        DISPATCH();
+    add:
+        r[pc->a] = r[pc->b] + r[pc->c];
+        pc++;
+        DISPATCH();
+    sub:
+        r[pc->a] = r[pc->b] - r[pc->c];
+        pc++;
+        DISPATCH();
+    mul:
+        r[pc->a] = r[pc->b] * r[pc->c];
+        pc++;
+        DISPATCH();
+    div:
+        if (r[pc->c] == 0)
+        {
+            std::raise(SIGFPE);
+            // Only reached when the signal is handled, the status the shell
+            // reports for it then
+            return 128 + SIGFPE;
+        }
+        r[pc->a] = r[pc->b] / r[pc->c];
+        pc++;
+        DISPATCH();
+    eq:
+        r[pc->a] = r[pc->b] == r[pc->c];
+        pc++;
+        DISPATCH();
+    ne:
+        r[pc->a] = r[pc->b] != r[pc->c];
+        pc++;
+        DISPATCH();
+    lt:
+        r[pc->a] = r[pc->b] < r[pc->c];
+        pc++;
+        DISPATCH();
+    le:
+        r[pc->a] = r[pc->b] <= r[pc->c];
+        pc++;
+        DISPATCH();
+    gt:
+        r[pc->a] = r[pc->b] > r[pc->c];
+        pc++;
+        DISPATCH();
+    ge:
+        r[pc->a] = r[pc->b] >= r[pc->c];
+        pc++;
+        DISPATCH();
+    jmp:
+        pc = code + pc->a;
+        DISPATCH();
+    jz:
+        pc = r[pc->b] == 0 ? code + pc->a : pc + 1;
+        DISPATCH();
+    jnz:
+        pc = r[pc->b] != 0 ? code + pc->a : pc + 1;
+        DISPATCH();
+    jeq:
+        pc = r[pc->b] == r[pc->c] ? code + pc->a : pc + 1;
+        DISPATCH();
+    jne:
+        pc = r[pc->b] != r[pc->c] ? code + pc->a : pc + 1;
+        DISPATCH();
+    jlt:
+        pc = r[pc->b] < r[pc->c] ? code + pc->a : pc + 1;
+        DISPATCH();
+    jle:
+        pc = r[pc->b] <= r[pc->c] ? code + pc->a : pc + 1;
+        DISPATCH();
+    jgt:
+        pc = r[pc->b] > r[pc->c] ? code + pc->a : pc + 1;
+        DISPATCH();
+    jge:
+        pc = r[pc->b] >= r[pc->c] ? code + pc->a : pc + 1;
+        DISPATCH();
+    exit:
+        return static_cast<int>(r[pc->b] & 0xFF);
+    load:
+        if (r[pc->c] >= pc->n)
+        {
+            goto out_of_bounds;
+        }
+        r[pc->a] = r[pc->b + r[pc->c]];
+        pc++;
+        DISPATCH();
+    store:
+        if (r[pc->b] >= pc->n)
+        {
+            goto out_of_bounds;
+        }
+        r[pc->a + r[pc->b]] = r[pc->c];
+        pc++;
+        DISPATCH();
+    vmov:
+        std::copy_n(r + pc->b, pc->n, r + pc->a);
+        pc++;
+        DISPATCH();
+    vfill:
+        std::fill_n(r + pc->a, pc->n, r[pc->b]);
+        pc++;
+        DISPATCH();
+    vadd:
+        std::transform(r + pc->b, r + pc->b + pc->n, r + pc->c, r + pc->a, std::plus<>());
+        pc++;
+        DISPATCH();
+    vsub:
+        std::transform(r + pc->b, r + pc->b + pc->n, r + pc->c, r + pc->a, std::minus<>());
+        pc++;
+        DISPATCH();
+    vmul:
+        std::transform(r + pc->b, r + pc->b + pc->n, r + pc->c, r + pc->a, std::multiplies<>());
+        pc++;
+        DISPATCH();
+    out_of_bounds:
+        std::raise(SIGILL);
+        return 128 + SIGILL;
+#undef DISPATCH
+    }
+
+private:
+    std::vector<uint64_t> m_regs{}; // reused by the next run
+};
@@ -0,0 +1,914 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./error.hpp"
+#include "./output_buffer.hpp"
+
+// Three-address intermediate representation in SSA form. A function is a
+// control flow graph of basic blocks; every instruction defines exactly one
+// value, referenced by its index into Function::values, and ends its block
+// with a terminator. Values are never reassigned, variables that are
+// assigned on several paths are merged by phi instructions at the start of
+// the block where the paths join.
+namespace ir
+{
+    using ValueId = uint32_t;
+    using BlockId = uint32_t;
+    using ArrayId = uint32_t;
+
+    // Index of a missing value or block
+    constexpr uint32_t none = UINT32_MAX;
+
+    enum class Opcode : uint8_t
+    {
+        const_,
+        add,
+        sub,
+        mul,
+        div,
+        eq, // the comparisons are unsigned and yield 0 or 1
+        ne,
+        lt,
+        le,
+        gt,
+        ge,
+        phi,
+        // Arrays are not SSA values but memory of a fixed length, written by
+        // stores and kernels. An index out of bounds traps at runtime.
+        load,  // element lhs of array imm
+        store, // rhs to element lhs of array imm
+        kernel // index imm into Function::kernels
+    };
+
+    [[nodiscard]] constexpr bool is_binary(const Opcode opcode)
+    {
+        return opcode >= Opcode::add && opcode <= Opcode::ge;
+    }
+
+    // Stores and kernels only write memory, nothing uses them as operand
+    [[nodiscard]] constexpr bool has_result(const Opcode opcode)
+    {
+        return opcode != Opcode::store && opcode != Opcode::kernel;
+    }
+
+    [[nodiscard]] constexpr bool is_comparison(const Opcode opcode)
+    {
+        return opcode >= Opcode::eq && opcode <= Opcode::ge;
+    }
+
+    struct Instr
+    {
+        Opcode opcode;
+        BlockId block = none;
+        ValueId lhs = none; // binary operators, load and store
+        ValueId rhs = none;
+        uint64_t imm = 0; // const: the value, phi: index into Function::phi_operands, load and store: the array
+    };
+
+    // One step of an element-wise expression, which is evaluated for every
+    // element i in postfix order on a stack
+    struct KernelOp
+    {
+        enum class Kind : uint8_t
+        {
+            load,   // pushes element i of the array index
+            scalar, // pushes Kernel::scalars[index], the same for every element
+            add,    // replace the top two entries with the result
+            sub,
+            mul
+        };
+
+        Kind kind;
+        uint32_t index = 0;
+
+        [[nodiscard]] bool is_leaf() const
+        {
+            return kind == Kind::load || kind == Kind::scalar;
+        }
+    };
+
+    // Writes the expression to every element of dst. All elements of the
+    // arrays it reads are read before the first one is written, which only
+    // makes a difference when dst is read too, and then only at element i.
+    struct Kernel
+    {
+        ArrayId dst;
+        std::vector<KernelOp> ops{};
+        std::vector<ValueId> scalars{};
+    };
+
+    enum class TermKind : uint8_t
+    {
+        none, // only while the block is being built
+        jump,
+        branch,
+        exit
+    };
+
+    struct Terminator
+    {
+        TermKind kind = TermKind::none;
+        ValueId value = none; // branch: the condition, exit: the status
+        // jump: the target, branch: taken when the condition is not zero and when it is
+        std::array<BlockId, 2> targets{none, none};
+
+        [[nodiscard]] std::span<const BlockId> successors() const
+        {
+            const size_t count = kind == TermKind::jump ? 1 : kind == TermKind::branch ? 2
+                                                                                       : 0;
+            return std::span(targets).first(count);
+        }
+    };
+
+    struct Block
+    {
+        std::vector<ValueId> instrs{}; // phis come first
+        std::vector<BlockId> preds{};  // in the order of the operands of the phis
+        Terminator term{};
+    };
+
+    // Blocks are numbered in the order they are laid out, the entry being the
+    // first, and values in the order of their blocks and instructions.
+    struct Function
+    {
+        std::vector<Instr> values;
+        std::vector<Block> blocks;
+        std::vector<std::vector<ValueId>> phi_operands;
+        std::vector<uint32_t> arrays; // the length of each
+        std::vector<Kernel> kernels;
+
+        [[nodiscard]] std::span<const ValueId> operands(const ValueId phi) const
+        {
+            return phi_operands[values[phi].imm];
+        }
+
+        [[nodiscard]] size_t phi_count() const
+        {
+            return phi_operands.size();
+        }
+
+        [[nodiscard]] const Kernel &kernel(const ValueId v) const
+        {
+            return kernels[values[v].imm];
+        }
+    };
+
+    // Calls f with every operand of v, which is not a phi
+    template <typename F>
+    void for_each_operand(const Function &fn, const ValueId v, F &&f)
+    {
+        const Instr &instr = fn.values[v];
+        switch (instr.opcode)
+        {
+        case Opcode::const_:
+        case Opcode::phi:
+            break;
+        case Opcode::kernel:
+            for (const ValueId scalar : fn.kernel(v).scalars)
+            {
+                f(scalar);
+            }
+            break;
+        case Opcode::load:
+            f(instr.lhs);
+            break;
+        default:
+            f(instr.lhs);
+            f(instr.rhs);
+            break;
+        }
+    }
+
+    inline std::string_view opcode_name(const Opcode opcode)
+    {
+        static constexpr std::array<std::string_view, 15> names{"const", "add", "sub", "mul", "div", "eq", "ne", "lt",
+                                                                "le", "gt", "ge", "phi", "load", "store", "kernel"};
+        return names[static_cast<size_t>(opcode)];
+    }
+
+    inline void append_value(OutputBuffer &output, const ValueId value)
+    {
+        output.append('v').append_uint(value);
+    }
+
+    inline void append_block(OutputBuffer &output, const BlockId block)
+    {
+        output.append('b').append_uint(block);
+    }
+
+    inline void append_array(OutputBuffer &output, const ArrayId array)
+    {
+        output.append('a').append_uint(array);
+    }
+
+    // The ops of a kernel in postfix order
+    inline void append_kernel(OutputBuffer &output, const Kernel &kernel)
+    {
+        static constexpr std::array<std::string_view, 3> operators{"add", "sub", "mul"};
+        append_array(output, kernel.dst);
+        output.append(',');
+        for (const KernelOp op : kernel.ops)
+        {
+            output.append(' ');
+            switch (op.kind)
+            {
+            case KernelOp::Kind::load:
+                append_array(output, op.index);
+                break;
+            case KernelOp::Kind::scalar:
+                append_value(output, kernel.scalars[op.index]);
+                break;
+            default:
+                output.append(operators[static_cast<size_t>(op.kind) - static_cast<size_t>(KernelOp::Kind::add)]);
+                break;
+            }
+        }
+    }
+
+    // Renders fn as text at the end of output, one instruction per line
+    inline void append_ir(OutputBuffer &output, const Function &fn)
+    {
+        if (!fn.arrays.empty())
+        {
+            output.append("arrays:");
+            for (ArrayId a = 0; a < fn.arrays.size(); a++)
+            {
+                output.append(' ');
+                append_array(output, a);
+                output.append('[').append_uint(fn.arrays[a]).append(']');
+            }
+            output.append('\n');
+        }
+        for (BlockId b = 0; b < fn.blocks.size(); b++)
+        {
+            const Block &block = fn.blocks[b];
+            append_block(output, b);
+            output.append(':');
+            for (size_t i = 0; i < block.preds.size(); i++)
+            {
+                output.append(i == 0 ? "    ; preds " : ", ");
+                append_block(output, block.preds[i]);
+            }
+            output.append('\n');
+            for (const ValueId v : block.instrs)
+            {
+                const Instr &instr = fn.values[v];
+                output.append("    ");
+                if (has_result(instr.opcode))
+                {
+                    append_value(output, v);
+                    output.append(" = ");
+                }
+                output.append(opcode_name(instr.opcode));
+                if (instr.opcode == Opcode::const_)
+                {
+                    output.append(' ').append_uint(instr.imm);
+                }
+                else if (instr.opcode == Opcode::phi)
+                {
+                    const std::span<const ValueId> operands = fn.operands(v);
+                    for (size_t i = 0; i < operands.size(); i++)
+                    {
+                        output.append(i == 0 ? " [" : ", [");
+                        append_value(output, operands[i]);
+                        output.append(", ");
+                        append_block(output, block.preds[i]);
+                        output.append(']');
+                    }
+                }
+                else if (instr.opcode == Opcode::kernel)
+                {
+                    output.append(' ');
+                    append_kernel(output, fn.kernel(v));
+                }
+                else if (instr.opcode == Opcode::load || instr.opcode == Opcode::store)
+                {
+                    output.append(' ');
+                    append_array(output, static_cast<ArrayId>(instr.imm));
+                    output.append('[');
+                    append_value(output, instr.lhs);
+                    output.append(']');
+                    if (instr.opcode == Opcode::store)
+                    {
+                        output.append(", ");
+                        append_value(output, instr.rhs);
+                    }
+                }
+                else
+                {
+                    output.append(' ');
+                    append_value(output, instr.lhs);
+                    output.append(", ");
+                    append_value(output, instr.rhs);
+                }
+                output.append('\n');
+            }
+            const Terminator &term = block.term;
+            switch (term.kind)
+            {
+            case TermKind::none:
+                output.append("    <no terminator>\n");
+                break;
+            case TermKind::jump:
+                output.append("    jump ");
+                append_block(output, term.targets[0]);
+                output.append('\n');
+                break;
+            case TermKind::branch:
+                output.append("    branch ");
+                append_value(output, term.value);
+                output.append(", ");
+                append_block(output, term.targets[0]);
+                output.append(", ");
+                append_block(output, term.targets[1]);
+                output.append('\n');
+                break;
+            case TermKind::exit:
+                output.append("    exit ");
+                append_value(output, term.value);
+                output.append('\n');
+                break;
+            }
+        }
+    }
+
+    // Values standing for the phis that were removed because they turned out
+    // trivial, a phi whose operands are all the same value (or itself) being
+    // that value
+    class Replacements
+    {
+    public:
+        Replacements() = default;
+
+        explicit Replacements(const size_t value_count)
+            : m_replaced(value_count, none)
+        {
+        }
+
+        // Makes room for a newly created value
+        void add()
+        {
+            m_replaced.push_back(none);
+        }
+
+        [[nodiscard]] bool is_replaced(const ValueId v) const
+        {
+            return m_replaced[v] != none;
+        }
+
+        ValueId resolve(ValueId v)
+        {
+            ValueId root = v;
+            while (m_replaced[root] != none)
+            {
+                root = m_replaced[root];
+            }
+            while (m_replaced[v] != none)
+            {
+                v = std::exchange(m_replaced[v], root);
+            }
+            return root;
+        }
+
+        // Returns the value replacing phi, or phi itself when it is not trivial
+        ValueId try_remove_trivial_phi(const Function &fn, const ValueId phi)
+        {
+            ValueId same = none;
+            for (const ValueId operand : fn.operands(phi))
+            {
+                const ValueId value = resolve(operand);
+                if (value == same || value == phi)
+                {
+                    continue;
+                }
+                if (same != none)
+                {
+                    return phi;
+                }
+                same = value;
+            }
+            if (same == none)
+            {
+                return phi;
+            }
+            m_replaced[phi] = same;
+            return same;
+        }
+
+    private:
+        std::vector<ValueId> m_replaced{};
+    };
+
+    // Blocks reachable from the entry in reverse postorder. Successors are
+    // visited last to first, so the first target of a branch directly follows it.
+    inline std::vector<BlockId> reverse_postorder(const Function &fn)
+    {
+        std::vector<BlockId> order;
+        std::vector<bool> visited(fn.blocks.size(), false);
+        std::vector<std::pair<BlockId, size_t>> stack{{0, 0}};
+        visited[0] = true;
+        while (!stack.empty())
+        {
+            auto &[b, next] = stack.back();
+            const std::span<const BlockId> succs = fn.blocks[b].term.successors();
+            if (next < succs.size())
+            {
+                const BlockId succ = succs[succs.size() - 1 - next++];
+                if (!visited[succ])
+                {
+                    visited[succ] = true;
+                    stack.emplace_back(succ, 0);
+                }
+                continue;
+            }
+            order.push_back(b);
+            stack.pop_back();
+        }
+        std::ranges::reverse(order);
+        return order;
+    }
+
+    struct Removed
+    {
+        size_t blocks = 0;
+        size_t values = 0; // unreachable or dead
+        size_t phis = 0;   // trivial
+    };
+
+    // Cleans up after a pass: drops the blocks that cannot be reached from the
+    // entry, the operands of the phis coming from them, the values marked in
+    // dead (when given) and every phi left trivial. Blocks are then renumbered
+    // in reverse postorder, values in block order and kernels in the order
+    // of theirs.
+    inline Removed compact(Function &fn, Replacements &replaced, const std::vector<bool> &dead = {})
+    {
+        const std::vector<BlockId> order = reverse_postorder(fn);
+        std::vector<BlockId> block_ids(fn.blocks.size(), none);
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            block_ids[order[i]] = static_cast<BlockId>(i);
+        }
+
+        for (const BlockId b : order)
+        {
+            Block &block = fn.blocks[b];
+            for (const ValueId v : block.instrs)
+            {
+                if (fn.values[v].opcode != Opcode::phi)
+                {
+                    break;
+                }
+                std::vector<ValueId> &operands = fn.phi_operands[fn.values[v].imm];
+                size_t kept = 0;
+                for (size_t i = 0; i < operands.size(); i++)
+                {
+                    if (block_ids[block.preds[i]] != none)
+                    {
+                        operands[kept++] = operands[i];
+                    }
+                }
+                operands.resize(kept);
+            }
+            std::erase_if(block.preds, [&](const BlockId pred)
+                          { return block_ids[pred] == none; });
+        }
+        // Removing one phi can make another one trivial
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (const BlockId b : order)
+            {
+                for (const ValueId v : fn.blocks[b].instrs)
+                {
+                    if (fn.values[v].opcode == Opcode::phi && !replaced.is_replaced(v) &&
+                        (dead.empty() || !dead[v]) && replaced.try_remove_trivial_phi(fn, v) != v)
+                    {
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        Removed removed;
+        for (const BlockId b : order)
+        {
+            removed.phis += std::ranges::count_if(fn.blocks[b].instrs, [&](const ValueId v)
+                                                  { return replaced.is_replaced(v); });
+        }
+        const auto kept = [&](const ValueId v)
+        {
+            return !replaced.is_replaced(v) && (dead.empty() || !dead[v]);
+        };
+        Function compacted;
+        std::vector<ValueId> value_ids(fn.values.size(), none);
+        for (const BlockId b : order)
+        {
+            for (const ValueId v : fn.blocks[b].instrs)
+            {
+                if (kept(v))
+                {
+                    value_ids[v] = static_cast<ValueId>(compacted.values.size());
+                    compacted.values.push_back(fn.values[v]);
+                }
+            }
+        }
+        const auto map = [&](const ValueId v)
+        {
+            return v == none ? none : value_ids[replaced.resolve(v)];
+        };
+        for (Instr &instr : compacted.values)
+        {
+            instr.block = block_ids[instr.block];
+            instr.lhs = map(instr.lhs);
+            instr.rhs = map(instr.rhs);
+            if (instr.opcode == Opcode::phi)
+            {
+                std::vector<ValueId> operands = std::move(fn.phi_operands[instr.imm]);
+                for (ValueId &operand : operands)
+                {
+                    operand = map(operand);
+                }
+                instr.imm = compacted.phi_operands.size();
+                compacted.phi_operands.push_back(std::move(operands));
+            }
+            else if (instr.opcode == Opcode::kernel)
+            {
+                Kernel kernel = std::move(fn.kernels[instr.imm]);
+                for (ValueId &scalar : kernel.scalars)
+                {
+                    scalar = map(scalar);
+                }
+                instr.imm = compacted.kernels.size();
+                compacted.kernels.push_back(std::move(kernel));
+            }
+        }
+        compacted.arrays = std::move(fn.arrays);
+        compacted.blocks.reserve(order.size());
+        for (const BlockId b : order)
+        {
+            Block &block = compacted.blocks.emplace_back(std::move(fn.blocks[b]));
+            std::erase_if(block.instrs, [&](const ValueId v)
+                          { return !kept(v); });
+            for (ValueId &v : block.instrs)
+            {
+                v = value_ids[v];
+            }
+            for (BlockId &pred : block.preds)
+            {
+                pred = block_ids[pred];
+            }
+            block.term.value = map(block.term.value);
+            for (BlockId &target : block.term.targets)
+            {
+                target = target == none ? none : block_ids[target];
+            }
+        }
+
+        removed.blocks = fn.blocks.size() - compacted.blocks.size();
+        removed.values = fn.values.size() - compacted.values.size() - removed.phis;
+        fn = std::move(compacted);
+        return removed;
+    }
+
+    // Checks the invariants the optimizations and the backend rely on and
+    // throws CompileError naming the first one that is broken:
+    //  - every block is reachable from the entry and ends in a terminator,
+    //    and its predecessors are exactly the blocks that branch to it
+    //  - every value is defined once, in the block it claims, with phis first
+    //  - phis have one operand per predecessor and only follow jumps, so the
+    //    copies they turn into never sit on a conditional edge
+    //  - every operand is defined before it is used on every path: by a value
+    //    dominating the use, or for phis the end of the matching predecessor
+    //  - operands have a result, and arrays and kernels exist
+    class Verifier
+    {
+    public:
+        explicit Verifier(const Function &fn)
+            : m_fn(fn)
+        {
+        }
+
+        void verify()
+        {
+            if (m_fn.blocks.empty())
+            {
+                fail("function without blocks");
+            }
+            check_edges();
+            check_definitions();
+            compute_dominators();
+            check_uses();
+        }
+
+    private:
+        template <typename... Parts>
+        [[noreturn]] static void fail(const Parts &...parts)
+        {
+            throw CompileError("invalid IR: ", parts...);
+        }
+
+        void check_edges()
+        {
+            std::vector<size_t> edges(m_fn.blocks.size(), 0);
+            for (BlockId b = 0; b < m_fn.blocks.size(); b++)
+            {
+                const Terminator &term = m_fn.blocks[b].term;
+                if (term.kind == TermKind::none)
+                {
+                    fail("b", b, " has no terminator");
+                }
+                if ((term.kind == TermKind::branch || term.kind == TermKind::exit) && term.value >= m_fn.values.size())
+                {
+                    fail("b", b, " uses an undefined value");
+                }
+                for (const BlockId succ : term.successors())
+                {
+                    if (succ >= m_fn.blocks.size())
+                    {
+                        fail("b", b, " branches to a missing block");
+                    }
+                    const std::vector<BlockId> &preds = m_fn.blocks[succ].preds;
+                    if (std::ranges::count(preds, b) != std::ranges::count(term.successors(), succ))
+                    {
+                        fail("b", succ, " does not list b", b, " as predecessor");
+                    }
+                    edges[succ]++;
+                }
+            }
+            for (BlockId b = 0; b < m_fn.blocks.size(); b++)
+            {
+                if (edges[b] != m_fn.blocks[b].preds.size())
+                {
+                    fail("b", b, " lists a predecessor that does not branch to it");
+                }
+            }
+            if (!m_fn.blocks.front().preds.empty())
+            {
+                fail("the entry block has predecessors");
+            }
+        }
+
+        void check_definitions()
+        {
+            std::vector<bool> defined(m_fn.values.size(), false);
+            for (BlockId b = 0; b < m_fn.blocks.size(); b++)
+            {
+                const Block &block = m_fn.blocks[b];
+                bool phis = true;
+                for (const ValueId v : block.instrs)
+                {
+                    if (v >= m_fn.values.size() || defined[v])
+                    {
+                        fail("v", v, " is defined more than once or out of range");
+                    }
+                    defined[v] = true;
+                    const Instr &instr = m_fn.values[v];
+                    if (instr.block != b)
+                    {
+                        fail("v", v, " is in b", b, " but claims b", instr.block);
+                    }
+                    if (instr.opcode != Opcode::phi)
+                    {
+                        phis = false;
+                        continue;
+                    }
+                    if (!phis)
+                    {
+                        fail("phi v", v, " follows another instruction");
+                    }
+                    if (instr.imm >= m_fn.phi_operands.size() || m_fn.operands(v).size() != block.preds.size())
+                    {
+                        fail("phi v", v, " does not have one operand per predecessor");
+                    }
+                    for (const BlockId pred : block.preds)
+                    {
+                        if (m_fn.blocks[pred].term.kind != TermKind::jump)
+                        {
+                            fail("phi v", v, " sits on a conditional edge from b", pred);
+                        }
+                    }
+                }
+            }
+            if (std::ranges::find(defined, false) != defined.end())
+            {
+                fail("a value is not in any block");
+            }
+        }
+
+        // Iterative dominators of Cooper, Harvey and Kennedy over the reverse
+        // postorder, followed by a numbering of the dominator tree that
+        // answers dominance queries in constant time
+        void compute_dominators()
+        {
+            const size_t count = m_fn.blocks.size();
+            std::vector<BlockId> postorder;
+            std::vector<uint32_t> order(count, none);
+            std::vector<std::pair<BlockId, size_t>> stack{{0, 0}};
+            std::vector<bool> visited(count, false);
+            visited[0] = true;
+            while (!stack.empty())
+            {
+                auto &[b, next] = stack.back();
+                const std::span<const BlockId> succs = m_fn.blocks[b].term.successors();
+                if (next < succs.size())
+                {
+                    const BlockId succ = succs[next++];
+                    if (!visited[succ])
+                    {
+                        visited[succ] = true;
+                        stack.emplace_back(succ, 0);
+                    }
+                    continue;
+                }
+                order[b] = static_cast<uint32_t>(postorder.size());
+                postorder.push_back(b);
+                stack.pop_back();
+            }
+            if (postorder.size() != count)
+            {
+                fail("a block is not reachable from the entry");
+            }
+
+            m_idom.assign(count, none);
+            m_idom[0] = 0;
+            bool changed = true;
+            while (changed)
+            {
+                changed = false;
+                for (auto it = postorder.rbegin() + 1; it != postorder.rend(); ++it)
+                {
+                    BlockId idom = none;
+                    for (const BlockId pred : m_fn.blocks[*it].preds)
+                    {
+                        if (m_idom[pred] == none)
+                        {
+                            continue;
+                        }
+                        idom = idom == none ? pred : intersect(pred, idom, order);
+                    }
+                    if (m_idom[*it] != idom)
+                    {
+                        m_idom[*it] = idom;
+                        changed = true;
+                    }
+                }
+            }
+
+            std::vector<std::vector<BlockId>> children(count);
+            for (BlockId b = 1; b < count; b++)
+            {
+                children[m_idom[b]].push_back(b);
+            }
+            m_enter.assign(count, 0);
+            m_leave.assign(count, 0);
+            uint32_t clock = 0;
+            std::vector<std::pair<BlockId, size_t>> walk{{0, 0}};
+            m_enter[0] = clock++;
+            while (!walk.empty())
+            {
+                auto &[b, next] = walk.back();
+                if (next < children[b].size())
+                {
+                    const BlockId child = children[b][next++];
+                    m_enter[child] = clock++;
+                    walk.emplace_back(child, 0);
+                    continue;
+                }
+                m_leave[b] = clock++;
+                walk.pop_back();
+            }
+        }
+
+        void check_memory(const ValueId v) const
+        {
+            const Instr &instr = m_fn.values[v];
+            if (instr.opcode == Opcode::load || instr.opcode == Opcode::store)
+            {
+                if (instr.imm >= m_fn.arrays.size())
+                {
+                    fail("v", v, " accesses a missing array");
+                }
+            }
+            else if (instr.opcode == Opcode::kernel)
+            {
+                if (instr.imm >= m_fn.kernels.size())
+                {
+                    fail("v", v, " runs a missing kernel");
+                }
+                const Kernel &kernel = m_fn.kernel(v);
+                size_t depth = 0;
+                for (const KernelOp op : kernel.ops)
+                {
+                    if (op.is_leaf() ? op.index >= (op.kind == KernelOp::Kind::load ? m_fn.arrays.size() : kernel.scalars.size())
+                                     : depth < 2)
+                    {
+                        fail("kernel v", v, " has an invalid op");
+                    }
+                    if (op.kind == KernelOp::Kind::load && kernel.dst < m_fn.arrays.size() &&
+                        m_fn.arrays[op.index] != m_fn.arrays[kernel.dst])
+                    {
+                        fail("kernel v", v, " reads an array of another length");
+                    }
+                    depth = op.is_leaf() ? depth + 1 : depth - 1;
+                }
+                if (kernel.dst >= m_fn.arrays.size() || depth != 1)
+                {
+                    fail("kernel v", v, " does not compute one array");
+                }
+            }
+        }
+
+        [[nodiscard]] BlockId intersect(BlockId a, BlockId b, const std::vector<uint32_t> &order) const
+        {
+            while (a != b)
+            {
+                while (order[a] < order[b])
+                {
+                    a = m_idom[a];
+                }
+                while (order[b] < order[a])
+                {
+                    b = m_idom[b];
+                }
+            }
+            return a;
+        }
+
+        [[nodiscard]] bool dominates(const BlockId a, const BlockId b) const
+        {
+            return m_enter[a] <= m_enter[b] && m_leave[b] <= m_leave[a];
+        }
+
+        void check_uses()
+        {
+            // Position of each value in its block, to order uses within one block
+            std::vector<size_t> index(m_fn.values.size());
+            for (const Block &block : m_fn.blocks)
+            {
+                for (size_t i = 0; i < block.instrs.size(); i++)
+                {
+                    index[block.instrs[i]] = i;
+                }
+            }
+            const auto check = [&](const ValueId operand, const BlockId block, const size_t position, const ValueId user)
+            {
+                if (operand >= m_fn.values.size() || !has_result(m_fn.values[operand].opcode))
+                {
+                    fail("v", user, " uses an undefined value");
+                }
+                const BlockId def = m_fn.values[operand].block;
+                if (def == block ? index[operand] >= position : !dominates(def, block))
+                {
+                    fail("v", operand, " does not dominate its use in b", block);
+                }
+            };
+
+            for (BlockId b = 0; b < m_fn.blocks.size(); b++)
+            {
+                const Block &block = m_fn.blocks[b];
+                for (size_t i = 0; i < block.instrs.size(); i++)
+                {
+                    const ValueId v = block.instrs[i];
+                    const Instr &instr = m_fn.values[v];
+                    if (instr.opcode == Opcode::phi)
+                    {
+                        const std::span<const ValueId> operands = m_fn.operands(v);
+                        for (size_t p = 0; p < operands.size(); p++)
+                        {
+                            const BlockId pred = block.preds[p];
+                            check(operands[p], pred, m_fn.blocks[pred].instrs.size(), v);
+                        }
+                    }
+                    else
+                    {
+                        check_memory(v);
+                        for_each_operand(m_fn, v, [&](const ValueId operand)
+                                         { check(operand, b, i, v); });
+                    }
+                }
+                if (block.term.kind == TermKind::branch || block.term.kind == TermKind::exit)
+                {
+                    check(block.term.value, b, block.instrs.size(), none);
+                }
+            }
+        }
+
+        const Function &m_fn;
+        std::vector<BlockId> m_idom{};
+        std::vector<uint32_t> m_enter{};
+        std::vector<uint32_t> m_leave{};
+    };
+
+    inline void verify(const Function &fn)
+    {
+        Verifier(fn).verify();
+    }
+}
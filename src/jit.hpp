@@ -0,0 +1,118 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "./encoder.hpp"
+#include "./error.hpp"
+#include "./x86.hpp"
+
+// Runs the generated code in-process instead of writing an executable. The
+// program is called like a function: a prologue saves the registers the
+// caller expects to survive and the stack pointer, and every exit syscall
+// becomes a jump to an epilogue restoring them and returning the status.
+// The stack slots of the program go below the caller's frame. A program that
+// faults takes the process down with the signal the executable would get.
+class JitProgram
+{
+public:
+    // instrs as generated for an executable. Throws CompileError when the
+    // code cannot be mapped.
+    explicit JitProgram(const std::vector<Instr> &instrs)
+    {
+        const std::vector<uint8_t> code = Encoder().encode(wrap(instrs));
+        m_size = code.size();
+        void *memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            throw CompileError("unable to map code: ", std::strerror(errno));
+        }
+        m_code = memory;
+        std::memcpy(m_code, code.data(), m_size);
+        // Never writable and executable at the same time
+        if (mprotect(m_code, m_size, PROT_READ | PROT_EXEC) != 0)
+        {
+            const int error = errno;
+            munmap(m_code, m_size);
+            throw CompileError("unable to map code: ", std::strerror(error));
+        }
+    }
+
+    // The code refers to m_saved_rsp by its address
+    JitProgram(const JitProgram &) = delete;
+    JitProgram &operator=(const JitProgram &) = delete;
+
+    ~JitProgram()
+    {
+        munmap(m_code, m_size);
+    }
+
+    // Returns the exit status, which like that of a process is the low byte
+    // of the value passed to exit
+    [[nodiscard]] int run()
+    {
+        const auto entry = reinterpret_cast<uint64_t (*)()>(m_code);
+        return static_cast<int>(entry() & 0xFF);
+    }
+
+    [[nodiscard]] size_t code_size() const
+    {
+        return m_size;
+    }
+
+private:
+    static constexpr std::array<Reg, 6> callee_saved{Reg::rbx, Reg::rbp, Reg::r12, Reg::r13, Reg::r14, Reg::r15};
+
+    [[nodiscard]] std::vector<Instr> wrap(const std::vector<Instr> &instrs)
+    {
+        uint64_t exit_label = 0;
+        for (const Instr &instr : instrs)
+        {
+            if (instr.op == Op::label)
+            {
+                exit_label = std::max(exit_label, instr.dst.value + 1);
+            }
+        }
+        const Operand saved_rsp = Operand::from_mem(Reg::rax, 0);
+        const Operand saved_rsp_address = Operand::from_imm(reinterpret_cast<uint64_t>(&m_saved_rsp));
+
+        std::vector<Instr> wrapped;
+        wrapped.reserve(instrs.size() + 2 * callee_saved.size() + 8);
+        for (const Reg reg : callee_saved)
+        {
+            wrapped.push_back({.op = Op::push, .dst = Operand::from_reg(reg)});
+        }
+        wrapped.push_back({.op = Op::mov, .dst = Operand::from_reg(Reg::rax), .src = saved_rsp_address});
+        wrapped.push_back({.op = Op::mov, .dst = saved_rsp, .src = Operand::from_reg(Reg::rsp)});
+        // The status is in rdi, as the exit syscall takes it
+        for (const Instr &instr : instrs)
+        {
+            if (instr.op == Op::syscall)
+            {
+                wrapped.push_back({.op = Op::jmp, .dst = Operand::from_label(exit_label)});
+                continue;
+            }
+            wrapped.push_back(instr);
+        }
+        wrapped.push_back({.op = Op::label, .dst = Operand::from_label(exit_label)});
+        wrapped.push_back({.op = Op::mov, .dst = Operand::from_reg(Reg::rax), .src = saved_rsp_address});
+        wrapped.push_back({.op = Op::mov, .dst = Operand::from_reg(Reg::rsp), .src = saved_rsp});
+        for (auto reg = callee_saved.rbegin(); reg != callee_saved.rend(); reg++)
+        {
+            wrapped.push_back({.op = Op::pop, .dst = Operand::from_reg(*reg)});
+        }
+        wrapped.push_back({.op = Op::mov, .dst = Operand::from_reg(Reg::rax), .src = Operand::from_reg(Reg::rdi)});
+        wrapped.push_back({.op = Op::ret});
+        return wrapped;
+    }
+
+    void *m_code = nullptr;
+    size_t m_size = 0;
+    uint64_t m_saved_rsp = 0; // the caller's, while the program runs
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "./ir.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// Loop-invariant code motion: a value computed inside a loop from operands
+// that are all defined outside of it, or are invariant themselves, is
+// computed once in the loop's preheader instead of on every iteration.
+//
+// Blocks are in reverse postorder, so a back edge is an edge to a block that
+// is laid out no later than the block it leaves; the loop is every block that
+// reaches the back edge without passing its header. The Lowering gives each
+// loop a preheader, the one block outside the loop jumping to the header.
+// The body may not run on every path through the loop, only values that
+// cannot fault are moved: everything but divisions by a divisor that might
+// be zero.
+class LoopInvariantCodeMotion
+{
+public:
+    struct Stats
+    {
+        size_t loops = 0;
+        size_t values = 0; // hoisted, not counting constants
+    };
+
+    explicit LoopInvariantCodeMotion(ir::Function &fn)
+        : m_fn(fn)
+    {
+    }
+
+    void run()
+    {
+        // Inner loops have their header after that of the loops around them.
+        // What leaves an inner loop lands in a preheader that is part of the
+        // outer loop, and can leave that one as well.
+        bool hoisted = false;
+        for (auto header = static_cast<ir::BlockId>(m_fn.blocks.size()); header-- > 0;)
+        {
+            hoisted = hoist_loop(header) || hoisted;
+        }
+        // Moved values are renumbered into block order
+        if (hoisted)
+        {
+            ir::Replacements replaced(m_fn.values.size());
+            ir::compact(m_fn, replaced);
+        }
+    }
+
+    [[nodiscard]] const Stats &stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    bool hoist_loop(const ir::BlockId header)
+    {
+        // The loop's blocks are marked in m_in_loop while it is processed
+        m_in_loop.resize(m_fn.blocks.size(), false);
+        std::vector<ir::BlockId> &loop = m_loop;
+        loop.assign(1, header);
+        m_in_loop[header] = true;
+        bool has_latch = false;
+        for (const ir::BlockId pred : m_fn.blocks[header].preds)
+        {
+            has_latch = has_latch || pred >= header;
+            if (pred >= header && !m_in_loop[pred])
+            {
+                m_in_loop[pred] = true;
+                loop.push_back(pred);
+            }
+        }
+        for (size_t i = 1; i < loop.size(); i++)
+        {
+            for (const ir::BlockId pred : m_fn.blocks[loop[i]].preds)
+            {
+                if (!m_in_loop[pred])
+                {
+                    m_in_loop[pred] = true;
+                    loop.push_back(pred);
+                }
+            }
+        }
+        const bool hoisted = has_latch && hoist(header);
+        for (const ir::BlockId b : loop)
+        {
+            m_in_loop[b] = false;
+        }
+        return hoisted;
+    }
+
+    bool hoist(const ir::BlockId header)
+    {
+        m_stats.loops++;
+        ir::BlockId preheader = ir::none;
+        for (const ir::BlockId pred : m_fn.blocks[header].preds)
+        {
+            if (m_in_loop[pred])
+            {
+                continue;
+            }
+            if (preheader != ir::none || m_fn.blocks[pred].term.kind != ir::TermKind::jump)
+            {
+                return false;
+            }
+            preheader = pred;
+        }
+        if (preheader == ir::none)
+        {
+            return false;
+        }
+
+        // Operands come before their users in layout order, apart from the
+        // phis, which are never invariant
+        std::ranges::sort(m_loop);
+        bool hoisted = false;
+        std::vector<ir::ValueId> &hoisted_values = m_fn.blocks[preheader].instrs;
+        for (const ir::BlockId b : m_loop)
+        {
+            std::erase_if(m_fn.blocks[b].instrs, [&](const ir::ValueId v)
+                          {
+                              if (!is_invariant(v))
+                              {
+                                  return false;
+                              }
+                              m_fn.values[v].block = preheader;
+                              hoisted_values.push_back(v);
+                              m_stats.values += m_fn.values[v].opcode != ir::Opcode::const_;
+                              hoisted = true;
+                              return true; });
+        }
+        return hoisted;
+    }
+
+    [[nodiscard]] bool is_invariant(const ir::ValueId v) const
+    {
+        const ir::Instr &instr = m_fn.values[v];
+        if (instr.opcode == ir::Opcode::const_)
+        {
+            return true;
+        }
+        if (!ir::is_binary(instr.opcode) || m_in_loop[m_fn.values[instr.lhs].block] ||
+            m_in_loop[m_fn.values[instr.rhs].block])
+        {
+            return false;
+        }
+        const ir::Instr &divisor = m_fn.values[instr.rhs];
+        return instr.opcode != ir::Opcode::div || (divisor.opcode == ir::Opcode::const_ && divisor.imm != 0);
+    }
+
+    ir::Function &m_fn;
+    std::vector<bool> m_in_loop{};
+    std::vector<ir::BlockId> m_loop{}; // the blocks of the loop being processed
+    Stats m_stats{};
+};
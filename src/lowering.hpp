@@ -0,0 +1,667 @@
+#pragma once
+
+#include "./error.hpp"
+#include "./ir.hpp"
+#include "./parser.hpp"
+#include "./symbol_table.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Lowers the syntax tree to the IR, resolving names on the way. SSA form is
+// built directly with the algorithm of Braun et al. (Simple and Efficient
+// Construction of Static Single Assignment Form): the value of a variable
+// is looked up in the current block and, when it is not assigned there,
+// recursively in its predecessors, placing a phi where they join. A block is
+// sealed once all its predecessors are known; reads in a block that is not
+// sealed yet get a phi whose operands are filled in on sealing.
+//
+// Arrays stay out of SSA form: each variable holding one gets an array of
+// its own in the Function, accessed by loads and stores, and element-wise
+// expressions become kernels over whole arrays.
+class Lowering
+{
+public:
+    // prog has to outlive the lowering
+    Lowering(const node::NodeProg &prog, const Interner &interner)
+        : m_prog(prog),
+          m_interner(interner)
+    {
+    }
+
+    // Throws CompileError for names that are undeclared or declared twice
+    [[nodiscard]] ir::Function lower()
+    {
+        m_lengths.assign(m_prog.has_arrays ? m_prog.exprs.size() : 0, unknown_length);
+        m_block = new_block();
+        seal(m_block);
+        lower_scope(m_prog.root);
+        // Falling off the end of the program exits with 0
+        terminate({.kind = ir::TermKind::exit, .value = emit_const(0)});
+        // Drops what follows an exit and the phis that turned out trivial
+        m_removed = ir::compact(m_fn, m_replaced);
+        return std::move(m_fn);
+    }
+
+    // The blocks and values dropped as unreachable, which is all the code
+    // following an exit, and the trivial phis
+    [[nodiscard]] const ir::Removed &removed() const
+    {
+        return m_removed;
+    }
+
+    [[nodiscard]] const SymbolStats &symbol_stats() const
+    {
+        return m_vars.stats();
+    }
+
+private:
+    // Variables are identified by the let statement declaring them
+    using Var = node::StmtId;
+
+    ir::ValueId lower_expr(const node::ExprId id)
+    {
+        const node::NodeExpr &expr = m_prog.exprs[id];
+        switch (expr.kind)
+        {
+        case node::ExprKind::int_lit:
+            return emit_const(expr.value());
+        case node::ExprKind::ident:
+            return read_variable(lookup_number(expr.lhs), m_block);
+        case node::ExprKind::array_lit:
+        case node::ExprKind::array_fill:
+            throw CompileError("array used as a number");
+        case node::ExprKind::index:
+        {
+            const ir::ArrayId array = lookup_array(expr.lhs);
+            return emit({.opcode = ir::Opcode::load, .lhs = lower_expr(expr.rhs), .imm = array});
+        }
+        case node::ExprKind::add:
+            return lower_bin_expr(ir::Opcode::add, expr);
+        case node::ExprKind::sub:
+            return lower_bin_expr(ir::Opcode::sub, expr);
+        case node::ExprKind::mul:
+            return lower_bin_expr(ir::Opcode::mul, expr);
+        case node::ExprKind::div:
+            return lower_bin_expr(ir::Opcode::div, expr);
+        case node::ExprKind::eq:
+            return lower_bin_expr(ir::Opcode::eq, expr);
+        case node::ExprKind::ne:
+            return lower_bin_expr(ir::Opcode::ne, expr);
+        case node::ExprKind::lt:
+            return lower_bin_expr(ir::Opcode::lt, expr);
+        case node::ExprKind::le:
+            return lower_bin_expr(ir::Opcode::le, expr);
+        case node::ExprKind::gt:
+            return lower_bin_expr(ir::Opcode::gt, expr);
+        case node::ExprKind::ge:
+            return lower_bin_expr(ir::Opcode::ge, expr);
+        }
+        assert(false);
+        return ir::none;
+    }
+
+    ir::ValueId lower_bin_expr(const ir::Opcode opcode, const node::NodeExpr &expr)
+    {
+        const ir::ValueId lhs = lower_expr(expr.lhs);
+        const ir::ValueId rhs = lower_expr(expr.rhs);
+        return emit({.opcode = opcode, .lhs = lhs, .rhs = rhs});
+    }
+
+    // The number of elements of the array id evaluates to, 0 for a number
+    uint32_t array_length(const node::ExprId id)
+    {
+        if (!m_prog.has_arrays)
+        {
+            return 0;
+        }
+        // Only computed once, which keeps nested expressions linear
+        uint32_t &length = m_lengths[id];
+        if (length != unknown_length)
+        {
+            return length;
+        }
+        const node::NodeExpr &expr = m_prog.exprs[id];
+        switch (expr.kind)
+        {
+        case node::ExprKind::int_lit:
+        case node::ExprKind::index:
+            length = 0;
+            break;
+        case node::ExprKind::ident:
+        {
+            const auto array = m_arrays.find(lookup(expr.lhs));
+            length = array == m_arrays.end() ? 0 : m_fn.arrays[array->second];
+            break;
+        }
+        case node::ExprKind::array_lit:
+            length = expr.rhs - expr.lhs;
+            break;
+        case node::ExprKind::array_fill:
+            length = expr.rhs;
+            break;
+        default:
+            length = node::element_wise_length(expr.kind, array_length(expr.lhs), array_length(expr.rhs));
+            break;
+        }
+        return length;
+    }
+
+    // Writes the array id evaluates to into dst, which has its length
+    void lower_array(const node::ExprId id, const ir::ArrayId dst)
+    {
+        const node::NodeExpr &expr = m_prog.exprs[id];
+        if (expr.kind != node::ExprKind::array_lit)
+        {
+            ir::Kernel kernel{.dst = dst};
+            build_kernel(id, kernel);
+            emit_kernel(std::move(kernel), m_fn.arrays[dst]);
+            return;
+        }
+        // The elements may read dst, all of them are computed first
+        std::vector<ir::ValueId> values;
+        for (const node::ExprId elem : m_prog.elements(id))
+        {
+            values.push_back(lower_expr(elem));
+        }
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            emit({.opcode = ir::Opcode::store, .lhs = emit_const(i), .rhs = values[i], .imm = dst});
+        }
+    }
+
+    // Appends the ops of id to kernel. Numbers, including whole
+    // sub-expressions of them, are computed before the kernel and become
+    // its scalars.
+    void build_kernel(const node::ExprId id, ir::Kernel &kernel)
+    {
+        const node::NodeExpr &expr = m_prog.exprs[id];
+        if (array_length(id) == 0)
+        {
+            add_scalar(kernel, lower_expr(id));
+            return;
+        }
+        switch (expr.kind)
+        {
+        case node::ExprKind::ident:
+            kernel.ops.push_back({.kind = ir::KernelOp::Kind::load, .index = m_arrays.at(lookup(expr.lhs))});
+            break;
+        case node::ExprKind::array_fill:
+            add_scalar(kernel, lower_expr(expr.lhs));
+            break;
+        case node::ExprKind::array_lit:
+        {
+            const ir::ArrayId temp = temp_array(expr.rhs - expr.lhs);
+            lower_array(id, temp);
+            kernel.ops.push_back({.kind = ir::KernelOp::Kind::load, .index = temp});
+            break;
+        }
+        default:
+            build_kernel(expr.lhs, kernel);
+            build_kernel(expr.rhs, kernel);
+            kernel.ops.push_back({.kind = expr.kind == node::ExprKind::add   ? ir::KernelOp::Kind::add
+                                          : expr.kind == node::ExprKind::sub ? ir::KernelOp::Kind::sub
+                                                                             : ir::KernelOp::Kind::mul});
+            break;
+        }
+    }
+
+    static void add_scalar(ir::Kernel &kernel, const ir::ValueId value)
+    {
+        const auto index = static_cast<uint32_t>(std::ranges::find(kernel.scalars, value) - kernel.scalars.begin());
+        if (index == kernel.scalars.size())
+        {
+            kernel.scalars.push_back(value);
+        }
+        kernel.ops.push_back({.kind = ir::KernelOp::Kind::scalar, .index = index});
+    }
+
+    // A kernel holds each of its scalars and the stack of its evaluation in
+    // vector registers, 14 of which the Generator leaves to them. One that
+    // needs more has the larger operand of its last op split off into a
+    // kernel of its own, writing a temporary array, until it fits. Returns
+    // the array written, a temporary when kernel.dst is none.
+    ir::ArrayId emit_kernel(ir::Kernel kernel, const uint32_t length)
+    {
+        while (kernel_registers(kernel) > max_kernel_registers)
+        {
+            const size_t last = kernel.ops.size() - 1;
+            const size_t rhs = operand_begin(kernel.ops, last - 1);
+            const size_t begin = last - rhs > rhs ? rhs : 0;
+            const size_t end = begin == 0 ? rhs : last;
+            ir::Kernel part{.dst = ir::none};
+            for (size_t i = begin; i < end; i++)
+            {
+                if (kernel.ops[i].kind == ir::KernelOp::Kind::scalar)
+                {
+                    add_scalar(part, kernel.scalars[kernel.ops[i].index]);
+                    continue;
+                }
+                part.ops.push_back(kernel.ops[i]);
+            }
+            kernel.ops[begin] = {.kind = ir::KernelOp::Kind::load, .index = emit_kernel(std::move(part), length)};
+            kernel.ops.erase(kernel.ops.begin() + static_cast<ptrdiff_t>(begin) + 1, kernel.ops.begin() + static_cast<ptrdiff_t>(end));
+            drop_unused_scalars(kernel);
+        }
+        // Nothing else reads the temporaries read here, the kernel may even
+        // write one of them as it goes element by element. A chain of split
+        // kernels thus takes two temporaries instead of one per link.
+        for (const ir::KernelOp op : kernel.ops)
+        {
+            if (op.kind == ir::KernelOp::Kind::load)
+            {
+                release_temp(op.index);
+            }
+        }
+        if (kernel.dst == ir::none)
+        {
+            kernel.dst = temp_array(length);
+        }
+        const ir::ArrayId dst = kernel.dst;
+        emit({.opcode = ir::Opcode::kernel, .imm = m_fn.kernels.size()});
+        m_fn.kernels.push_back(std::move(kernel));
+        return dst;
+    }
+
+    static constexpr size_t max_kernel_registers = 14;
+
+    [[nodiscard]] static size_t kernel_registers(const ir::Kernel &kernel)
+    {
+        size_t depth = 0;
+        size_t max_depth = 0;
+        for (const ir::KernelOp op : kernel.ops)
+        {
+            depth = op.is_leaf() ? depth + 1 : depth - 1;
+            max_depth = std::max(max_depth, depth);
+        }
+        return kernel.scalars.size() + max_depth;
+    }
+
+    // The first op of the operand whose last op is ops[last]
+    [[nodiscard]] static size_t operand_begin(const std::vector<ir::KernelOp> &ops, size_t last)
+    {
+        size_t missing = 1;
+        while (true)
+        {
+            missing = ops[last].is_leaf() ? missing - 1 : missing + 1;
+            if (missing == 0)
+            {
+                return last;
+            }
+            last--;
+        }
+    }
+
+    static void drop_unused_scalars(ir::Kernel &kernel)
+    {
+        std::vector<ir::ValueId> scalars = std::move(kernel.scalars);
+        kernel.scalars.clear();
+        std::vector<uint32_t> indices(scalars.size(), UINT32_MAX);
+        for (ir::KernelOp &op : kernel.ops)
+        {
+            if (op.kind != ir::KernelOp::Kind::scalar)
+            {
+                continue;
+            }
+            if (indices[op.index] == UINT32_MAX)
+            {
+                indices[op.index] = static_cast<uint32_t>(kernel.scalars.size());
+                kernel.scalars.push_back(scalars[op.index]);
+            }
+            op.index = indices[op.index];
+        }
+    }
+
+    ir::ArrayId new_array(const uint32_t length)
+    {
+        m_fn.arrays.push_back(length);
+        return static_cast<ir::ArrayId>(m_fn.arrays.size() - 1);
+    }
+
+    // An array for an intermediate result, free again once the kernel reading
+    // it is emitted
+    ir::ArrayId temp_array(const uint32_t length)
+    {
+        for (auto &[array, used] : m_temps)
+        {
+            if (!used && m_fn.arrays[array] == length)
+            {
+                used = true;
+                return array;
+            }
+        }
+        m_temps.emplace_back(new_array(length), true);
+        return m_temps.back().first;
+    }
+
+    void release_temp(const ir::ArrayId array)
+    {
+        for (auto &temp : m_temps)
+        {
+            temp.second = temp.second && temp.first != array;
+        }
+    }
+
+    void lower_scope(const node::ScopeId scope)
+    {
+        m_vars.begin_scope();
+        for (const node::StmtId stmt : m_prog.body(scope))
+        {
+            lower_stmt(stmt);
+        }
+        m_vars.end_scope();
+    }
+
+    void lower_stmt(const node::StmtId id)
+    {
+        const node::NodeStmt &stmt = m_prog.stmts[id];
+        switch (stmt.kind)
+        {
+        case node::StmtKind::exit:
+            terminate({.kind = ir::TermKind::exit, .value = lower_expr(stmt.expr)});
+            // Whatever follows is unreachable but still checked, it ends up
+            // in a block without predecessors that is dropped in the end
+            m_block = new_block();
+            seal(m_block);
+            break;
+        case node::StmtKind::let:
+        {
+            if (m_vars.lookup(stmt.ident) != nullptr)
+            {
+                throw CompileError("identifier already used: ", m_interner.name(stmt.ident));
+            }
+            // The initializer is evaluated before the variable exists
+            const uint32_t length = array_length(stmt.expr);
+            if (length == 0)
+            {
+                const ir::ValueId value = lower_expr(stmt.expr);
+                m_vars.declare(stmt.ident, id);
+                write_variable(id, m_block, value);
+                break;
+            }
+            if (length > node::max_array_elements - m_array_elements)
+            {
+                throw CompileError("arrays take more than ", node::max_array_elements, " elements");
+            }
+            m_array_elements += length;
+            const ir::ArrayId array = new_array(length);
+            lower_array(stmt.expr, array);
+            m_vars.declare(stmt.ident, id);
+            m_arrays.emplace(id, array);
+            break;
+        }
+        case node::StmtKind::assign:
+        {
+            const Var var = lookup(stmt.ident);
+            const auto array = m_arrays.find(var);
+            if (array == m_arrays.end())
+            {
+                const ir::ValueId value = lower_expr(stmt.expr);
+                write_variable(var, m_block, value);
+                break;
+            }
+            node::check_assigned_length(m_fn.arrays[array->second], array_length(stmt.expr));
+            lower_array(stmt.expr, array->second);
+            break;
+        }
+        case node::StmtKind::store:
+        {
+            const ir::ArrayId array = lookup_array(stmt.ident);
+            const ir::ValueId index = lower_expr(stmt.index);
+            const ir::ValueId value = lower_expr(stmt.expr);
+            emit({.opcode = ir::Opcode::store, .lhs = index, .rhs = value, .imm = array});
+            break;
+        }
+        case node::StmtKind::scope:
+            lower_scope(stmt.scope);
+            break;
+        case node::StmtKind::if_:
+            lower_if(stmt);
+            break;
+        case node::StmtKind::while_:
+            lower_while(stmt);
+            break;
+        }
+    }
+
+    // Both arms get a block of their own, so the edges into the join block
+    // always come from a jump and never from the branch itself. The elifs of
+    // a chain join where the if_ starting it does, one phi merges them all.
+    void lower_if(const node::NodeStmt &stmt_if, ir::BlockId join = ir::none)
+    {
+        const ir::ValueId cond = lower_expr(stmt_if.expr);
+        const ir::BlockId then_block = new_block();
+        const ir::BlockId else_block = new_block();
+        terminate({.kind = ir::TermKind::branch, .value = cond, .targets = {then_block, else_block}});
+        seal(then_block);
+        seal(else_block);
+
+        const bool starts_chain = join == ir::none;
+        if (starts_chain)
+        {
+            join = new_block();
+        }
+        m_block = then_block;
+        lower_scope(stmt_if.scope);
+        terminate({.kind = ir::TermKind::jump, .targets = {join}});
+
+        m_block = else_block;
+        if (stmt_if.else_ != node::none && m_prog.stmts[stmt_if.else_].kind == node::StmtKind::if_)
+        {
+            lower_if(m_prog.stmts[stmt_if.else_], join);
+        }
+        else
+        {
+            if (stmt_if.else_ != node::none)
+            {
+                lower_stmt(stmt_if.else_);
+            }
+            terminate({.kind = ir::TermKind::jump, .targets = {join}});
+        }
+        if (starts_chain)
+        {
+            seal(join);
+            m_block = join;
+        }
+    }
+
+    // Loops are inverted: the condition is tested once in front of the loop
+    // and then at the bottom of every iteration, which takes one conditional
+    // branch per iteration. The header is sealed once the back edge exists.
+    // As in lower_if, the edges into the header and the block after the loop
+    // go through blocks of their own that end in a jump.
+    void lower_while(const node::NodeStmt &stmt_while)
+    {
+        const ir::BlockId preheader = new_block();
+        const ir::BlockId skip = new_block();
+        terminate({.kind = ir::TermKind::branch, .value = lower_expr(stmt_while.expr), .targets = {preheader, skip}});
+        seal(preheader);
+        seal(skip);
+
+        const ir::BlockId header = new_block();
+        const ir::BlockId done = new_block();
+        m_block = preheader;
+        terminate({.kind = ir::TermKind::jump, .targets = {header}});
+        m_block = skip;
+        terminate({.kind = ir::TermKind::jump, .targets = {done}});
+
+        m_block = header;
+        lower_scope(stmt_while.scope);
+        const ir::BlockId back_edge = new_block();
+        const ir::BlockId leave = new_block();
+        terminate({.kind = ir::TermKind::branch, .value = lower_expr(stmt_while.expr), .targets = {back_edge, leave}});
+        seal(back_edge);
+        seal(leave);
+        m_block = back_edge;
+        terminate({.kind = ir::TermKind::jump, .targets = {header}});
+        m_block = leave;
+        terminate({.kind = ir::TermKind::jump, .targets = {done}});
+
+        seal(header);
+        seal(done);
+        m_block = done;
+    }
+
+    Var lookup(const Symbol ident)
+    {
+        const Var *var = m_vars.lookup(ident);
+        if (var == nullptr)
+        {
+            throw CompileError("undeclared identifier: ", m_interner.name(ident));
+        }
+        return *var;
+    }
+
+    Var lookup_number(const Symbol ident)
+    {
+        const Var var = lookup(ident);
+        if (m_arrays.contains(var))
+        {
+            throw CompileError("array used as a number: ", m_interner.name(ident));
+        }
+        return var;
+    }
+
+    ir::ArrayId lookup_array(const Symbol ident)
+    {
+        const auto array = m_arrays.find(lookup(ident));
+        if (array == m_arrays.end())
+        {
+            throw CompileError("not an array: ", m_interner.name(ident));
+        }
+        return array->second;
+    }
+
+    ir::BlockId new_block()
+    {
+        m_fn.blocks.emplace_back();
+        m_defs.emplace_back();
+        m_sealed.push_back(false);
+        m_incomplete.emplace_back();
+        return static_cast<ir::BlockId>(m_fn.blocks.size() - 1);
+    }
+
+    // Ends the current block and records it as predecessor of its targets
+    void terminate(const ir::Terminator term)
+    {
+        m_fn.blocks[m_block].term = term;
+        for (const ir::BlockId succ : term.successors())
+        {
+            m_fn.blocks[succ].preds.push_back(m_block);
+        }
+    }
+
+    ir::ValueId emit(ir::Instr instr, const ir::BlockId block)
+    {
+        instr.block = block;
+        m_fn.values.push_back(instr);
+        m_replaced.add();
+        const auto value = static_cast<ir::ValueId>(m_fn.values.size() - 1);
+        m_fn.blocks[block].instrs.push_back(value);
+        return value;
+    }
+
+    ir::ValueId emit(const ir::Instr instr)
+    {
+        return emit(instr, m_block);
+    }
+
+    ir::ValueId emit_const(const uint64_t value)
+    {
+        return emit({.opcode = ir::Opcode::const_, .imm = value});
+    }
+
+    // Phis go before the other instructions of block
+    ir::ValueId new_phi(const ir::BlockId block)
+    {
+        m_fn.values.push_back({.opcode = ir::Opcode::phi, .block = block, .imm = m_fn.phi_operands.size()});
+        m_fn.phi_operands.emplace_back();
+        m_replaced.add();
+        const auto phi = static_cast<ir::ValueId>(m_fn.values.size() - 1);
+        std::vector<ir::ValueId> &instrs = m_fn.blocks[block].instrs;
+        const auto first_other = std::ranges::find_if(instrs, [&](const ir::ValueId v)
+                                                      { return m_fn.values[v].opcode != ir::Opcode::phi; });
+        instrs.insert(first_other, phi);
+        return phi;
+    }
+
+    void write_variable(const Var var, const ir::BlockId block, const ir::ValueId value)
+    {
+        m_defs[block][var] = value;
+    }
+
+    ir::ValueId read_variable(const Var var, const ir::BlockId block)
+    {
+        const auto it = m_defs[block].find(var);
+        if (it != m_defs[block].end())
+        {
+            return it->second;
+        }
+        ir::ValueId value;
+        const std::vector<ir::BlockId> &preds = m_fn.blocks[block].preds;
+        if (!m_sealed[block])
+        {
+            value = new_phi(block);
+            m_incomplete[block].emplace_back(var, value);
+        }
+        else if (preds.empty())
+        {
+            // Only unreachable blocks have no predecessors besides the
+            // entry, where every variable is assigned before it is read
+            value = emit({.opcode = ir::Opcode::const_}, block);
+        }
+        else if (preds.size() == 1)
+        {
+            value = read_variable(var, preds.front());
+        }
+        else
+        {
+            // The phi is recorded first to end the recursion around loops
+            const ir::ValueId phi = new_phi(block);
+            write_variable(var, block, phi);
+            value = add_phi_operands(var, phi);
+        }
+        write_variable(var, block, value);
+        return value;
+    }
+
+    ir::ValueId add_phi_operands(const Var var, const ir::ValueId phi)
+    {
+        const ir::BlockId block = m_fn.values[phi].block;
+        for (size_t i = 0; i < m_fn.blocks[block].preds.size(); i++)
+        {
+            const ir::ValueId operand = read_variable(var, m_fn.blocks[block].preds[i]);
+            m_fn.phi_operands[m_fn.values[phi].imm].push_back(operand);
+        }
+        return m_replaced.try_remove_trivial_phi(m_fn, phi);
+    }
+
+    void seal(const ir::BlockId block)
+    {
+        for (const auto &[var, phi] : m_incomplete[block])
+        {
+            add_phi_operands(var, phi);
+        }
+        m_incomplete[block].clear();
+        m_sealed[block] = true;
+    }
+
+    const node::NodeProg &m_prog;
+    const Interner &m_interner;
+    ir::Function m_fn{};
+    ir::BlockId m_block = 0;
+    SymbolTable<Var> m_vars{};
+    std::vector<std::unordered_map<Var, ir::ValueId>> m_defs{}; // current value of each variable per block
+    std::vector<bool> m_sealed{};
+    std::vector<std::vector<std::pair<Var, ir::ValueId>>> m_incomplete{}; // phis waiting for their block to be sealed
+    ir::Replacements m_replaced{};
+    ir::Removed m_removed{};
+    std::unordered_map<Var, ir::ArrayId> m_arrays{}; // of the variables holding one
+    static constexpr uint32_t unknown_length = UINT32_MAX;
+    std::vector<uint32_t> m_lengths{}; // per expression, see array_length
+    uint32_t m_array_elements = 0;     // of the variables declared so far
+    std::vector<std::pair<ir::ArrayId, bool>> m_temps{}; // and whether they are in use
+};
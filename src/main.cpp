@@ -1,61 +1,75 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <vector>
 #include <optional>
 #include <cctype>
+#include <cstdlib>
+#include <string>
 
-#include "./arena.hpp"
-
-#include "./generation.hpp"
-#include "./parser.hpp"
-#include "./tokenization.hpp"
+#include "./cli.hpp"
+#include "./server.hpp"
 // // Optional is a libraray which allows to return instances when
 // // no value is present which is nullopt different from nullptr
 // // as it is not a pointer
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (args.size() == 2 && args.front() == "--server")
     {
-        std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
-        std::cerr << "hydro <input.hy>" << std::endl;
-        return EXIT_FAILURE;
+        try
+        {
+            CompileServer(args.back()).serve();
+        }
+        catch (const CompileError &error)
+        {
+            std::cerr << error.what() << std::endl;
+            return EXIT_FAILURE;
+        }
     }
-    //  std::fstream file("out.asm", std::ios::out);
-    std::string contents;
+    if (args.size() >= 2 && args.front() == "--connect")
     {
-        std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
+        const std::string socket_path = args[1];
+        args.erase(args.begin(), args.begin() + 2);
+        // Stdin cannot be forwarded, a program is not run inside the server
+        // where its faults would take the server down, and without a server
+        // the compilation runs here
+        const auto given = [&](const std::string_view arg)
+        {
+            return std::ranges::find(args, arg) != args.end();
+        };
+        if (!given("-") && !given("--run") && !given("--interp"))
+        {
+            try
+            {
+                if (const std::optional<int> status = compile_remote(socket_path, args))
+                {
+                    return status.value();
+                }
+            }
+            catch (const CompileError &)
+            {
+            }
+        }
     }
 
-    Tokenizer tokenizer(std::move(contents));
-    std::cout << contents << std::endl;
-    std::vector<Token> tokens = tokenizer.tokenize();
-
-    Parser parser(std::move(tokens));
-    std::optional<node::NodeProg> prog = parser.parse_prog();
-    if (!prog.has_value())
+    std::optional<Invocation> invocation = parse_invocation(args, std::getenv("HYDRO_CACHE_DIR"), std::cerr);
+    if (!invocation.has_value())
     {
-        std::cerr << "invalid program" << std::endl;
-        exit(EXIT_FAILURE);
-    }
-    Generator generator(prog.value());
-    {
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+        return EXIT_FAILURE;
     }
+    std::optional<CompileCache> cache;
+    if (invocation->cache_dir.has_value())
     {
-        std::stringstream contents_stream;
-        std::fstream input("out.asm", std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
+        try
+        {
+            cache.emplace(invocation->cache_dir.value(), static_cast<uint64_t>(invocation->cache_size_mib) * 1024 * 1024);
+        }
+        catch (const CompileError &error)
+        {
+            std::cerr << error.what() << std::endl;
+            return EXIT_FAILURE;
+        }
     }
-    std::cout << contents << std::endl;
-    system("nasm -felf64 out.asm");
-    system("ld -o out out.o");
-
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    std::vector<Compiler> compilers;
+    return run_invocation(invocation.value(), compilers, cache.has_value() ? &cache.value() : nullptr, std::cout, std::cerr);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "./error.hpp"
+
+// Append-only byte buffer for generated output. Appending only copies into the
+// preallocated storage and numbers are formatted in place, so nothing
+// allocates while the buffer stays within its capacity.
+class OutputBuffer
+{
+public:
+    explicit OutputBuffer(const size_t capacity = 4096)
+    {
+        m_data.reserve(capacity);
+    }
+
+    void reserve(const size_t capacity)
+    {
+        m_data.reserve(capacity);
+    }
+
+    OutputBuffer &append(const std::string_view text)
+    {
+        m_data.insert(m_data.end(), text.begin(), text.end());
+        return *this;
+    }
+
+    OutputBuffer &append(const char c)
+    {
+        m_data.push_back(c);
+        return *this;
+    }
+
+    OutputBuffer &append_bytes(const void *data, const size_t size)
+    {
+        const auto bytes = static_cast<const char *>(data);
+        m_data.insert(m_data.end(), bytes, bytes + size);
+        return *this;
+    }
+
+    OutputBuffer &append_uint(const uint64_t value)
+    {
+        char digits[20];
+        const auto result = std::to_chars(std::begin(digits), std::end(digits), value);
+        m_data.insert(m_data.end(), std::begin(digits), result.ptr);
+        return *this;
+    }
+
+    [[nodiscard]] std::string_view view() const
+    {
+        return {m_data.data(), m_data.size()};
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_data.size();
+    }
+
+    void clear()
+    {
+        m_data.clear();
+    }
+
+    // Replaces the file at path with the contents of the buffer
+    void write_file(const std::string &path, const mode_t mode = 0644) const
+    {
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+        if (fd < 0)
+        {
+            throw CompileError("unable to open ", path, ": ", std::strerror(errno));
+        }
+        try
+        {
+            write_fd(fd, path);
+        }
+        catch (const CompileError &)
+        {
+            ::close(fd);
+            throw;
+        }
+        // The mode passed to open only applies to new files
+        fchmod(fd, mode);
+        ::close(fd);
+    }
+
+    // name is only used in error messages
+    void write_fd(const int fd, const std::string &name) const
+    {
+        // A single write covers the whole buffer unless it is interrupted
+        const char *pos = m_data.data();
+        size_t remaining = m_data.size();
+        while (remaining > 0)
+        {
+            const ssize_t count = ::write(fd, pos, remaining);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count < 0)
+            {
+                throw CompileError("unable to write ", name, ": ", std::strerror(errno));
+            }
+            pos += count;
+            remaining -= static_cast<size_t>(count);
+        }
+    }
+
+private:
+    std::vector<char> m_data{};
+};
@@ -1,166 +1,283 @@
 #pragma once
 
+#include "./error.hpp"
 #include "./tokenization.hpp"
+#include <algorithm>
 #include <optional>
 #include <iostream>
-#include <variant>
+#include <array>
 #include <cassert>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
 
+// The tree is stored flat: every kind of node lives in one contiguous array of
+// NodeProg and children are referenced by their 32-bit index into it.
 namespace node
 {
-    struct NodeTermIntLit
-    {
-        Token int_lit;
-    };
-    struct NodeTermIdent
-    {
-        Token ident;
-    };
+    using ExprId = uint32_t;
+    using StmtId = uint32_t;
+    using ScopeId = uint32_t;
 
-    struct NodeExpr;
+    // Index of a missing child
+    constexpr uint32_t none = UINT32_MAX;
 
-    struct NodeTermParen
-    {
-        NodeExpr *expr;
-    };
-    struct NodeBinExprAdd
-    {
-        NodeExpr *lhs;
-        NodeExpr *rhs;
-    };
-    struct NodeBinExprMulti
-    {
-        NodeExpr *lhs;
-        NodeExpr *rhs;
-    };
-    struct NodeBinExprSub
+    // Over all arrays declared by a program, which live in its stack frame
+    constexpr uint32_t max_array_elements = 1 << 18;
+
+    enum class ExprKind : uint8_t
     {
-        NodeExpr *lhs;
-        NodeExpr *rhs;
+        int_lit,
+        ident,
+        add,
+        sub,
+        mul,
+        div,
+        // Comparisons are unsigned like the arithmetic and yield 0 or 1
+        eq,
+        ne,
+        lt,
+        le,
+        gt,
+        ge,
+        // [e1, e2, ...] and [value; length], the arrays only occur in an
+        // element-wise expression or as initializer of a variable
+        array_lit,
+        array_fill,
+        index // a[i]
     };
-    struct NodeBinExprDiv
+
+    [[nodiscard]] constexpr bool is_bin_expr(const ExprKind kind)
     {
-        NodeExpr *lhs;
-        NodeExpr *rhs;
-    };
-    struct NodeBinExpr
+        return kind >= ExprKind::add && kind <= ExprKind::ge;
+    }
+
+    // The length of the array a binary expression evaluates to when its
+    // operands have the given lengths, 0 standing for a number. Numbers
+    // apply to every element. Throws CompileError for what arrays lack.
+    inline uint32_t element_wise_length(const ExprKind kind, const uint32_t lhs, const uint32_t rhs)
     {
-        std::variant<NodeBinExprAdd *, NodeBinExprMulti *, NodeBinExprSub *, NodeBinExprDiv *> var;
-    };
-    struct NodeTerm
+        if (lhs == 0 && rhs == 0)
+        {
+            return 0;
+        }
+        if (kind != ExprKind::add && kind != ExprKind::sub && kind != ExprKind::mul)
+        {
+            throw CompileError("only +, - and * apply to arrays");
+        }
+        if (lhs != 0 && rhs != 0 && lhs != rhs)
+        {
+            throw CompileError("array lengths differ: ", lhs, " and ", rhs);
+        }
+        return std::max(lhs, rhs);
+    }
+
+    // Throws CompileError unless a value of length can be assigned to an
+    // array of target's
+    inline void check_assigned_length(const uint32_t target, const uint32_t length)
     {
-        std::variant<NodeTermIntLit *, NodeTermIdent *, NodeTermParen *> var;
-    };
+        if (length == 0)
+        {
+            throw CompileError("expected an array of length ", target);
+        }
+        if (length != target)
+        {
+            throw CompileError("array lengths differ: ", target, " and ", length);
+        }
+    }
+
     struct NodeExpr
     {
-        std::variant<NodeTerm *, NodeBinExpr *> var;
+        ExprKind kind;
+        // ident and index: the Symbol, int_lit: low half of the value,
+        // array_lit: range of NodeProg::array_elems, array_fill: the value
+        uint32_t lhs = none;
+        // int_lit: high half of the value, array_fill: the length, index: the index
+        uint32_t rhs = none;
+
+        [[nodiscard]] static NodeExpr int_lit(const uint64_t value)
+        {
+            return {.kind = ExprKind::int_lit, .lhs = static_cast<uint32_t>(value), .rhs = static_cast<uint32_t>(value >> 32)};
+        }
+
+        [[nodiscard]] uint64_t value() const
+        {
+            assert(kind == ExprKind::int_lit);
+            return lhs | static_cast<uint64_t>(rhs) << 32;
+        }
     };
-    struct NodeStmtLet
+
+    enum class StmtKind : uint8_t
     {
-        Token ident;
-        NodeExpr *expr;
+        exit,
+        let,
+        assign,
+        scope,
+        if_,
+        while_,
+        store // a[i] = value
     };
-    struct NodeStmtExit
+
+    // Parens only group and do not get a node. An elif is an if_ statement and
+    // an else a scope statement, hung off the else_ of the if_ before them.
+    struct NodeStmt
     {
-        NodeExpr *expr;
+        StmtKind kind;
+        Symbol ident = 0;     // let, assign, store
+        ExprId expr = none;   // exit, let, assign, store, condition of an if_ or while_
+        ExprId index = none;  // store
+        ScopeId scope = none; // scope, body of an if_ or while_
+        StmtId else_ = none;  // if_: the elif or else that follows
     };
-    struct NodeStmt;
+
+    // Range of NodeProg::scope_stmts holding the statements of the scope
     struct NodeScope
     {
-        std::vector<NodeStmt *> stmts;
-    };
-    struct NodeIfPred;
-    struct NodeIfPredElif
-    {
-        NodeExpr *expr;
-        NodeScope *scope;
-        std::optional<NodeIfPred *> pred;
-    };
-    struct NodeIfPredElse
-    {
-        NodeScope *scope;
-    };
-    struct NodeIfPred
-    {
-        std::variant<NodeIfPredElif *, NodeIfPredElse *> var;
-    };
-    struct NodeStmtIf
-    {
-        NodeExpr *expr;
-        NodeScope *scope;
-        std::optional<NodeIfPred *> pred;
+        uint32_t begin;
+        uint32_t end;
     };
 
-    struct NodeStmtAssign
-    {
-        Token ident;
-        NodeExpr* expr;
-    };
-    struct NodeStmt
-    {
-        std::variant<NodeStmtExit *, NodeStmtLet *, NodeScope *, NodeStmtIf *, NodeStmtAssign *> var;
-    };
     struct NodeProg
     {
-        std::vector<NodeStmt *> stmts;
+        std::vector<NodeExpr> exprs;
+        std::vector<NodeStmt> stmts;
+        std::vector<NodeScope> scopes;
+        std::vector<StmtId> scope_stmts;
+        std::vector<ExprId> array_elems;
+        ScopeId root = none;     // the top level statements
+        bool has_arrays = false; // without an array literal every expression is a number
+
+        [[nodiscard]] std::span<const StmtId> body(const ScopeId scope) const
+        {
+            return std::span(scope_stmts).subspan(scopes[scope].begin, scopes[scope].end - scopes[scope].begin);
+        }
+
+        [[nodiscard]] std::span<const ExprId> elements(const ExprId array_lit) const
+        {
+            return std::span(array_elems).subspan(exprs[array_lit].lhs, exprs[array_lit].rhs - exprs[array_lit].lhs);
+        }
+
+        [[nodiscard]] size_t node_count() const
+        {
+            return exprs.size() + stmts.size() + scopes.size();
+        }
+
+        [[nodiscard]] size_t bytes() const
+        {
+            return exprs.size() * sizeof(NodeExpr) + stmts.size() * sizeof(NodeStmt) +
+                   scopes.size() * sizeof(NodeScope) + scope_stmts.size() * sizeof(StmtId) +
+                   array_elems.size() * sizeof(ExprId);
+        }
     };
 }
 
 class Parser
 {
 public:
-    explicit Parser(std::vector<Token> tokens)
-        : m_tokens(std::move(tokens)),
-          m_allocator(1024 * 1024 * 4) // 4 mb
+    // Tokens are pulled from tokenizer as the parser advances. The arrays of
+    // storage, typically the tree of a previous parse, are reused for the new tree.
+    explicit Parser(Tokenizer &tokenizer, node::NodeProg storage = {})
+        : m_tokenizer(tokenizer),
+          m_prog(std::move(storage))
     {
+        m_prog.exprs.clear();
+        m_prog.stmts.clear();
+        m_prog.scopes.clear();
+        m_prog.scope_stmts.clear();
+        m_prog.array_elems.clear();
+        m_prog.root = node::none;
+        m_prog.has_arrays = false;
     }
 
-    std::optional<node::NodeTerm *> parse_term()
+    std::optional<node::ExprId> parse_term()
     {
         if (auto int_lit = try_consume(TokenType::int_lit))
         {
-            auto term_int_lit = m_allocator.alloc<node::NodeTermIntLit>();
-            term_int_lit->int_lit = int_lit.value();
-            auto term = m_allocator.alloc<node::NodeTerm>();
-            term->var = term_int_lit;
-            return term;
+            return add_expr(node::NodeExpr::int_lit(int_lit->int_value));
         }
         if (auto ident = try_consume(TokenType::ident))
         {
-            auto term_ident = m_allocator.alloc<node::NodeTermIdent>();
-            term_ident->ident = ident.value();
-            auto term = m_allocator.alloc<node::NodeTerm>();
-            term->var = term_ident;
-            return term;
+            if (try_consume(TokenType::open_bracket))
+            {
+                const node::ExprId index = parse_index();
+                return add_expr({.kind = node::ExprKind::index, .lhs = ident->symbol, .rhs = index});
+            }
+            return add_expr({.kind = node::ExprKind::ident, .lhs = ident->symbol});
+        }
+        if (try_consume(TokenType::open_bracket))
+        {
+            return parse_array();
         }
         if (auto open_paren = try_consume(TokenType::open_paren))
         {
             auto expr = parse_expr();
             if (!expr.has_value())
             {
-                std::cerr << "Expected Expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Expected Expression");
             }
             try_consume(TokenType::close_paren, "expected )");
-            auto term_paren = m_allocator.alloc<node::NodeTermParen>();
-            term_paren->expr = expr.value();
-            auto term = m_allocator.alloc<node::NodeTerm>();
-            term->var = term_paren;
-            return term;
+            return expr;
         }
 
         return {};
     }
 
-    std::optional<node::NodeExpr *> parse_expr(const int min_prec = 0)
+    // Follows the [ of an array, elements are collected on a shared stack
+    // like the statements of a scope
+    node::ExprId parse_array()
     {
-        std::optional<node::NodeTerm *> term_lhs = parse_term();
-        if (!term_lhs.has_value())
+        m_prog.has_arrays = true;
+        const auto first = parse_expr();
+        if (!first.has_value())
+        {
+            throw CompileError("expected expression");
+        }
+        if (try_consume(TokenType::semi))
+        {
+            const Token length = try_consume(TokenType::int_lit, "expected array length");
+            check_array_length(length.int_value);
+            try_consume(TokenType::close_bracket, "expected ]");
+            return add_expr({.kind = node::ExprKind::array_fill, .lhs = first.value(), .rhs = static_cast<uint32_t>(length.int_value)});
+        }
+        const size_t begin = m_elem_stack.size();
+        m_elem_stack.push_back(first.value());
+        while (try_consume(TokenType::comma))
+        {
+            const auto elem = parse_expr();
+            if (!elem.has_value())
+            {
+                throw CompileError("expected expression");
+            }
+            m_elem_stack.push_back(elem.value());
+        }
+        try_consume(TokenType::close_bracket, "expected ]");
+        check_array_length(m_elem_stack.size() - begin);
+        const auto elems = static_cast<uint32_t>(m_prog.array_elems.size());
+        m_prog.array_elems.insert(m_prog.array_elems.end(), m_elem_stack.begin() + begin, m_elem_stack.end());
+        m_elem_stack.resize(begin);
+        return add_expr({.kind = node::ExprKind::array_lit, .lhs = elems, .rhs = static_cast<uint32_t>(m_prog.array_elems.size())});
+    }
+
+    // Follows the [ of an element access
+    node::ExprId parse_index()
+    {
+        const auto index = parse_expr();
+        if (!index.has_value())
+        {
+            throw CompileError("expected expression");
+        }
+        try_consume(TokenType::close_bracket, "expected ]");
+        return index.value();
+    }
+
+    std::optional<node::ExprId> parse_expr(const int min_prec = 0)
+    {
+        std::optional<node::ExprId> expr_lhs = parse_term();
+        if (!expr_lhs.has_value())
         {
             return {};
         }
-        auto expr_lhs = m_allocator.alloc<node::NodeExpr>();
-        expr_lhs->var = term_lhs.value();
         while (true)
         {
             std::optional<Token> curr_tok = peek();
@@ -183,219 +300,198 @@ public:
 
             if (!expr_rhs.has_value())
             {
-                std::cerr << "unable to parse expression " << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("unable to parse expression ");
             }
 
-            auto expr = m_allocator.alloc<node::NodeBinExpr>();
-            auto expr_lhs2 = m_allocator.alloc<node::NodeExpr>();
-            if (op.type == TokenType::plus)
-            {
-                auto add = m_allocator.alloc<node::NodeBinExprAdd>();
-                expr_lhs2->var = expr_lhs->var;
-                add->lhs = expr_lhs2;
-                add->rhs = expr_rhs.value();
-                expr->var = add;
-            }
-            else if (op.type == TokenType::star)
-            {
-                auto multi = m_allocator.alloc<node::NodeBinExprMulti>();
-                expr_lhs2->var = expr_lhs->var;
-                multi->lhs = expr_lhs2;
-                multi->rhs = expr_rhs.value();
-                expr->var = multi;
-            }
-            else if (op.type == TokenType::sub)
-            {
-                auto sub = m_allocator.alloc<node::NodeBinExprSub>();
-                expr_lhs2->var = expr_lhs->var;
-                sub->lhs = expr_lhs2;
-                sub->rhs = expr_rhs.value();
-                expr->var = sub;
-            }
-            else if (op.type == TokenType::div)
-            {
-                auto div = m_allocator.alloc<node::NodeBinExprDiv>();
-                expr_lhs2->var = expr_lhs->var;
-                div->lhs = expr_lhs2;
-                div->rhs = expr_rhs.value();
-                expr->var = div;
-            }
-            else
-            {
-                assert(false);
-            }
-            expr_lhs->var = expr;
+            expr_lhs = add_expr({.kind = bin_expr_kind(op.type), .lhs = expr_lhs.value(), .rhs = expr_rhs.value()});
         }
         return expr_lhs;
     }
 
-    std::optional<node::NodeScope *> parse_scope()
+    std::optional<node::ScopeId> parse_scope()
     {
         if (!try_consume(TokenType::open_curly).has_value())
         {
             return {};
         }
-        auto scope = m_allocator.alloc<node::NodeScope>();
+        // Nested scopes finish first, so statements are collected on a shared
+        // stack and only copied out once the whole scope is parsed
+        const size_t first = m_scope_stack.size();
         while (auto stmt = parse_stmt())
         {
-            scope->stmts.push_back(stmt.value());
+            m_scope_stack.push_back(stmt.value());
         }
         try_consume(TokenType::close_curly, "expected }");
-        return scope;
+        return end_scope(first);
     }
 
-    std::optional<node::NodeIfPred *> parse_if_pred()
+    std::optional<node::StmtId> parse_if_pred()
     {
         if (try_consume(TokenType::elif))
         {
             try_consume(TokenType::open_paren, "exprected (");
-            const auto elif = m_allocator.alloc<node::NodeIfPredElif>();
+            node::NodeStmt elif{.kind = node::StmtKind::if_};
             if (const auto expr = parse_expr())
             {
-                elif->expr = expr.value();
+                elif.expr = expr.value();
             }
             else
             {
-                std::cerr << "expected expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("expected expression");
             }
             try_consume(TokenType::close_paren, "expected )");
             if (const auto scope = parse_scope())
             {
-                elif->scope = scope.value();
+                elif.scope = scope.value();
             }
             else
             {
-                std::cerr << "expected scope" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("expected scope");
             }
-            elif->pred = parse_if_pred();
-            auto pred = m_allocator.emplace<node::NodeIfPred>(elif);
-            return pred;
+            elif.else_ = parse_if_pred().value_or(node::none);
+            return add_stmt(elif);
         }
         if (try_consume(TokenType::else_))
         {
-            auto else_ = m_allocator.alloc<node::NodeIfPredElse>();
             if (const auto scope = parse_scope())
             {
-                else_->scope = scope.value();
+                return add_stmt({.kind = node::StmtKind::scope, .scope = scope.value()});
             }
-            else
-            {
-                std::cerr << "expected scope" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-            auto pred = m_allocator.emplace<node::NodeIfPred>(else_);
-            return pred;
+            throw CompileError("expected scope");
         }
         return {};
     }
 
-    std::optional<node::NodeStmt *> parse_stmt()
+    std::optional<node::StmtId> parse_stmt()
     {
         if (peek().has_value() && peek().value().type == TokenType::exit && peek(1).has_value() && peek(1).value().type == TokenType::open_paren)
         {
             consume();
             consume();
-            auto stmt_exit = m_allocator.alloc<node::NodeStmtExit>();
+            node::NodeStmt stmt_exit{.kind = node::StmtKind::exit};
             if (const auto node_expr = parse_expr())
             {
-                stmt_exit->expr = node_expr.value();
+                stmt_exit.expr = node_expr.value();
             }
             else
             {
-                std::cerr << "invalid expression " << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("invalid expression ");
             }
             try_consume(TokenType::close_paren, "expected )");
             try_consume(TokenType::semi, "expected ;");
-
-            auto stmt = m_allocator.alloc<node::NodeStmt>();
-            stmt->var = stmt_exit;
-            return stmt;
+            return add_stmt(stmt_exit);
         }
         if (peek().has_value() && peek().value().type == TokenType::let && peek(1).has_value() && peek(1).value().type == TokenType::ident && peek(2).has_value() && peek(2).value().type == TokenType::eq)
         {
             consume();
-            auto stmt_let = m_allocator.alloc<node::NodeStmtLet>();
-            stmt_let->ident = consume();
+            node::NodeStmt stmt_let{.kind = node::StmtKind::let};
+            stmt_let.ident = consume().symbol;
             consume();
             if (const auto expr = parse_expr())
             {
-                stmt_let->expr = expr.value();
+                stmt_let.expr = expr.value();
             }
             else
             {
-                std::cerr << "invalid expression " << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("invalid expression ");
             }
             try_consume(TokenType::semi, "expected ;");
-            auto stmt = m_allocator.alloc<node::NodeStmt>();
-            stmt->var = stmt_let;
-            return stmt;
+            return add_stmt(stmt_let);
         }
 
         if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value() && peek(1).value().type == TokenType::eq)
         {
-            auto assign = m_allocator.alloc<node::NodeStmtAssign>();
-            assign->ident = consume();
+            node::NodeStmt assign{.kind = node::StmtKind::assign};
+            assign.ident = consume().symbol;
             consume();
             if (auto expr = parse_expr())
             {
-                assign->expr = expr.value();
+                assign.expr = expr.value();
             }
             else
             {
-                std::cerr << "expected expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("expected expression");
             }
             try_consume(TokenType::semi, "expected ;");
-            auto stmt = m_allocator.emplace<node::NodeStmt>(assign);
-            return stmt;
+            return add_stmt(assign);
+        }
+
+        if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value() && peek(1).value().type == TokenType::open_bracket)
+        {
+            node::NodeStmt store{.kind = node::StmtKind::store};
+            store.ident = consume().symbol;
+            consume();
+            store.index = parse_index();
+            try_consume(TokenType::eq, "expected =");
+            if (auto expr = parse_expr())
+            {
+                store.expr = expr.value();
+            }
+            else
+            {
+                throw CompileError("expected expression");
+            }
+            try_consume(TokenType::semi, "expected ;");
+            return add_stmt(store);
         }
 
         if (peek().has_value() && peek().value().type == TokenType::open_curly)
         {
             if (auto scope = parse_scope())
             {
-                auto stmt = m_allocator.alloc<node::NodeStmt>();
-                stmt->var = scope.value();
-                return stmt;
+                return add_stmt({.kind = node::StmtKind::scope, .scope = scope.value()});
             }
             else
             {
-                std::cerr << "invalid scope " << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("invalid scope ");
             }
         }
         if (auto if_ = try_consume(TokenType::if_))
         {
             try_consume(TokenType::open_paren, "expected (");
-            auto stmt_if = m_allocator.alloc<node::NodeStmtIf>();
+            node::NodeStmt stmt_if{.kind = node::StmtKind::if_};
+            if (const auto expr = parse_expr())
+            {
+                stmt_if.expr = expr.value();
+            }
+            else
+            {
+                throw CompileError("invalid expression ");
+            }
+            try_consume(TokenType::close_paren, "expected )");
+            if (const auto scope = parse_scope())
+            {
+                stmt_if.scope = scope.value();
+            }
+            else
+            {
+                throw CompileError("invalid scope ");
+            }
+            stmt_if.else_ = parse_if_pred().value_or(node::none);
+            return add_stmt(stmt_if);
+        }
+        if (try_consume(TokenType::while_))
+        {
+            try_consume(TokenType::open_paren, "expected (");
+            node::NodeStmt stmt_while{.kind = node::StmtKind::while_};
             if (const auto expr = parse_expr())
             {
-                stmt_if->expr = expr.value();
+                stmt_while.expr = expr.value();
             }
             else
             {
-                std::cerr << "invalid expression " << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("invalid expression ");
             }
             try_consume(TokenType::close_paren, "expected )");
             if (const auto scope = parse_scope())
             {
-                stmt_if->scope = scope.value();
+                stmt_while.scope = scope.value();
             }
             else
             {
-                std::cerr << "invalid scope " << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("invalid scope ");
             }
-            stmt_if->pred = parse_if_pred();
-            auto stmt = m_allocator.alloc<node::NodeStmt>();
-            stmt->var = stmt_if;
-            return stmt;
+            return add_stmt(stmt_while);
         }
 
         return {};
@@ -403,39 +499,56 @@ public:
 
     std::optional<node::NodeProg> parse_prog()
     {
-        node::NodeProg prog;
-
         while (peek().has_value())
         {
             if (auto stmt = parse_stmt())
             {
-                prog.stmts.push_back(stmt.value());
+                m_scope_stack.push_back(stmt.value());
             }
             else
             {
-                std::cerr << "invalid statement" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("invalid statement");
             }
         }
-        return prog;
+        m_prog.root = end_scope(0);
+        return std::move(m_prog);
     }
 
 private:
-    [[nodiscard]] std::optional<Token> peek(const size_t offset = 0) const
+    // Only the tokens up to the lookahead are kept, in a ring buffer
+    [[nodiscard]] std::optional<Token> peek(const size_t offset = 0)
     {
-        if (m_index + offset >= m_tokens.size())
+        if (!fill(offset + 1))
         {
             return {};
         }
-        else
-        {
-            return m_tokens.at(m_index + offset);
-        }
+        return m_lookahead[(m_lookahead_start + offset) % m_lookahead.size()];
     }
 
     Token consume()
     {
-        return m_tokens.at(m_index++);
+        [[maybe_unused]] const bool available = fill(1);
+        assert(available);
+        Token token = std::move(m_lookahead[m_lookahead_start]);
+        m_lookahead_start = (m_lookahead_start + 1) % m_lookahead.size();
+        m_lookahead_count--;
+        return token;
+    }
+
+    // Pulls tokens until count of them are buffered, returns false at the end of the input
+    bool fill(const size_t count)
+    {
+        assert(count <= m_lookahead.size());
+        while (m_lookahead_count < count)
+        {
+            std::optional<Token> token = m_tokenizer.next();
+            if (!token.has_value())
+            {
+                return false;
+            }
+            m_lookahead[(m_lookahead_start + m_lookahead_count++) % m_lookahead.size()] = std::move(token.value());
+        }
+        return true;
     }
 
     Token try_consume(const TokenType type, const std::string err_msg)
@@ -445,8 +558,7 @@ private:
             return consume();
         }
 
-        std::cerr << err_msg << std::endl;
-        exit(EXIT_FAILURE);
+        throw CompileError(err_msg);
     }
     std::optional<Token> try_consume(const TokenType type)
     {
@@ -458,7 +570,71 @@ private:
         return {};
     }
 
-    const std::vector<Token> m_tokens;
-    size_t m_index = 0;
-    ArenaAllocator m_allocator;
+    [[nodiscard]] static node::ExprKind bin_expr_kind(const TokenType type)
+    {
+        switch (type)
+        {
+        case TokenType::plus:
+            return node::ExprKind::add;
+        case TokenType::sub:
+            return node::ExprKind::sub;
+        case TokenType::star:
+            return node::ExprKind::mul;
+        case TokenType::div:
+            return node::ExprKind::div;
+        case TokenType::eq_eq:
+            return node::ExprKind::eq;
+        case TokenType::bang_eq:
+            return node::ExprKind::ne;
+        case TokenType::lt:
+            return node::ExprKind::lt;
+        case TokenType::lt_eq:
+            return node::ExprKind::le;
+        case TokenType::gt:
+            return node::ExprKind::gt;
+        case TokenType::gt_eq:
+            return node::ExprKind::ge;
+        default:
+            assert(false);
+            return node::ExprKind::add;
+        }
+    }
+
+    static void check_array_length(const uint64_t length)
+    {
+        if (length == 0 || length > node::max_array_elements)
+        {
+            throw CompileError("array length must be 1 to ", node::max_array_elements);
+        }
+    }
+
+    node::ExprId add_expr(const node::NodeExpr expr)
+    {
+        m_prog.exprs.push_back(expr);
+        return static_cast<node::ExprId>(m_prog.exprs.size() - 1);
+    }
+
+    node::StmtId add_stmt(const node::NodeStmt stmt)
+    {
+        m_prog.stmts.push_back(stmt);
+        return static_cast<node::StmtId>(m_prog.stmts.size() - 1);
+    }
+
+    // Moves the statements collected since first into a new scope
+    node::ScopeId end_scope(const size_t first)
+    {
+        const auto begin = static_cast<uint32_t>(m_prog.scope_stmts.size());
+        m_prog.scope_stmts.insert(m_prog.scope_stmts.end(), m_scope_stack.begin() + first, m_scope_stack.end());
+        m_scope_stack.resize(first);
+        m_prog.scopes.push_back({.begin = begin, .end = static_cast<uint32_t>(m_prog.scope_stmts.size())});
+        return static_cast<node::ScopeId>(m_prog.scopes.size() - 1);
+    }
+
+    Tokenizer &m_tokenizer;
+    node::NodeProg m_prog;
+    std::array<Token, 4> m_lookahead{}; // parse_stmt looks at most 3 tokens ahead
+    size_t m_lookahead_start = 0;
+    size_t m_lookahead_count = 0;
+    std::vector<node::StmtId> m_scope_stack{}; // statements of the scopes being parsed
+    std::vector<node::ExprId> m_elem_stack{};  // elements of the arrays being parsed
 };
@@ -0,0 +1,301 @@
+#pragma once
+
+#include "./x86.hpp"
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Rewrites redundant instruction sequences emitted by the Generator. Each
+// instruction is appended to the output and the rules are matched against
+// the window at its end; replacements are appended in turn, so rewrites
+// cascade until nothing in the window matches anymore.
+//
+// Rules assume flags are only consumed by the jcc or setcc directly after a
+// test or cmp, which is all the Generator produces.
+class Peephole
+{
+public:
+    struct Rule
+    {
+        std::string_view name;
+        size_t size;
+        // Returns the replacement of the window, or nullopt when the rule does not apply
+        std::optional<std::vector<Instr>> (Peephole::*rewrite)(std::span<const Instr> window) const;
+    };
+
+    static constexpr size_t rule_count = 5;
+
+    static const std::array<Rule, rule_count> &rules()
+    {
+        static constexpr std::array<Rule, rule_count> table{{
+            {"push-pop", 2, &Peephole::push_pop},
+            {"self-mov", 1, &Peephole::self_mov},
+            {"add-zero", 1, &Peephole::add_zero},
+            {"jmp-next", 1, &Peephole::jmp_next},
+            {"copy-propagation", 2, &Peephole::copy_propagation},
+        }};
+        return table;
+    }
+
+    void optimize(std::vector<Instr> &instrs)
+    {
+        m_input = &instrs;
+        m_labels.clear();
+        for (size_t i = 0; i < instrs.size(); i++)
+        {
+            if (instrs[i].op == Op::label)
+            {
+                m_labels[instrs[i].dst.value] = i;
+            }
+        }
+
+        m_output.clear();
+        m_output.reserve(instrs.size());
+        for (m_pos = 0; m_pos < instrs.size(); m_pos++)
+        {
+            append(instrs[m_pos]);
+        }
+        instrs = std::move(m_output);
+        m_input = nullptr;
+    }
+
+    [[nodiscard]] size_t rewrite_count() const
+    {
+        size_t count = 0;
+        for (const size_t rule_rewrites : m_rule_counts)
+        {
+            count += rule_rewrites;
+        }
+        return count;
+    }
+
+    [[nodiscard]] size_t rewrite_count(const size_t rule) const
+    {
+        return m_rule_counts[rule];
+    }
+
+private:
+    void append(const Instr &instr)
+    {
+        m_output.push_back(instr);
+        for (size_t i = 0; i < rule_count; i++)
+        {
+            const Rule &rule = rules()[i];
+            if (m_output.size() < rule.size)
+            {
+                continue;
+            }
+            const std::span<const Instr> window(m_output.end() - rule.size, m_output.end());
+            if (auto replacement = (this->*rule.rewrite)(window))
+            {
+                m_rule_counts[i]++;
+                m_output.resize(m_output.size() - rule.size);
+                for (const Instr &replaced : replacement.value())
+                {
+                    append(replaced);
+                }
+                return;
+            }
+        }
+    }
+
+    // push a; pop b => mov b, a
+    std::optional<std::vector<Instr>> push_pop(const std::span<const Instr> window) const
+    {
+        const Instr &push = window[0];
+        const Instr &pop = window[1];
+        if (push.op != Op::push || pop.op != Op::pop || pop.dst.kind != Operand::Kind::reg)
+        {
+            return {};
+        }
+        if (push.dst == pop.dst)
+        {
+            return std::vector<Instr>{};
+        }
+        return std::vector<Instr>{{.op = Op::mov, .dst = pop.dst, .src = push.dst}};
+    }
+
+    // mov a, a => nothing
+    std::optional<std::vector<Instr>> self_mov(const std::span<const Instr> window) const
+    {
+        if (window[0].op != Op::mov || window[0].dst != window[0].src)
+        {
+            return {};
+        }
+        return std::vector<Instr>{};
+    }
+
+    // add a, 0 / sub a, 0 => nothing
+    std::optional<std::vector<Instr>> add_zero(const std::span<const Instr> window) const
+    {
+        const Instr &instr = window[0];
+        if ((instr.op != Op::add && instr.op != Op::sub) || instr.src != Operand::from_imm(0))
+        {
+            return {};
+        }
+        return std::vector<Instr>{};
+    }
+
+    // jmp l; l: => l:
+    std::optional<std::vector<Instr>> jmp_next(const std::span<const Instr> window) const
+    {
+        if (window[0].op != Op::jmp)
+        {
+            return {};
+        }
+        for (size_t i = m_pos + 1; i < m_input->size() && (*m_input)[i].op == Op::label; i++)
+        {
+            if ((*m_input)[i].dst == window[0].dst)
+            {
+                return std::vector<Instr>{};
+            }
+        }
+        return {};
+    }
+
+    // mov t, x; mov y, t => mov y, x when t is not read afterwards
+    std::optional<std::vector<Instr>> copy_propagation(const std::span<const Instr> window) const
+    {
+        const Instr &first = window[0];
+        const Instr &second = window[1];
+        if (first.op != Op::mov || second.op != Op::mov || first.dst.kind != Operand::Kind::reg || second.src != first.dst)
+        {
+            return {};
+        }
+        // mov has no memory to memory form and only sign extended 32 bit immediates for memory
+        const Operand &src = first.src;
+        if (second.dst.kind == Operand::Kind::mem &&
+            (src.kind == Operand::Kind::mem || (src.kind == Operand::Kind::imm && src.value > INT32_MAX)))
+        {
+            return {};
+        }
+        if (reads(second.dst, first.dst.reg))
+        {
+            return {};
+        }
+        std::unordered_set<size_t> visited;
+        if (!is_dead(first.dst.reg, m_pos + 1, visited))
+        {
+            return {};
+        }
+        return std::vector<Instr>{{.op = Op::mov, .dst = second.dst, .src = src}};
+    }
+
+    // Whether reg is overwritten before it is read on every path starting at pos of the input
+    bool is_dead(const Reg reg, size_t pos, std::unordered_set<size_t> &visited) const
+    {
+        for (; pos < m_input->size(); pos++)
+        {
+            if (!visited.insert(pos).second)
+            {
+                return true;
+            }
+            const Instr &instr = (*m_input)[pos];
+            switch (instr.op)
+            {
+            case Op::label:
+                break;
+            case Op::jmp:
+                return is_dead(reg, m_labels.at(instr.dst.value), visited);
+            case Op::jz:
+            case Op::jnz:
+            case Op::jb:
+            case Op::jae:
+            case Op::jbe:
+            case Op::ja:
+                if (!is_dead(reg, m_labels.at(instr.dst.value), visited))
+                {
+                    return false;
+                }
+                break;
+            case Op::syscall:
+                // Syscall arguments
+                for (const Reg arg : {Reg::rax, Reg::rdi, Reg::rsi, Reg::rdx, Reg::r10, Reg::r8, Reg::r9})
+                {
+                    if (reg == arg)
+                    {
+                        return false;
+                    }
+                }
+                if (reg == Reg::rcx || reg == Reg::r11)
+                {
+                    return true;
+                }
+                break;
+            case Op::ret:
+                // Whoever called the code may read any register
+                return false;
+            case Op::div:
+                if (reg == Reg::rax || reg == Reg::rdx || reads(instr.dst, reg))
+                {
+                    return false;
+                }
+                break;
+            case Op::mul:
+                // rdx:rax = rax * dst
+                if (reg == Reg::rax || reads(instr.dst, reg))
+                {
+                    return false;
+                }
+                if (reg == Reg::rdx)
+                {
+                    return true;
+                }
+                break;
+            case Op::xor_:
+                // Zeroing idiom
+                if (instr.dst == instr.src && instr.dst.is_reg(reg))
+                {
+                    return true;
+                }
+                [[fallthrough]];
+            default:
+                if (reads(instr.src, reg) || (!writes_only(instr.op) && reads(instr.dst, reg)) ||
+                    (instr.dst.kind == Operand::Kind::mem && reads(instr.dst, reg)))
+                {
+                    return false;
+                }
+                if ((instr.op == Op::push || instr.op == Op::pop) && reg == Reg::rsp)
+                {
+                    return false;
+                }
+                if (writes_only(instr.op) && instr.dst.is_reg(reg))
+                {
+                    return true;
+                }
+                break;
+            }
+        }
+        return true;
+    }
+
+    // Whether operand uses the value of reg, directly or in an address
+    [[nodiscard]] static bool reads(const Operand &operand, const Reg reg)
+    {
+        if (operand.is_indexed() && operand.index == reg)
+        {
+            return true;
+        }
+        return (operand.kind == Operand::Kind::reg || operand.kind == Operand::Kind::mem ||
+                operand.kind == Operand::Kind::address) &&
+               operand.reg == reg;
+    }
+
+    // Whether op overwrites its destination without reading it
+    [[nodiscard]] static bool writes_only(const Op op)
+    {
+        return op == Op::mov || op == Op::movzx || op == Op::pop || op == Op::lea;
+    }
+
+    const std::vector<Instr> *m_input = nullptr;
+    size_t m_pos = 0;
+    std::unordered_map<uint64_t, size_t> m_labels{};
+    std::vector<Instr> m_output{};
+    std::array<size_t, rule_count> m_rule_counts{};
+};
@@ -0,0 +1,374 @@
+#pragma once
+
+#include "./ir.hpp"
+#include "./strength_reduction.hpp"
+#include "./x86.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <queue>
+#include <utility>
+#include <vector>
+
+// Registers handed out to values. rax and rdx are reserved for div, the exit
+// syscall and the Generator's scratch moves.
+constexpr std::array<Reg, 13> value_regs{Reg::rbx, Reg::rcx, Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::r10,
+                                         Reg::r11, Reg::r12, Reg::r13, Reg::r14, Reg::r15, Reg::rbp};
+
+// Whether value survives being sign extended from 32 bits, the immediates of
+// every instruction but mov
+[[nodiscard]] constexpr bool is_imm32(const uint64_t value)
+{
+    return static_cast<int64_t>(value) >= INT32_MIN && static_cast<int64_t>(value) <= INT32_MAX;
+}
+
+struct Allocation
+{
+    // Per ValueId: a register, a stack slot (QWORD [rsp + 8 * slot]) or, for
+    // constants that every user can take as immediate, the immediate itself.
+    // Stores and kernels have none.
+    std::vector<Operand> locations;
+    size_t slot_count = 0;
+    size_t spill_count = 0;
+};
+
+// Linear scan register allocation (Poletto & Sarkar) over live intervals.
+// Program points are numbered in the order blocks are laid out. Without a
+// loop every path from a definition to a use only crosses blocks laid out
+// between the two, so the interval from the definition to the last use
+// covers every point where the value is live; a back edge additionally
+// keeps whatever is live at the loop header alive to the end of the loop.
+// Phis are written by copies at the end of their predecessors, which is
+// where their intervals start. A phi of a loop header that is dead by the
+// time its operand from the back edge is computed shares one interval with
+// that operand, so the back edge needs no copy for it.
+class RegisterAllocator
+{
+public:
+    explicit RegisterAllocator(const ir::Function &fn)
+        : m_fn(fn)
+    {
+    }
+
+    [[nodiscard]] Allocation allocate()
+    {
+        Allocation allocation;
+        allocation.locations.resize(m_fn.values.size());
+        find_immediates(allocation);
+        build_intervals(allocation);
+
+        std::vector<const Interval *> order;
+        order.reserve(m_intervals.size());
+        for (const Interval &interval : m_intervals)
+        {
+            order.push_back(&interval);
+        }
+        std::ranges::stable_sort(order, {}, &Interval::start);
+
+        // A value dying at an instruction can leave its register to the
+        // result, intervals only overlap when one ends after the other starts
+        std::vector<const Interval *> active;
+        // Spilled intervals by their end, the first to end on top
+        const auto ends_later = [](const Interval *a, const Interval *b)
+        {
+            return a->end > b->end;
+        };
+        std::priority_queue<const Interval *, std::vector<const Interval *>, decltype(ends_later)> spilled(ends_later);
+        std::vector<Reg> free_regs(value_regs.rbegin(), value_regs.rend());
+        std::vector<std::pair<size_t, size_t>> free_slots; // and the point since which they are free
+        for (const Interval *interval : order)
+        {
+            std::erase_if(active, [&](const Interval *other)
+                          {
+                              if (other->end > interval->start)
+                              {
+                                  return false;
+                              }
+                              free_regs.push_back(allocation.locations[other->value].reg);
+                              return true; });
+            while (!spilled.empty() && spilled.top()->end <= interval->start)
+            {
+                free_slots.emplace_back(slot_of(allocation.locations[spilled.top()->value]), spilled.top()->end);
+                spilled.pop();
+            }
+
+            if (!free_regs.empty())
+            {
+                place(allocation, *interval, Operand::from_reg(free_regs.back()));
+                free_regs.pop_back();
+                active.push_back(interval);
+                continue;
+            }
+
+            // No register left, spill whichever interval lives the longest
+            const Interval *spill = interval;
+            const auto furthest = std::ranges::max_element(active, {}, &Interval::end);
+            if ((*furthest)->end > interval->end)
+            {
+                place(allocation, *interval, allocation.locations[(*furthest)->value]);
+                spill = *furthest;
+                *furthest = interval;
+            }
+            // The interval taken out of a register started earlier, and can
+            // only reuse a slot that was already free by then
+            size_t slot;
+            const auto free_slot = std::ranges::find_if(free_slots, [&](const auto &free)
+                                                        { return free.second <= spill->start; });
+            if (free_slot == free_slots.end())
+            {
+                slot = allocation.slot_count++;
+            }
+            else
+            {
+                slot = free_slot->first;
+                free_slots.erase(free_slot);
+            }
+            place(allocation, *spill, Operand::from_mem(Reg::rsp, slot * 8));
+            allocation.spill_count++;
+            spilled.push(spill);
+        }
+        return allocation;
+    }
+
+private:
+    struct Interval
+    {
+        ir::ValueId value;
+        size_t start;
+        size_t end;
+        ir::ValueId coalesced = ir::none; // the back edge operand of the phi value, in the same location
+    };
+
+    static void place(Allocation &allocation, const Interval &interval, const Operand location)
+    {
+        allocation.locations[interval.value] = location;
+        if (interval.coalesced != ir::none)
+        {
+            allocation.locations[interval.coalesced] = location;
+        }
+    }
+
+    // Constants only need a location when one of their users cannot encode
+    // them. Only divisions by zero are left to div, every other divisor and
+    // the multipliers done with lea and shifts never show up in the code.
+    void find_immediates(Allocation &allocation) const
+    {
+        std::vector<bool> needs_location(m_fn.values.size(), false);
+        for (const ir::Instr &instr : m_fn.values)
+        {
+            if (!ir::is_binary(instr.opcode) || m_fn.values[instr.rhs].opcode != ir::Opcode::const_)
+            {
+                continue;
+            }
+            const uint64_t rhs = m_fn.values[instr.rhs].imm;
+            const bool reduced = instr.opcode == ir::Opcode::mul && reduce_multiplier(rhs).has_value();
+            if (instr.opcode == ir::Opcode::div ? rhs == 0 : !is_imm32(rhs) && !reduced)
+            {
+                needs_location[instr.rhs] = true;
+            }
+        }
+        for (ir::ValueId v = 0; v < m_fn.values.size(); v++)
+        {
+            if (m_fn.values[v].opcode == ir::Opcode::const_ && !needs_location[v])
+            {
+                allocation.locations[v] = Operand::from_imm(m_fn.values[v].imm);
+            }
+        }
+    }
+
+    void build_intervals(const Allocation &allocation)
+    {
+        std::vector<size_t> value_pos(m_fn.values.size());
+        std::vector<size_t> block_start(m_fn.blocks.size());
+        std::vector<size_t> block_end(m_fn.blocks.size());
+        size_t pos = 0;
+        for (ir::BlockId b = 0; b < m_fn.blocks.size(); b++)
+        {
+            block_start[b] = pos++;
+            for (const ir::ValueId v : m_fn.blocks[b].instrs)
+            {
+                // Phis all take effect at the start of the block
+                value_pos[v] = m_fn.values[v].opcode == ir::Opcode::phi ? block_start[b] : pos++;
+            }
+            block_end[b] = pos++;
+        }
+
+        std::vector<size_t> interval_of(m_fn.values.size(), SIZE_MAX);
+        for (ir::ValueId v = 0; v < m_fn.values.size(); v++)
+        {
+            if (allocation.locations[v].kind != Operand::Kind::imm && ir::has_result(m_fn.values[v].opcode))
+            {
+                interval_of[v] = m_intervals.size();
+                m_intervals.push_back({.value = v, .start = value_pos[v], .end = value_pos[v]});
+            }
+        }
+        const auto extend = [&](const ir::ValueId v, const size_t point)
+        {
+            if (interval_of[v] != SIZE_MAX)
+            {
+                Interval &interval = m_intervals[interval_of[v]];
+                interval.start = std::min(interval.start, point);
+                interval.end = std::max(interval.end, point);
+            }
+        };
+        // The last point reading each value, where extend also covers the
+        // copies writing phis
+        std::vector<size_t> last_use(m_fn.values.size(), 0);
+        const auto use = [&](const ir::ValueId v, const size_t point)
+        {
+            extend(v, point);
+            last_use[v] = std::max(last_use[v], point);
+        };
+
+        for (ir::BlockId b = 0; b < m_fn.blocks.size(); b++)
+        {
+            const ir::Block &block = m_fn.blocks[b];
+            for (const ir::ValueId v : block.instrs)
+            {
+                const ir::Instr &instr = m_fn.values[v];
+                if (instr.opcode == ir::Opcode::phi)
+                {
+                    const std::span<const ir::ValueId> operands = m_fn.operands(v);
+                    for (size_t i = 0; i < operands.size(); i++)
+                    {
+                        extend(v, block_end[block.preds[i]]);
+                        use(operands[i], block_end[block.preds[i]]);
+                    }
+                }
+                else
+                {
+                    ir::for_each_operand(m_fn, v, [&](const ir::ValueId operand)
+                                         { use(operand, value_pos[v]); });
+                }
+            }
+            if (block.term.kind == ir::TermKind::branch || block.term.kind == ir::TermKind::exit)
+            {
+                use(block.term.value, block_end[b]);
+            }
+        }
+        coalesce_back_edges(interval_of, value_pos, block_start, last_use);
+
+        // A value live into a loop header stays live around the whole loop.
+        // Extending one loop can make a value reach into the header of another.
+        struct Loop
+        {
+            size_t header_start;
+            size_t latch_end;
+        };
+        std::vector<Loop> loops;
+        for (ir::BlockId header = 0; header < m_fn.blocks.size(); header++)
+        {
+            for (const ir::BlockId latch : m_fn.blocks[header].preds)
+            {
+                if (latch >= header)
+                {
+                    loops.push_back({.header_start = block_start[header], .latch_end = block_end[latch]});
+                }
+            }
+        }
+        if (loops.empty())
+        {
+            return;
+        }
+        // The headers an interval reaches into are a range of loops, whose
+        // furthest latch comes from a sparse table of maxima over ranges of
+        // 2^k loops
+        std::vector<std::vector<size_t>> furthest_latch(1);
+        for (const Loop &loop : loops)
+        {
+            furthest_latch[0].push_back(loop.latch_end);
+        }
+        for (size_t k = 1; (size_t{1} << k) <= loops.size(); k++)
+        {
+            const std::vector<size_t> &half = furthest_latch[k - 1];
+            std::vector<size_t> level(loops.size() - (size_t{1} << k) + 1);
+            for (size_t i = 0; i < level.size(); i++)
+            {
+                level[i] = std::max(half[i], half[i + (size_t{1} << (k - 1))]);
+            }
+            furthest_latch.push_back(std::move(level));
+        }
+        const auto after = [&](const size_t point)
+        {
+            return static_cast<size_t>(std::ranges::upper_bound(loops, point, {}, &Loop::header_start) - loops.begin());
+        };
+        for (Interval &interval : m_intervals)
+        {
+            const size_t first = after(interval.start);
+            size_t last = after(interval.end);
+            while (first < last)
+            {
+                const auto k = static_cast<size_t>(std::bit_width(last - first) - 1);
+                const size_t end = std::max(furthest_latch[k][first], furthest_latch[k][last - (size_t{1} << k)]);
+                if (end <= interval.end)
+                {
+                    break;
+                }
+                interval.end = end;
+                last = after(end);
+            }
+        }
+    }
+
+    // The loop leaves through the bottom test before the back edge, after
+    // which nothing reads the phi's old value: the operand may take over its
+    // location as soon as the phi's last use is behind it. Blocks of one
+    // iteration run in layout order, and a value of an inner loop only
+    // reaches the back edge through a phi after that loop.
+    void coalesce_back_edges(const std::vector<size_t> &interval_of, const std::vector<size_t> &value_pos,
+                             const std::vector<size_t> &block_start, const std::vector<size_t> &last_use)
+    {
+        std::vector<bool> merged(m_intervals.size(), false);
+        for (ir::BlockId header = 0; header < m_fn.blocks.size(); header++)
+        {
+            const ir::Block &block = m_fn.blocks[header];
+            for (size_t i = 0; i < block.preds.size(); i++)
+            {
+                if (block.preds[i] < header)
+                {
+                    continue;
+                }
+                for (const ir::ValueId phi : block.instrs)
+                {
+                    if (m_fn.values[phi].opcode != ir::Opcode::phi)
+                    {
+                        break;
+                    }
+                    const ir::ValueId operand = m_fn.operands(phi)[i];
+                    const size_t into = interval_of[phi];
+                    const size_t from = interval_of[operand];
+                    if (operand == phi || from == SIZE_MAX || merged[into] || merged[from] || m_intervals[into].coalesced != ir::none ||
+                        m_intervals[from].coalesced != ir::none || value_pos[operand] < block_start[header] ||
+                        last_use[phi] > value_pos[operand])
+                    {
+                        continue;
+                    }
+                    Interval &interval = m_intervals[into];
+                    interval.start = std::min(interval.start, m_intervals[from].start);
+                    interval.end = std::max(interval.end, m_intervals[from].end);
+                    interval.coalesced = operand;
+                    merged[from] = true;
+                }
+            }
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < m_intervals.size(); i++)
+        {
+            if (!merged[i])
+            {
+                m_intervals[kept++] = m_intervals[i];
+            }
+        }
+        m_intervals.resize(kept);
+    }
+
+    [[nodiscard]] static size_t slot_of(const Operand &location)
+    {
+        return location.value / 8;
+    }
+
+    const ir::Function &m_fn;
+    std::vector<Interval> m_intervals{};
+};
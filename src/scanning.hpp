@@ -0,0 +1,289 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Character classes of the lexer, one table lookup per byte
+enum class CharClass : uint8_t
+{
+    invalid,
+    space,
+    alpha,
+    digit,
+    slash,
+    punct
+};
+
+constexpr std::array<CharClass, 256> make_char_classes()
+{
+    std::array<CharClass, 256> classes{};
+    for (const unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'})
+    {
+        classes[c] = CharClass::space;
+    }
+    for (int c = 'a'; c <= 'z'; c++)
+    {
+        classes[c] = CharClass::alpha;
+        classes[c - 'a' + 'A'] = CharClass::alpha;
+    }
+    for (int c = '0'; c <= '9'; c++)
+    {
+        classes[c] = CharClass::digit;
+    }
+    classes['/'] = CharClass::slash;
+    for (const unsigned char c : {'(', ')', ';', '=', '+', '*', '-', '{', '}', '<', '>', '!', '[', ']', ','})
+    {
+        classes[c] = CharClass::punct;
+    }
+    return classes;
+}
+
+constexpr std::array<CharClass, 256> char_classes = make_char_classes();
+
+[[nodiscard]] constexpr CharClass char_class(const char c)
+{
+    return char_classes[static_cast<unsigned char>(c)];
+}
+
+// Each scan returns the first position in [pos, end) that does not belong
+// to the run it skips, or end.
+struct Scanner
+{
+    const char *(*skip_space)(const char *pos, const char *end);
+    const char *(*skip_alnum)(const char *pos, const char *end);
+    const char *(*skip_digits)(const char *pos, const char *end);
+    // Stops at the next '\n'
+    const char *(*skip_line)(const char *pos, const char *end);
+    // Stops at the next "*/"
+    const char *(*skip_block_comment)(const char *pos, const char *end);
+};
+
+enum class ScanIsa
+{
+    scalar,
+    sse2,
+    avx2
+};
+
+namespace scan
+{
+    template <typename Match>
+    const char *skip_scalar(const char *pos, const char *end)
+    {
+        while (pos != end && Match::scalar(pos, end))
+        {
+            pos++;
+        }
+        return pos;
+    }
+
+    struct Space
+    {
+        static bool scalar(const char *pos, const char *)
+        {
+            return char_class(*pos) == CharClass::space;
+        }
+    };
+    struct Alnum
+    {
+        static bool scalar(const char *pos, const char *)
+        {
+            return char_class(*pos) == CharClass::alpha || char_class(*pos) == CharClass::digit;
+        }
+    };
+    struct Digit
+    {
+        static bool scalar(const char *pos, const char *)
+        {
+            return char_class(*pos) == CharClass::digit;
+        }
+    };
+    struct NotNewline
+    {
+        static bool scalar(const char *pos, const char *)
+        {
+            return *pos != '\n';
+        }
+    };
+    struct NotBlockEnd
+    {
+        static bool scalar(const char *pos, const char *end)
+        {
+            return *pos != '*' || pos + 1 == end || pos[1] != '/';
+        }
+    };
+
+#if defined(__x86_64__)
+    // The vector kernels compute a bit mask of the bytes that continue the run
+    // and stop at the first clear bit. Bytes >= 0x80 compare as negative, so
+    // they fall outside every range.
+    inline __m128i in_range_sse2(const __m128i c, const char lo, const char hi)
+    {
+        return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(static_cast<char>(lo - 1))),
+                             _mm_cmplt_epi8(c, _mm_set1_epi8(static_cast<char>(hi + 1))));
+    }
+
+    struct Sse2
+    {
+        static constexpr int width = 16;
+
+        static uint32_t space(const char *pos)
+        {
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+            return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')), in_range_sse2(c, '\t', '\r')));
+        }
+        static uint32_t alnum(const char *pos)
+        {
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+            const __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+            return _mm_movemask_epi8(_mm_or_si128(in_range_sse2(c, '0', '9'), in_range_sse2(lower, 'a', 'z')));
+        }
+        static uint32_t digit(const char *pos)
+        {
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+            return _mm_movemask_epi8(in_range_sse2(c, '0', '9'));
+        }
+        static uint32_t not_newline(const char *pos)
+        {
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+            return ~_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n'))) & 0xFFFF;
+        }
+        // Reads one byte past the block
+        static uint32_t not_block_end(const char *pos)
+        {
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+            const __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos + 1));
+            return ~_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('*')),
+                                                    _mm_cmpeq_epi8(next, _mm_set1_epi8('/')))) &
+                   0xFFFF;
+        }
+    };
+
+    template <uint32_t (*mask)(const char *), typename Match, int lookahead = 0>
+    const char *skip_sse2(const char *pos, const char *end)
+    {
+        while (end - pos >= Sse2::width + lookahead)
+        {
+            const uint32_t stop = ~mask(pos) & 0xFFFF;
+            if (stop != 0)
+            {
+                return pos + __builtin_ctz(stop);
+            }
+            pos += Sse2::width;
+        }
+        return skip_scalar<Match>(pos, end);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i in_range_avx2(const __m256i c, const char lo, const char hi)
+    {
+        return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(static_cast<char>(lo - 1))),
+                                _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(hi + 1)), c));
+    }
+
+    struct Avx2
+    {
+        static constexpr int width = 32;
+
+        __attribute__((target("avx2"))) static uint32_t space(const char *pos)
+        {
+            const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+            return _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')), in_range_avx2(c, '\t', '\r')));
+        }
+        __attribute__((target("avx2"))) static uint32_t alnum(const char *pos)
+        {
+            const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+            const __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+            return _mm256_movemask_epi8(_mm256_or_si256(in_range_avx2(c, '0', '9'), in_range_avx2(lower, 'a', 'z')));
+        }
+        __attribute__((target("avx2"))) static uint32_t digit(const char *pos)
+        {
+            const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+            return _mm256_movemask_epi8(in_range_avx2(c, '0', '9'));
+        }
+        __attribute__((target("avx2"))) static uint32_t not_newline(const char *pos)
+        {
+            const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+            return ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')));
+        }
+        // Reads one byte past the block
+        __attribute__((target("avx2"))) static uint32_t not_block_end(const char *pos)
+        {
+            const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos));
+            const __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos + 1));
+            return ~_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('*')),
+                                                          _mm256_cmpeq_epi8(next, _mm256_set1_epi8('/'))));
+        }
+    };
+
+    template <uint32_t (*mask)(const char *), typename Match, int lookahead = 0>
+    __attribute__((target("avx2"))) const char *skip_avx2(const char *pos, const char *end)
+    {
+        while (end - pos >= Avx2::width + lookahead)
+        {
+            const uint32_t stop = ~mask(pos);
+            if (stop != 0)
+            {
+                return pos + __builtin_ctz(stop);
+            }
+            pos += Avx2::width;
+        }
+        return skip_scalar<Match>(pos, end);
+    }
+#endif
+}
+
+[[nodiscard]] inline const Scanner &scanner(const ScanIsa isa)
+{
+    static constexpr Scanner scalar{
+        .skip_space = scan::skip_scalar<scan::Space>,
+        .skip_alnum = scan::skip_scalar<scan::Alnum>,
+        .skip_digits = scan::skip_scalar<scan::Digit>,
+        .skip_line = scan::skip_scalar<scan::NotNewline>,
+        .skip_block_comment = scan::skip_scalar<scan::NotBlockEnd>,
+    };
+#if defined(__x86_64__)
+    static constexpr Scanner sse2{
+        .skip_space = scan::skip_sse2<scan::Sse2::space, scan::Space>,
+        .skip_alnum = scan::skip_sse2<scan::Sse2::alnum, scan::Alnum>,
+        .skip_digits = scan::skip_sse2<scan::Sse2::digit, scan::Digit>,
+        .skip_line = scan::skip_sse2<scan::Sse2::not_newline, scan::NotNewline>,
+        .skip_block_comment = scan::skip_sse2<scan::Sse2::not_block_end, scan::NotBlockEnd, 1>,
+    };
+    static constexpr Scanner avx2{
+        .skip_space = scan::skip_avx2<scan::Avx2::space, scan::Space>,
+        .skip_alnum = scan::skip_avx2<scan::Avx2::alnum, scan::Alnum>,
+        .skip_digits = scan::skip_avx2<scan::Avx2::digit, scan::Digit>,
+        .skip_line = scan::skip_avx2<scan::Avx2::not_newline, scan::NotNewline>,
+        .skip_block_comment = scan::skip_avx2<scan::Avx2::not_block_end, scan::NotBlockEnd, 1>,
+    };
+    switch (isa)
+    {
+    case ScanIsa::avx2:
+        return avx2;
+    case ScanIsa::sse2:
+        return sse2;
+    case ScanIsa::scalar:
+        break;
+    }
+#endif
+    return scalar;
+}
+
+// Widest instruction set the running cpu supports
+[[nodiscard]] inline ScanIsa detect_scan_isa()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return ScanIsa::avx2;
+    }
+    return ScanIsa::sse2;
+#else
+    return ScanIsa::scalar;
+#endif
+}
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "./cache.hpp"
+#include "./cli.hpp"
+#include "./error.hpp"
+
+// A compile server answers requests from `hydro --connect` on a Unix socket,
+// so a client only pays for a connection instead of starting a compiler.
+// Between requests it keeps the warm compilers (interned names, node arrays
+// and output buffers) and the open caches.
+//
+// Every message is a list of strings: a little-endian u32 count followed by
+// each string as a u32 length and its bytes. A request holds the working
+// directory of the client and its arguments, the response the exit status,
+// the standard output and the standard error of the compilation. Only the
+// user running the server may connect.
+namespace wire
+{
+    // Messages larger than this are taken to be garbage
+    constexpr uint32_t max_length = 256 * 1024 * 1024;
+    // Requests are a directory and arguments, far smaller than responses
+    constexpr uint32_t max_request_strings = 4096;
+    constexpr uint32_t max_request_length = 64 * 1024;
+
+    inline bool send_all(const int fd, const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t count = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                return false;
+            }
+            data += count;
+            size -= static_cast<size_t>(count);
+        }
+        return true;
+    }
+
+    inline bool receive_all(const int fd, char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t count = ::recv(fd, data, size, 0);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                return false;
+            }
+            data += count;
+            size -= static_cast<size_t>(count);
+        }
+        return true;
+    }
+
+    inline void append_u32(std::string &message, const uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            message.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    inline bool send_strings(const int fd, const std::vector<std::string> &strings)
+    {
+        std::string message;
+        append_u32(message, static_cast<uint32_t>(strings.size()));
+        for (const std::string &string : strings)
+        {
+            append_u32(message, static_cast<uint32_t>(string.size()));
+            message += string;
+        }
+        return send_all(fd, message.data(), message.size());
+    }
+
+    inline std::optional<uint32_t> receive_u32(const int fd)
+    {
+        unsigned char bytes[4];
+        if (!receive_all(fd, reinterpret_cast<char *>(bytes), sizeof(bytes)))
+        {
+            return {};
+        }
+        return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+    }
+
+    // Returns nullopt when the connection ends early or the message has more
+    // than max_count strings or one longer than max_string. Nothing is
+    // allocated for data that has not arrived.
+    inline std::optional<std::vector<std::string>> receive_strings(const int fd, const uint32_t max_count,
+                                                                   const uint32_t max_string)
+    {
+        const std::optional<uint32_t> count = receive_u32(fd);
+        if (!count.has_value() || count.value() > max_count)
+        {
+            return {};
+        }
+        std::vector<std::string> strings;
+        for (uint32_t i = 0; i < count.value(); i++)
+        {
+            const std::optional<uint32_t> length = receive_u32(fd);
+            if (!length.has_value() || length.value() > max_string)
+            {
+                return {};
+            }
+            std::string &string = strings.emplace_back(length.value(), '\0');
+            if (!receive_all(fd, string.data(), string.size()))
+            {
+                return {};
+            }
+        }
+        return strings;
+    }
+
+    inline sockaddr_un socket_address(const std::string &path)
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            throw CompileError("socket path too long: ", path);
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+
+    // Returns -1 when nobody listens on path
+    inline int connect_to(const std::string &path)
+    {
+        const sockaddr_un address = socket_address(path);
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        if (::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+}
+
+class CompileServer
+{
+public:
+    explicit CompileServer(std::string socket_path)
+        : m_socket_path(std::move(socket_path))
+    {
+    }
+
+    // Accepts requests until the process is killed, each on its own thread.
+    // Throws CompileError when the socket cannot be set up.
+    [[noreturn]] void serve()
+    {
+        const sockaddr_un address = wire::socket_address(m_socket_path);
+        const int existing = wire::connect_to(m_socket_path);
+        if (existing >= 0)
+        {
+            ::close(existing);
+            throw CompileError("a server is already listening on ", m_socket_path);
+        }
+        // Left behind by a server that is gone
+        ::unlink(m_socket_path.c_str());
+
+        // The server writes wherever a request asks it to, with its own
+        // rights: the socket is only accessible to its user. No other thread
+        // runs yet to be affected by the umask.
+        const int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const mode_t umask = ::umask(0077);
+        const bool bound = listener >= 0 && ::bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+        ::umask(umask);
+        if (!bound || ::listen(listener, SOMAXCONN) != 0)
+        {
+            throw CompileError("unable to listen on ", m_socket_path, ": ", std::strerror(errno));
+        }
+        while (true)
+        {
+            const int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0)
+            {
+                continue;
+            }
+            // Also holds when the socket file was made accessible afterwards
+            ucred peer{};
+            socklen_t peer_size = sizeof(peer);
+            if (::getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) != 0 || peer.uid != ::geteuid())
+            {
+                respond_failure(client, "the server belongs to another user");
+                ::close(client);
+                continue;
+            }
+            std::thread([this, client]
+                        {
+                            handle(client);
+                            ::close(client); })
+                .detach();
+        }
+    }
+
+private:
+    // The connection is closed after the response. A request that fails in
+    // any way only fails itself, never the server.
+    void handle(const int client)
+    {
+        try
+        {
+            const std::optional<std::vector<std::string>> request =
+                wire::receive_strings(client, wire::max_request_strings, wire::max_request_length);
+            if (!request.has_value() || request->empty())
+            {
+                respond_failure(client, "malformed or oversized request");
+                return;
+            }
+            std::ostringstream out;
+            std::ostringstream err;
+            const int status = run(request.value(), out, err);
+            wire::send_strings(client, {std::to_string(status), std::move(out).str(), std::move(err).str()});
+        }
+        catch (const std::exception &error)
+        {
+            respond_failure(client, error.what());
+        }
+    }
+
+    static void respond_failure(const int client, const std::string_view message)
+    {
+        try
+        {
+            wire::send_strings(client, {std::to_string(EXIT_FAILURE), {}, std::string(message) + '\n'});
+        }
+        catch (const std::exception &)
+        {
+            // Out of memory even for that, the client sees the connection close
+        }
+    }
+
+    int run(const std::vector<std::string> &request, std::ostream &out, std::ostream &err)
+    {
+        const std::vector<std::string> args(request.begin() + 1, request.end());
+        std::optional<Invocation> invocation = parse_invocation(args, nullptr, err);
+        if (!invocation.has_value())
+        {
+            return EXIT_FAILURE;
+        }
+        invocation->base_dir = request.front();
+        // A faulting program would take the server down with it
+        if (invocation->options.executes())
+        {
+            err << "--run and --interp are not supported by the server" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        CompileCache *cache = nullptr;
+        if (invocation->cache_dir.has_value())
+        {
+            try
+            {
+                cache = open_cache(invocation->base_dir / invocation->cache_dir.value(), invocation->cache_size_mib);
+            }
+            catch (const CompileError &error)
+            {
+                err << error.what() << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        std::vector<Compiler> compilers = take_compilers();
+        const int status = run_invocation(invocation.value(), compilers, cache, out, err);
+        give_back(std::move(compilers));
+        return status;
+    }
+
+    // Caches stay open for the lifetime of the server, the size limit is the
+    // one of the first request that named the directory
+    CompileCache *open_cache(const std::filesystem::path &dir, const size_t size_mib)
+    {
+        std::error_code error;
+        std::filesystem::path canonical = std::filesystem::weakly_canonical(dir, error);
+        const std::string key = error ? dir.string() : canonical.string();
+        const std::lock_guard lock(m_mutex);
+        std::unique_ptr<CompileCache> &cache = m_caches[key];
+        if (cache == nullptr)
+        {
+            cache = std::make_unique<CompileCache>(key, static_cast<uint64_t>(size_mib) * 1024 * 1024);
+        }
+        return cache.get();
+    }
+
+    // Concurrent requests each get their own set of compilers
+    std::vector<Compiler> take_compilers()
+    {
+        const std::lock_guard lock(m_mutex);
+        if (m_idle.empty())
+        {
+            return {};
+        }
+        std::vector<Compiler> compilers = std::move(m_idle.back());
+        m_idle.pop_back();
+        return compilers;
+    }
+
+    void give_back(std::vector<Compiler> compilers)
+    {
+        const std::lock_guard lock(m_mutex);
+        m_idle.push_back(std::move(compilers));
+    }
+
+    std::string m_socket_path;
+    std::mutex m_mutex{};
+    std::vector<std::vector<Compiler>> m_idle{};
+    std::unordered_map<std::string, std::unique_ptr<CompileCache>> m_caches{};
+};
+
+// Sends a compilation to the server on socket_path and forwards its output.
+// Returns the exit status, or nullopt when no server answered.
+inline std::optional<int> compile_remote(const std::string &socket_path, std::vector<std::string> args)
+{
+    if (const char *env_cache_dir = std::getenv("HYDRO_CACHE_DIR"))
+    {
+        // Comes first so an explicit --cache-dir still wins
+        args.insert(args.begin(), {"--cache-dir", env_cache_dir});
+    }
+    const int fd = wire::connect_to(socket_path);
+    if (fd < 0)
+    {
+        return {};
+    }
+    std::error_code error;
+    args.insert(args.begin(), std::filesystem::current_path(error).string());
+    const bool sent = wire::send_strings(fd, args);
+    const std::optional<std::vector<std::string>> response = sent ? wire::receive_strings(fd, 3, wire::max_length) : std::nullopt;
+    ::close(fd);
+    if (!response.has_value() || response->size() != 3)
+    {
+        return {};
+    }
+    std::cout << (*response)[1] << std::flush;
+    std::cerr << (*response)[2] << std::flush;
+    return parse_count((*response)[0]).value_or(EXIT_FAILURE);
+}
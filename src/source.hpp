@@ -0,0 +1,132 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "./error.hpp"
+
+// Contents of an input file. Regular files are mapped into memory and never
+// copied; pipes, character devices and stdin ("-") are read into a buffer.
+class SourceBuffer
+{
+public:
+    static SourceBuffer load(const std::string &path)
+    {
+        SourceBuffer source;
+        const bool is_stdin = path == "-";
+        const int fd = is_stdin ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw CompileError("unable to open ", path, ": ", std::strerror(errno));
+        }
+
+        struct stat info{};
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+        {
+            const auto size = static_cast<size_t>(info.st_size);
+            void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                madvise(data, size, MADV_SEQUENTIAL);
+                source.m_mapped = static_cast<const char *>(data);
+                source.m_size = size;
+            }
+        }
+        if (source.m_mapped == nullptr)
+        {
+            try
+            {
+                source.read_all(fd, path);
+            }
+            catch (const CompileError &)
+            {
+                if (!is_stdin)
+                {
+                    ::close(fd);
+                }
+                throw;
+            }
+        }
+        if (!is_stdin)
+        {
+            ::close(fd);
+        }
+        return source;
+    }
+
+    SourceBuffer(const SourceBuffer &) = delete;
+    SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+    SourceBuffer(SourceBuffer &&other) noexcept
+        : m_mapped(std::exchange(other.m_mapped, nullptr)),
+          m_size(std::exchange(other.m_size, 0)),
+          m_buffer(std::move(other.m_buffer))
+    {
+    }
+
+    SourceBuffer &operator=(SourceBuffer &&other) noexcept
+    {
+        std::swap(m_mapped, other.m_mapped);
+        std::swap(m_size, other.m_size);
+        std::swap(m_buffer, other.m_buffer);
+        return *this;
+    }
+
+    ~SourceBuffer()
+    {
+        if (m_mapped != nullptr)
+        {
+            munmap(const_cast<char *>(m_mapped), m_size);
+        }
+    }
+
+    [[nodiscard]] std::string_view view() const
+    {
+        if (m_mapped != nullptr)
+        {
+            return {m_mapped, m_size};
+        }
+        return m_buffer;
+    }
+
+private:
+    SourceBuffer() = default;
+
+    void read_all(const int fd, const std::string &path)
+    {
+        constexpr size_t chunk_size = 64 * 1024;
+        while (true)
+        {
+            const size_t old_size = m_buffer.size();
+            m_buffer.resize(old_size + chunk_size);
+            const ssize_t count = ::read(fd, m_buffer.data() + old_size, chunk_size);
+            if (count < 0 && errno == EINTR)
+            {
+                m_buffer.resize(old_size);
+                continue;
+            }
+            if (count < 0)
+            {
+                throw CompileError("unable to read ", path, ": ", std::strerror(errno));
+            }
+            m_buffer.resize(old_size + static_cast<size_t>(count));
+            if (count == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    const char *m_mapped = nullptr;
+    size_t m_size = 0;
+    std::string m_buffer{};
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <optional>
+
+// Multiplication and division by constants without imul and div. div takes
+// tens of cycles and imul three, lea and the shifts one each.
+
+// A multiplier factor * 2^shift, where lea computes x * factor as
+// x + x * (factor - 1)
+struct Multiplier
+{
+    uint64_t factor = 1; // 1, 3, 5 or 9
+    unsigned shift = 0;
+};
+
+// The multipliers reachable with at most one lea and one shift
+[[nodiscard]] constexpr std::optional<Multiplier> reduce_multiplier(const uint64_t value)
+{
+    if (value == 0)
+    {
+        return {};
+    }
+    const auto shift = static_cast<unsigned>(std::countr_zero(value));
+    const uint64_t factor = value >> shift;
+    if (factor != 1 && factor != 3 && factor != 5 && factor != 9)
+    {
+        return {};
+    }
+    return Multiplier{.factor = factor, .shift = shift};
+}
+
+// Unsigned division by a constant as a multiplication by its reciprocal
+// (Granlund & Montgomery, Division by Invariant Integers using
+// Multiplication): x / d is the high half of x * magic shifted right. When
+// the exact magic number takes 65 bits, its top bit is added back as
+// (((x - q) >> 1) + q) >> shift, with q the high half of x * magic.
+struct Reciprocal
+{
+    uint64_t magic = 0; // 0 for powers of two, which are a shift alone
+    unsigned shift = 0;
+    bool add = false;
+};
+
+// divisor must not be 0
+[[nodiscard]] constexpr Reciprocal reciprocal(const uint64_t divisor)
+{
+    const auto log2 = static_cast<unsigned>(63 - std::countl_zero(divisor));
+    if (std::has_single_bit(divisor))
+    {
+        return {.shift = log2};
+    }
+    // 2^(64 + log2) / divisor rounded down, the reciprocal scaled to 64 bits
+    // of precision past the point
+    const unsigned __int128 scaled = static_cast<unsigned __int128>(1) << (64 + log2);
+    const auto magic = static_cast<uint64_t>(scaled / divisor);
+    const auto remainder = static_cast<uint64_t>(scaled % divisor);
+    // Rounding up is exact enough when its error stays below 2^log2
+    if (divisor - remainder < uint64_t{1} << log2)
+    {
+        return {.magic = magic + 1, .shift = log2};
+    }
+    // Otherwise one more bit is needed, the 65th is implied
+    const uint64_t twice_remainder = remainder * 2;
+    const bool round_up = twice_remainder >= divisor || twice_remainder < remainder;
+    return {.magic = magic * 2 + (round_up ? 1 : 0) + 1, .shift = log2, .add = true};
+}
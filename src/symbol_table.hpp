@@ -0,0 +1,77 @@
+#pragma once
+
+#include "./interner.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+struct SymbolStats
+{
+    size_t lookups = 0;
+    size_t misses = 0;
+    size_t declarations = 0;
+    size_t scopes = 0;
+    size_t max_depth = 0;
+};
+
+// Maps names to a stack of bindings, the innermost one being visible.
+// Symbols are dense, so the table is indexed by them directly. Closing a
+// scope only touches the bindings it declared.
+template <typename Binding>
+class SymbolTable
+{
+public:
+    void begin_scope()
+    {
+        m_scopes.push_back(m_declared.size());
+        m_stats.scopes++;
+        m_stats.max_depth = std::max(m_stats.max_depth, m_scopes.size());
+    }
+
+    void end_scope()
+    {
+        while (m_declared.size() > m_scopes.back())
+        {
+            m_bindings[m_declared.back()].pop_back();
+            m_declared.pop_back();
+        }
+        m_scopes.pop_back();
+    }
+
+    // Binds name in the innermost scope
+    void declare(const Symbol name, Binding binding)
+    {
+        if (name >= m_bindings.size())
+        {
+            m_bindings.resize(name + 1);
+        }
+        m_bindings[name].push_back(std::move(binding));
+        m_declared.push_back(name);
+        m_stats.declarations++;
+    }
+
+    // Returns the visible binding of name, or nullptr if there is none
+    [[nodiscard]] Binding *lookup(const Symbol name)
+    {
+        m_stats.lookups++;
+        if (name >= m_bindings.size() || m_bindings[name].empty())
+        {
+            m_stats.misses++;
+            return nullptr;
+        }
+        return &m_bindings[name].back();
+    }
+
+    [[nodiscard]] const SymbolStats &stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    std::vector<std::vector<Binding>> m_bindings{};
+    std::vector<Symbol> m_declared{};
+    std::vector<size_t> m_scopes{};
+    SymbolStats m_stats{};
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs a batch of independent tasks on a fixed number of workers. Every
+// worker starts out with an even share of the tasks in its own queue and
+// takes them from the front; a worker whose queue runs dry steals from the
+// back of the others, so a few slow tasks do not leave cores idle.
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(const size_t worker_count)
+        : m_worker_count(std::max<size_t>(worker_count, 1))
+    {
+    }
+
+    [[nodiscard]] size_t worker_count() const
+    {
+        return m_worker_count;
+    }
+
+    // Calls task(worker, index) for every index in [0, count) and returns when
+    // all of them are done. worker is in [0, worker_count()) and identifies
+    // the thread, so tasks can keep per-worker state. The calling thread is
+    // worker 0. task must not throw.
+    template <typename Task>
+    void run(const size_t count, const Task &task)
+    {
+        const size_t workers = std::min(m_worker_count, std::max<size_t>(count, 1));
+        std::vector<std::unique_ptr<Queue>> queues;
+        for (size_t worker = 0; worker < workers; worker++)
+        {
+            auto queue = std::make_unique<Queue>();
+            for (size_t index = worker * count / workers; index < (worker + 1) * count / workers; index++)
+            {
+                queue->tasks.push_back(index);
+            }
+            queues.push_back(std::move(queue));
+        }
+
+        const auto work = [&](const size_t worker)
+        {
+            while (const std::optional<size_t> index = next(queues, worker))
+            {
+                task(worker, index.value());
+            }
+        };
+        std::vector<std::jthread> threads;
+        for (size_t worker = 1; worker < workers; worker++)
+        {
+            threads.emplace_back(work, worker);
+        }
+        work(0);
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    static std::optional<size_t> next(const std::vector<std::unique_ptr<Queue>> &queues, const size_t worker)
+    {
+        {
+            Queue &own = *queues[worker];
+            const std::lock_guard lock(own.mutex);
+            if (!own.tasks.empty())
+            {
+                const size_t index = own.tasks.front();
+                own.tasks.pop_front();
+                return index;
+            }
+        }
+        // Tasks are never added, so once every queue was seen empty the batch is done
+        for (size_t offset = 1; offset < queues.size(); offset++)
+        {
+            Queue &victim = *queues[(worker + offset) % queues.size()];
+            const std::lock_guard lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                const size_t index = victim.tasks.back();
+                victim.tasks.pop_back();
+                return index;
+            }
+        }
+        return {};
+    }
+
+    size_t m_worker_count;
+};
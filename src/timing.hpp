@@ -0,0 +1,133 @@
+#pragma once
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Wall time of each compiler pass plus named counters, printed as a table for
+// people or as JSON for scripts. Passes are reported in the order they ran.
+class PassTimer
+{
+public:
+    enum class Format
+    {
+        table,
+        json
+    };
+
+    // Runs pass and records how long it took, returns whatever pass returns
+    template <typename Pass>
+    decltype(auto) time(const std::string_view name, Pass &&pass)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        struct Record
+        {
+            PassTimer &timer;
+            std::string_view name;
+            std::chrono::steady_clock::time_point start;
+            ~Record()
+            {
+                timer.m_passes.push_back({.name = name, .seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()});
+            }
+        } record{.timer = *this, .name = name, .start = start};
+        return std::forward<Pass>(pass)();
+    }
+
+    void count(const std::string_view name, const uint64_t value)
+    {
+        m_counters.push_back({.name = name, .value = value});
+    }
+
+    [[nodiscard]] double seconds(const std::string_view name) const
+    {
+        for (const PassTime &pass : m_passes)
+        {
+            if (pass.name == name)
+            {
+                return pass.seconds;
+            }
+        }
+        return 0;
+    }
+
+    // name labels the report, typically with the input file
+    void print(std::ostream &out, const Format format, const std::string_view name) const
+    {
+        double total = 0;
+        for (const PassTime &pass : m_passes)
+        {
+            total += pass.seconds;
+        }
+        if (format == Format::json)
+        {
+            out << "{\"file\": \"";
+            for (const char c : name)
+            {
+                out << (c == '"' || c == '\\' ? "\\" : "") << c;
+            }
+            out << "\", \"passes\": {";
+            for (size_t i = 0; i < m_passes.size(); i++)
+            {
+                out << (i == 0 ? "" : ", ") << "\"" << m_passes[i].name << "\": " << m_passes[i].seconds;
+            }
+            out << "}, \"total\": " << total << ", \"counters\": {";
+            for (size_t i = 0; i < m_counters.size(); i++)
+            {
+                out << (i == 0 ? "" : ", ") << "\"" << m_counters[i].name << "\": " << m_counters[i].value;
+            }
+            out << "}, \"max_rss_kib\": " << max_rss_kib() << "}" << std::endl;
+            return;
+        }
+
+        const auto flags = out.flags();
+        out << std::fixed << std::setprecision(3);
+        out << "===== pass timing: " << name << " =====" << std::endl;
+        for (const PassTime &pass : m_passes)
+        {
+            out << "  " << std::left << std::setw(12) << pass.name << std::right << std::setw(10) << pass.seconds * 1e3
+                << " ms " << std::setw(6) << std::setprecision(1) << (total > 0 ? pass.seconds / total * 100 : 0)
+                << "%" << std::setprecision(3) << std::endl;
+        }
+        out << "  " << std::left << std::setw(12) << "total" << std::right << std::setw(10) << total * 1e3 << " ms"
+            << std::endl;
+        out << "===== counters =====" << std::endl;
+        for (const Counter &counter : m_counters)
+        {
+            out << "  " << std::left << std::setw(20) << counter.name << std::right << std::setw(12) << counter.value
+                << std::endl;
+        }
+        out << "  " << std::left << std::setw(20) << "max_rss_kib" << std::right << std::setw(12) << max_rss_kib()
+            << std::endl;
+        out.flags(flags);
+    }
+
+private:
+    struct PassTime
+    {
+        std::string_view name;
+        double seconds;
+    };
+
+    struct Counter
+    {
+        std::string_view name;
+        uint64_t value;
+    };
+
+    // Peak resident memory of the whole process so far
+    [[nodiscard]] static long max_rss_kib()
+    {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    std::vector<PassTime> m_passes{};
+    std::vector<Counter> m_counters{};
+};
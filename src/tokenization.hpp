@@ -1,10 +1,17 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <optional>
 #include <iostream>
 #include <algorithm>
+#include <string_view>
+
+#include "./error.hpp"
+#include "./interner.hpp"
+#include "./scanning.hpp"
 // #include "./token.hpp"
 
 enum class TokenType
@@ -25,19 +32,36 @@ enum class TokenType
     close_curly,
     if_,
     elif,
-    else_
+    else_,
+    while_,
+    eq_eq,
+    bang_eq,
+    lt,
+    lt_eq,
+    gt,
+    gt_eq,
+    open_bracket,
+    close_bracket,
+    comma
 };
 
-std::optional<int> bin_prec(const TokenType type)
+inline std::optional<int> bin_prec(const TokenType type)
 {
     switch (type)
     {
+    case TokenType::eq_eq:
+    case TokenType::bang_eq:
+    case TokenType::lt:
+    case TokenType::lt_eq:
+    case TokenType::gt:
+    case TokenType::gt_eq:
+        return 0;
     case TokenType::plus:
     case TokenType::sub:
-        return 0;
+        return 1;
     case TokenType::star:
     case TokenType::div:
-        return 1;
+        return 2;
     default:
         return {};
     }
@@ -46,201 +70,211 @@ std::optional<int> bin_prec(const TokenType type)
 struct Token
 {
     TokenType type;
-    std::optional<std::string> value{};
+    uint64_t int_value = 0; // value of an int_lit, wrapped around at 64 bits as nasm does
+    Symbol symbol = 0;      // name of an ident
 };
 
+struct Keyword
+{
+    std::string_view text;
+    TokenType type;
+};
+
+constexpr std::array<Keyword, 6> keywords{{
+    {"exit", TokenType::exit},
+    {"let", TokenType::let},
+    {"if", TokenType::if_},
+    {"elif", TokenType::elif},
+    {"else", TokenType::else_},
+    {"while", TokenType::while_},
+}};
+
+// Perfect hash over the keywords, checked to be collision free below
+constexpr size_t keyword_hash(const std::string_view word)
+{
+    return (word.size() + static_cast<unsigned char>(word.front()) + static_cast<unsigned char>(word.back()) * 4) % 16;
+}
+
+constexpr std::array<std::optional<Keyword>, 16> make_keyword_table()
+{
+    std::array<std::optional<Keyword>, 16> table{};
+    for (const Keyword &keyword : keywords)
+    {
+        if (table[keyword_hash(keyword.text)].has_value())
+        {
+            throw "keyword hash collision";
+        }
+        table[keyword_hash(keyword.text)] = keyword;
+    }
+    return table;
+}
+
+constexpr std::array<std::optional<Keyword>, 16> keyword_table = make_keyword_table();
+
+constexpr std::optional<TokenType> lookup_keyword(const std::string_view word)
+{
+    const std::optional<Keyword> &slot = keyword_table[keyword_hash(word)];
+    if (slot.has_value() && slot->text == word)
+    {
+        return slot->type;
+    }
+    return {};
+}
+
+static_assert(lookup_keyword("elif") == TokenType::elif && !lookup_keyword("exits").has_value());
+
+constexpr std::array<std::optional<TokenType>, 256> make_punct_tokens()
+{
+    std::array<std::optional<TokenType>, 256> tokens{};
+    tokens['('] = TokenType::open_paren;
+    tokens[')'] = TokenType::close_paren;
+    tokens[';'] = TokenType::semi;
+    tokens['='] = TokenType::eq;
+    tokens['+'] = TokenType::plus;
+    tokens['*'] = TokenType::star;
+    tokens['-'] = TokenType::sub;
+    tokens['/'] = TokenType::div;
+    tokens['{'] = TokenType::open_curly;
+    tokens['}'] = TokenType::close_curly;
+    tokens['<'] = TokenType::lt;
+    tokens['>'] = TokenType::gt;
+    tokens['['] = TokenType::open_bracket;
+    tokens[']'] = TokenType::close_bracket;
+    tokens[','] = TokenType::comma;
+    return tokens;
+}
+
+constexpr std::array<std::optional<TokenType>, 256> punct_tokens = make_punct_tokens();
+
+// Tokens of a punctuation character followed by '='
+constexpr std::array<std::optional<TokenType>, 256> make_punct_eq_tokens()
+{
+    std::array<std::optional<TokenType>, 256> tokens{};
+    tokens['='] = TokenType::eq_eq;
+    tokens['!'] = TokenType::bang_eq;
+    tokens['<'] = TokenType::lt_eq;
+    tokens['>'] = TokenType::gt_eq;
+    return tokens;
+}
+
+constexpr std::array<std::optional<TokenType>, 256> punct_eq_tokens = make_punct_eq_tokens();
+
 class Tokenizer
 {
 public:
-    explicit Tokenizer(const std::string &src)
-        : m_src(std::move(src))
-    // std::mov takes the rvalue and transfers the contents
-    // of the string from src to m_src. instead of doing a simple
-    //  operation which would be expensive as it would involve copy operation
+    // src is not copied and has to outlive the tokenizer
+    Tokenizer(const std::string_view src, Interner &interner, const ScanIsa isa = detect_scan_isa())
+        : m_src(src),
+          m_interner(interner),
+          m_scanner(scanner(isa))
     {
     }
 
+    // Lexes the whole remaining source at once
     std::vector<Token> tokenize()
     {
-        std::string buf;
         std::vector<Token> tokens;
-        while (peek().has_value())
+        // Rough estimate of the token density, saves most of the regrowth
+        tokens.reserve(static_cast<size_t>(m_end - m_pos) / 8);
+        while (std::optional<Token> token = next())
         {
-            if (std::isalpha(peek().value()))
+            tokens.push_back(std::move(token.value()));
+        }
+        return tokens;
+    }
+
+    // Lexes the next token, or returns nullopt at the end of the source
+    std::optional<Token> next()
+    {
+        std::optional<Token> token = lex();
+        m_token_count += token.has_value();
+        return token;
+    }
+
+    // Tokens returned so far
+    [[nodiscard]] size_t token_count() const
+    {
+        return m_token_count;
+    }
+
+private:
+    std::optional<Token> lex()
+    {
+        const char *pos = m_pos;
+        const char *const end = m_end;
+        while ((pos = m_scanner.skip_space(pos, end)) != end)
+        {
+            switch (char_class(*pos))
             {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isalnum(peek().value()))
-                {
-                    buf.push_back(consume());
-                }
-                if (buf == "exit")
-                {
-                    tokens.push_back({.type = TokenType::exit});
-                    buf.clear();
-                    continue;
-                }
-                else if (buf == "let")
+            case CharClass::alpha:
+            {
+                const char *const word_end = m_scanner.skip_alnum(pos + 1, end);
+                const std::string_view word(pos, word_end - pos);
+                m_pos = word_end;
+                if (const std::optional<TokenType> keyword = lookup_keyword(word))
                 {
-                    tokens.push_back({.type = TokenType::let});
-                    buf.clear();
-                    continue;
+                    return Token{.type = keyword.value()};
                 }
-                else if (buf == "if")
+                return Token{.type = TokenType::ident, .symbol = m_interner.intern(word)};
+            }
+            case CharClass::digit:
+            {
+                const char *const digits_end = m_scanner.skip_digits(pos + 1, end);
+                m_pos = digits_end;
+                uint64_t value = 0;
+                for (; pos != digits_end; pos++)
                 {
-                    tokens.push_back({.type = TokenType::if_});
-                    buf.clear();
-                    continue;
+                    value = value * 10 + static_cast<uint64_t>(*pos - '0');
                 }
-                else if (buf == "elif")
+                return Token{.type = TokenType::int_lit, .int_value = value};
+            }
+            case CharClass::slash:
+                if (pos + 1 != end && pos[1] == '/')
                 {
-                    tokens.push_back({.type = TokenType::elif});
-                    buf.clear();
-                    continue;
+                    pos = m_scanner.skip_line(pos + 2, end);
                 }
-                else if (buf == "else")
+                else if (pos + 1 != end && pos[1] == '*')
                 {
-                    tokens.push_back({.type = TokenType::else_});
-                    buf.clear();
-                    continue;
+                    // An unterminated comment runs to the end of the file
+                    pos = m_scanner.skip_block_comment(pos + 2, end);
+                    pos = pos == end ? end : pos + 2;
                 }
-
                 else
                 {
-                    tokens.push_back({.type = TokenType::ident, .value = buf});
-                    buf.clear();
-                    continue;
+                    m_pos = pos + 1;
+                    return Token{.type = TokenType::div};
                 }
-            }
-            else if (std::isdigit(peek().value()))
+                break;
+            case CharClass::punct:
             {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isdigit(peek().value()))
+                const auto c = static_cast<unsigned char>(*pos);
+                if (pos + 1 != end && pos[1] == '=' && punct_eq_tokens[c].has_value())
                 {
-                    buf.push_back(consume());
+                    m_pos = pos + 2;
+                    return Token{.type = punct_eq_tokens[c].value()};
                 }
-                tokens.push_back({.type = TokenType::int_lit, .value = buf});
-                buf.clear();
-                continue;
-            }
-            else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '/')
-            {
-                consume();
-                consume();
-                while (peek().has_value() && peek().value() != '\n')
-                {
-                    consume();
-                }
-            }
-            else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '*')
-            {
-                consume();
-                consume();
-                while (peek().has_value())
+                // A '!' is only valid in front of '='
+                if (punct_tokens[c].has_value())
                 {
-                    if (peek().has_value() && peek().value() == '*' && peek(1).has_value() && peek(1).value() == '/')
-                        break;
-                    consume();
+                    m_pos = pos + 1;
+                    return Token{.type = punct_tokens[c].value()};
                 }
-                if (peek().has_value())
-                {
-                    consume();
-                }
-                if (peek().has_value())
-                {
-                    consume();
-                }
-            }
-            else if (peek().value() == '(')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::open_paren});
-                continue;
-            }
-            else if (peek().value() == ')')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::close_paren});
-                continue;
-            }
-            else if (peek().value() == ';')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::semi});
-                continue;
-            }
-            else if (peek().value() == '=')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::eq});
-                continue;
+                throw CompileError("you messed up!");
             }
-            else if (std::isspace(peek().value()))
-            {
-                consume();
-                continue;
-            }
-            else if (peek().value() == '+')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::plus});
-                continue;
-            }
-            else if (peek().value() == '*')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::star});
-                continue;
-            }
-            else if (peek().value() == '-')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::sub});
-                continue;
-            }
-            else if (peek().value() == '/')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::div});
-                continue;
-            }
-            else if (peek().value() == '{')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::open_curly});
-                continue;
-            }
-            else if (peek().value() == '}')
-            {
-                consume();
-                tokens.push_back({.type = TokenType::close_curly});
-                continue;
-            }
-            else
-            {
+            case CharClass::space:
+            case CharClass::invalid:
                 // std::cout << "(unrecognized token)" << std::endl;
-                std::cerr << "you messed up!" << std::endl;
-                exit(EXIT_FAILURE);
-                // std::terminate();
+                throw CompileError("you messed up!");
             }
         }
-        m_index = 0;
-        return tokens;
-    }
-
-private:
-    [[nodiscard]] std::optional<char> peek(int offset = 0) const
-    {
-        if (m_index + offset >= m_src.length())
-        {
-            return {};
-        }
-        return m_src.at(m_index + offset);
+        m_pos = end;
+        return {};
     }
 
-    char consume()
-    {
-        return m_src.at(m_index++);
-    }
-    const std::string m_src;
-    int m_index = 0;
+    const std::string_view m_src;
+    Interner &m_interner;
+    const Scanner &m_scanner;
+    const char *m_pos = m_src.data();
+    const char *const m_end = m_src.data() + m_src.size();
+    size_t m_token_count = 0;
 };
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "./output_buffer.hpp"
+
+// General purpose registers, listed in their hardware encoding order
+enum class Reg : uint8_t
+{
+    rax,
+    rcx,
+    rdx,
+    rbx,
+    rsp,
+    rbp,
+    rsi,
+    rdi,
+    r8,
+    r9,
+    r10,
+    r11,
+    r12,
+    r13,
+    r14,
+    r15
+};
+
+inline std::string_view reg_name(const Reg reg)
+{
+    static constexpr std::array<std::string_view, 16> names{
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+    return names[static_cast<size_t>(reg)];
+}
+
+// Low byte of reg, which setcc writes
+inline std::string_view byte_reg_name(const Reg reg)
+{
+    static constexpr std::array<std::string_view, 16> names{
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+    return names[static_cast<size_t>(reg)];
+}
+
+enum class Op : uint8_t
+{
+    label,
+    mov,
+    movzx,
+    lea,
+    push,
+    pop,
+    add,
+    sub,
+    imul,
+    mul,
+    div,
+    shl,
+    shr,
+    xor_,
+    test,
+    cmp,
+    jmp,
+    // Conditional jumps and setcc, the comparisons are unsigned
+    jz,
+    jnz,
+    jb,
+    jae,
+    jbe,
+    ja,
+    setz,
+    setnz,
+    setb,
+    setae,
+    setbe,
+    seta,
+    syscall,
+    ret,
+    ud2,
+    // SSE2 on xmm registers and, on ymm registers, the AVX2 form taking the
+    // destination as first source. The lanes are 64 bits.
+    movq,       // between the low lane and a general purpose register or memory
+    movdqu,     // unaligned load, store or copy of a whole register
+    paddq,
+    psubq,
+    pmuludq,    // the low 32 bits of each lane multiplied to 64
+    psllq,      // by an immediate
+    psrlq,
+    punpcklqdq, // of a register with itself copies the low lane to the high one
+    vpbroadcastq, // the low lane of an xmm register to every lane of a ymm register
+    vzeroupper  // after ymm code, before SSE code runs again
+};
+
+inline std::string_view op_name(const Op op)
+{
+    static constexpr std::array<std::string_view, 42> names{
+        "", "mov", "movzx", "lea", "push", "pop", "add", "sub", "imul", "mul", "div", "shl", "shr", "xor", "test", "cmp",
+        "jmp", "jz", "jnz", "jb", "jae", "jbe", "ja", "setz", "setnz", "setb", "setae", "setbe", "seta", "syscall", "ret",
+        "ud2", "movq", "movdqu", "paddq", "psubq", "pmuludq", "psllq", "psrlq", "punpcklqdq", "vpbroadcastq", "vzeroupper"};
+    return names[static_cast<size_t>(op)];
+}
+
+[[nodiscard]] constexpr bool is_vector(const Op op)
+{
+    return op >= Op::movq;
+}
+
+[[nodiscard]] constexpr bool is_conditional_jump(const Op op)
+{
+    return op >= Op::jz && op <= Op::ja;
+}
+
+[[nodiscard]] constexpr bool is_setcc(const Op op)
+{
+    return op >= Op::setz && op <= Op::seta;
+}
+
+// The condition a conditional jump or setcc tests, as encoded in its opcode
+[[nodiscard]] constexpr uint8_t condition_code(const Op op)
+{
+    switch (op)
+    {
+    case Op::jb:
+    case Op::setb:
+        return 0x2;
+    case Op::jae:
+    case Op::setae:
+        return 0x3;
+    case Op::jz:
+    case Op::setz:
+        return 0x4;
+    case Op::jnz:
+    case Op::setnz:
+        return 0x5;
+    case Op::jbe:
+    case Op::setbe:
+        return 0x6;
+    case Op::ja:
+    case Op::seta:
+        return 0x7;
+    default:
+        return 0;
+    }
+}
+
+// The setcc testing the condition of jcc
+[[nodiscard]] constexpr Op setcc_of(const Op jcc)
+{
+    return static_cast<Op>(static_cast<uint8_t>(jcc) - static_cast<uint8_t>(Op::jz) + static_cast<uint8_t>(Op::setz));
+}
+
+// The conditional jump taken exactly when jcc is not
+[[nodiscard]] constexpr Op negate_jump(const Op jcc)
+{
+    switch (jcc)
+    {
+    case Op::jz:
+        return Op::jnz;
+    case Op::jnz:
+        return Op::jz;
+    case Op::jb:
+        return Op::jae;
+    case Op::jae:
+        return Op::jb;
+    case Op::jbe:
+        return Op::ja;
+    case Op::ja:
+    default:
+        return Op::jbe;
+    }
+}
+
+struct Operand
+{
+    enum class Kind : uint8_t
+    {
+        none,
+        reg,
+        imm,
+        mem,     // QWORD [reg + value], plus index * scale when scale is not 0
+        address, // reg + index * scale + value, computed by lea
+        label,
+        xmm, // the vector registers, by their number in reg
+        ymm
+    };
+
+    Kind kind = Kind::none;
+    Reg reg = Reg::rax;
+    Reg index = Reg::rax;
+    uint8_t scale = 0; // 1, 2, 4 or 8, 0 for no index
+    uint64_t value = 0;
+
+    static Operand from_reg(const Reg reg)
+    {
+        return {.kind = Kind::reg, .reg = reg};
+    }
+    static Operand from_imm(const uint64_t value)
+    {
+        return {.kind = Kind::imm, .value = value};
+    }
+    static Operand from_mem(const Reg base, const uint64_t disp)
+    {
+        return {.kind = Kind::mem, .reg = base, .value = disp};
+    }
+    static Operand from_mem(const Reg base, const Reg index, const uint8_t scale, const uint64_t disp)
+    {
+        return {.kind = Kind::mem, .reg = base, .index = index, .scale = scale, .value = disp};
+    }
+    static Operand from_address(const Reg base, const Reg index, const uint8_t scale)
+    {
+        return {.kind = Kind::address, .reg = base, .index = index, .scale = scale};
+    }
+    static Operand from_label(const size_t label)
+    {
+        return {.kind = Kind::label, .value = label};
+    }
+    // An xmm register, or the ymm register with the same number when wide
+    static Operand from_vector(const uint8_t number, const bool wide = false)
+    {
+        return {.kind = wide ? Kind::ymm : Kind::xmm, .reg = static_cast<Reg>(number)};
+    }
+
+    [[nodiscard]] bool is_vector() const
+    {
+        return kind == Kind::xmm || kind == Kind::ymm;
+    }
+
+    [[nodiscard]] bool is_indexed() const
+    {
+        return kind == Kind::address || (kind == Kind::mem && scale != 0);
+    }
+
+    [[nodiscard]] bool is_reg(const Reg other) const
+    {
+        return kind == Kind::reg && reg == other;
+    }
+
+    bool operator==(const Operand &) const = default;
+};
+
+struct Instr
+{
+    Op op;
+    Operand dst{};
+    Operand src{};
+
+    bool operator==(const Instr &) const = default;
+};
+
+// Memory operands get their QWORD unless sized is false, for the vector
+// instructions accessing whole registers
+inline void append_operand(OutputBuffer &output, const Operand &operand, const bool sized = true)
+{
+    switch (operand.kind)
+    {
+    case Operand::Kind::none:
+        break;
+    case Operand::Kind::reg:
+        output.append(reg_name(operand.reg));
+        break;
+    case Operand::Kind::imm:
+        output.append_uint(operand.value);
+        break;
+    case Operand::Kind::mem:
+        output.append(sized ? "QWORD [" : "[").append(reg_name(operand.reg));
+        if (operand.scale != 0)
+        {
+            output.append(" + ").append(reg_name(operand.index)).append(" * ").append_uint(operand.scale);
+        }
+        output.append(" + ").append_uint(operand.value).append(']');
+        break;
+    case Operand::Kind::address:
+        output.append('[').append(reg_name(operand.reg)).append(" + ").append(reg_name(operand.index)).append(" * ");
+        output.append_uint(operand.scale).append(" + ").append_uint(operand.value).append(']');
+        break;
+    case Operand::Kind::label:
+        output.append("label").append_uint(operand.value);
+        break;
+    case Operand::Kind::xmm:
+        output.append("xmm").append_uint(static_cast<uint64_t>(operand.reg));
+        break;
+    case Operand::Kind::ymm:
+        output.append("ymm").append_uint(static_cast<uint64_t>(operand.reg));
+        break;
+    }
+}
+
+// The AVX2 form of a vector instruction on ymm registers, which nasm wants
+// with the v prefix and, for the arithmetic, the destination repeated as
+// first source
+inline void append_vex(OutputBuffer &output, const Instr &instr)
+{
+    output.append("    v").append(op_name(instr.op)).append(' ');
+    append_operand(output, instr.dst, false);
+    if (instr.op != Op::movdqu)
+    {
+        output.append(", ");
+        append_operand(output, instr.dst, false);
+    }
+    output.append(", ");
+    append_operand(output, instr.src, false);
+    output.append('\n');
+}
+
+// Renders instrs as nasm source at the end of output
+inline void append_asm(OutputBuffer &output, const std::vector<Instr> &instrs)
+{
+    // Most lines are shorter than this, so the buffer is sized once
+    constexpr size_t line_estimate = 24;
+    output.reserve(output.size() + instrs.size() * line_estimate + 32);
+    output.append("global _start\n_start:\n");
+    for (const Instr &instr : instrs)
+    {
+        if (instr.op == Op::label)
+        {
+            append_operand(output, instr.dst);
+            output.append(":\n");
+            continue;
+        }
+        const bool wide = instr.dst.kind == Operand::Kind::ymm || instr.src.kind == Operand::Kind::ymm;
+        if (wide && instr.op != Op::vpbroadcastq)
+        {
+            append_vex(output, instr);
+            continue;
+        }
+        const bool sized = !is_vector(instr.op) || instr.op == Op::movq;
+        output.append("    ").append(op_name(instr.op));
+        if (is_setcc(instr.op))
+        {
+            output.append(' ').append(byte_reg_name(instr.dst.reg));
+        }
+        else if (instr.dst.kind != Operand::Kind::none)
+        {
+            output.append(' ');
+            append_operand(output, instr.dst, sized);
+        }
+        if (instr.op == Op::movzx)
+        {
+            output.append(", ").append(byte_reg_name(instr.src.reg));
+        }
+        else if (instr.src.kind != Operand::Kind::none)
+        {
+            output.append(", ");
+            append_operand(output, instr.src, sized);
+        }
+        output.append('\n');
+    }
+}
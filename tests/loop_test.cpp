@@ -0,0 +1,156 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../src/driver.hpp"
+
+// Checks the assembly of while loops: the bottom test is the only branch of
+// an iteration, jumping back to the top of the body, and the loop variables
+// are updated in place instead of being copied on the back edge.
+
+namespace
+{
+    struct Case
+    {
+        std::string_view name;
+        std::string_view source;
+        int status;
+    };
+
+    constexpr Case cases[] = {
+        {"counter", "let i = 0;\nlet a = 0;\nwhile (i < 10) {\n    a = a + 3;\n    i = i + 1;\n}\nexit(a);\n", 30},
+        {"nested", "let i = 0;\nlet s = 0;\nwhile (i < 5) {\n    let j = 0;\n    while (j < i) {\n        s = s + j;\n"
+                   "        j = j + 1;\n    }\n    i = i + 1;\n}\nexit(s);\n",
+         10},
+    };
+
+    bool is_jump(const std::string_view line)
+    {
+        return line.starts_with("    j");
+    }
+
+    // Whether the line copies one register into another
+    bool is_register_copy(const std::string_view line)
+    {
+        if (!line.starts_with("    mov "))
+        {
+            return false;
+        }
+        const std::string_view operands = line.substr(8);
+        const size_t comma = operands.find(", ");
+        return comma != std::string_view::npos && operands.find('[') == std::string_view::npos &&
+               !std::isdigit(static_cast<unsigned char>(operands[comma + 2]));
+    }
+
+    // The label a backward conditional jump at `line` goes to, or 0
+    size_t loop_top(const std::vector<std::string> &lines, const size_t line)
+    {
+        if (!is_jump(lines[line]) || lines[line].starts_with("    jmp"))
+        {
+            return 0;
+        }
+        const std::string target = lines[line].substr(lines[line].rfind(' ') + 1) + ":";
+        for (size_t top = line; top-- > 0;)
+        {
+            if (lines[top] == target)
+            {
+                return top;
+            }
+        }
+        return 0;
+    }
+
+    // Every innermost loop has to be straight-line code closed by its bottom
+    // test: no other jump or label and no copies between the jcc and its target
+    std::vector<std::string> check_loops(const std::vector<std::string> &lines)
+    {
+        std::vector<std::string> problems;
+        size_t loops = 0;
+        for (size_t i = 0; i < lines.size(); i++)
+        {
+            const size_t top = loop_top(lines, i);
+            bool innermost = top != 0;
+            for (size_t j = top + 1; innermost && j < i; j++)
+            {
+                innermost = loop_top(lines, j) == 0;
+            }
+            if (!innermost)
+            {
+                continue;
+            }
+            loops++;
+            for (size_t j = top + 1; j < i; j++)
+            {
+                if (is_jump(lines[j]) || lines[j].ends_with(":") || is_register_copy(lines[j]))
+                {
+                    problems.push_back("loop at " + lines[top] + " contains `" + lines[j] + "`");
+                }
+            }
+        }
+        if (loops == 0)
+        {
+            problems.emplace_back("no loop ends in a conditional jump back to its top");
+        }
+        return problems;
+    }
+
+    int spawn_status(const std::string &path)
+    {
+        const int status = std::system(path.c_str());
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+}
+
+int main()
+{
+    const std::filesystem::path dir = std::filesystem::temp_directory_path() / ("hydro_loop_test." + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+    bool failed = false;
+    Compiler compiler;
+    for (const Case &test : cases)
+    {
+        const std::string path = (dir / test.name).string();
+        const CompileJob job{.input = path + ".hy", .output = path, .asm_output = path + ".asm", .ir_output = path + ".ir"};
+        std::ofstream(job.input) << test.source;
+        CompileOptions options;
+        options.emit_asm = true;
+        std::ostringstream discarded;
+        std::vector<std::string> problems;
+        try
+        {
+            compiler.compile(job, options, discarded, discarded);
+            std::ifstream assembly(job.asm_output);
+            std::vector<std::string> lines;
+            for (std::string line; std::getline(assembly, line);)
+            {
+                lines.push_back(line);
+            }
+            problems = check_loops(lines);
+            const int status = spawn_status(job.output);
+            if (status != test.status)
+            {
+                problems.push_back("exits with " + std::to_string(status) + " instead of " + std::to_string(test.status));
+            }
+        }
+        catch (const CompileError &error)
+        {
+            problems.emplace_back(error.what());
+        }
+        for (const std::string &problem : problems)
+        {
+            std::cout << "FAIL " << test.name << ": " << problem << std::endl;
+        }
+        failed = failed || !problems.empty();
+    }
+    std::filesystem::remove_all(dir);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}